@@ -10,54 +10,68 @@
  *   Arrow keys  - Pan around
  *   R           - Reset to default view
  *   +/-         - Increase/decrease max iterations
+ *   H           - Toggle GPU / host SIMD renderer
  *   Q/Escape    - Quit
+ *
+ * Poster mode (no window, streams a huge image to disk tile by tile):
+ *   ./cuda_mandelbrot --poster out.png --width 32768 \
+ *       --center -0.7436438870 0.1318259043 --zoom 1.64e+05 --iter 2000
+ *   Options: --width W, --height H, --center X Y, --zoom Z, --iter N, --color C
+ *
+ * Zoom video (no window, one image per frame):
+ *   ./cuda_mandelbrot --video frames/zoom_%05d.png --keyframes keys.txt --frames 90
+ *   keys.txt holds "cx cy zoom iter" per line, or lines pasted from the
+ *   explorer's "Center: (...) Zoom: ... Iter: ..." output. --frames sets the
+ *   frames between consecutive keyframes; --width/--height set frame size.
+ *
+ *   --cpu renders with the multithreaded host SIMD path (also for the explorer).
+ *   Building with -DCPU_ONLY (make cuda_mandelbrot_cpu) needs no CUDA at all.
+ *   Center/zoom/iter are the values printed when clicking in the explorer.
+ *   A .png extension writes deflate-compressed PNG, anything else binary PPM.
  */
 
+#ifndef CPU_ONLY
 #include <cuda_runtime.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <sys/time.h>
 #include <math.h>
+#include <zlib.h>
+#include <float.h>
+#include <pthread.h>
+#include "host_threads.h"
+
+#ifdef CPU_ONLY
+// Host-only build (make cuda_mandelbrot_cpu): no CUDA toolkit required.
+// Shared __host__ __device__ code compiles as plain C++ and the pinned
+// allocations used by the host paths fall back to malloc.
+#define __host__
+#define __device__
+template <typename T> static int cudaMallocHost(T** p, size_t n) {
+    *p = (T*)malloc(n);
+    return *p == NULL;
+}
+static int cudaFreeHost(void* p) { free(p); return 0; }
+#endif
 
 #define WIDTH 800
 #define HEIGHT 600
 
-// Mandelbrot calculation kernel
-__global__ void mandelbrotKernel(unsigned char* pixels, int width, int height,
-                                  double centerX, double centerY, double zoom,
-                                  int maxIter, float colorOffset) {
-    int px = blockIdx.x * blockDim.x + threadIdx.x;
-    int py = blockIdx.y * blockDim.y + threadIdx.y;
-
-    if (px >= width || py >= height) return;
-
-    // Map pixel to complex plane
-    double x0 = centerX + (px - width / 2.0) / zoom;
-    double y0 = centerY + (py - height / 2.0) / zoom;
-
-    double x = 0.0;
-    double y = 0.0;
-    int iter = 0;
-
-    // Mandelbrot iteration: z = z^2 + c
-    while (x*x + y*y <= 4.0 && iter < maxIter) {
-        double xtemp = x*x - y*y + x0;
-        y = 2.0*x*y + y0;
-        x = xtemp;
-        iter++;
-    }
-
-    int idx = (py * width + px) * 4;
-
+// Smooth colouring from the final orbit point and escape count, writes BGRA.
+// Shared by the GPU kernels and the host SIMD renderer so both match.
+__host__ __device__ void colorMandelbrot(unsigned char* out, double x, double y,
+                                         int iter, int maxIter, float colorOffset) {
     if (iter == maxIter) {
         // Inside the set - black
-        pixels[idx + 0] = 0;
-        pixels[idx + 1] = 0;
-        pixels[idx + 2] = 0;
+        out[0] = 0;
+        out[1] = 0;
+        out[2] = 0;
     } else {
         // Outside - color based on escape time
         // Smooth coloring using continuous potential
@@ -92,11 +106,417 @@ __global__ void mandelbrotKernel(unsigned char* pixels, int width, int height,
             r = 1.0f - s; g = 0.0f; b = 1.0f - s;
         }
 
-        pixels[idx + 0] = (unsigned char)(b * 255);
-        pixels[idx + 1] = (unsigned char)(g * 255);
-        pixels[idx + 2] = (unsigned char)(r * 255);
+        out[0] = (unsigned char)(b * 255);
+        out[1] = (unsigned char)(g * 255);
+        out[2] = (unsigned char)(r * 255);
+    }
+    out[3] = 255;
+}
+
+#ifndef CPU_ONLY
+// Escape-time iteration and smooth colouring for one point, writes BGRA
+__device__ void shadeMandelbrot(unsigned char* out, double x0, double y0,
+                                int maxIter, float colorOffset) {
+    double x = 0.0;
+    double y = 0.0;
+    int iter = 0;
+
+    // Mandelbrot iteration: z = z^2 + c
+    while (x*x + y*y <= 4.0 && iter < maxIter) {
+        double xtemp = x*x - y*y + x0;
+        y = 2.0*x*y + y0;
+        x = xtemp;
+        iter++;
     }
-    pixels[idx + 3] = 255;
+
+    colorMandelbrot(out, x, y, iter, maxIter, colorOffset);
+}
+
+// Mandelbrot calculation kernel
+__global__ void mandelbrotKernel(unsigned char* pixels, int width, int height,
+                                  double centerX, double centerY, double zoom,
+                                  int maxIter, float colorOffset) {
+    int px = blockIdx.x * blockDim.x + threadIdx.x;
+    int py = blockIdx.y * blockDim.y + threadIdx.y;
+
+    if (px >= width || py >= height) return;
+
+    // Map pixel to complex plane
+    double x0 = centerX + (px - width / 2.0) / zoom;
+    double y0 = centerY + (py - height / 2.0) / zoom;
+
+    shadeMandelbrot(&pixels[(py * width + px) * 4], x0, y0, maxIter, colorOffset);
+}
+
+// Poster tile kernel: renders a tileW x tileH window at (originX, originY) of a
+// much larger imageW x imageH picture into a band buffer with row pitch 'pitch'
+__global__ void mandelbrotTileKernel(unsigned char* band, int pitch,
+                                     int tileW, int tileH,
+                                     int originX, int originY,
+                                     int imageW, int imageH,
+                                     double centerX, double centerY, double zoom,
+                                     int maxIter, float colorOffset) {
+    int tx = blockIdx.x * blockDim.x + threadIdx.x;
+    int ty = blockIdx.y * blockDim.y + threadIdx.y;
+
+    if (tx >= tileW || ty >= tileH) return;
+
+    double x0 = centerX + (originX + tx - imageW / 2.0) / zoom;
+    double y0 = centerY + (originY + ty - imageH / 2.0) / zoom;
+
+    shadeMandelbrot(&band[ty * pitch + (size_t)(originX + tx) * 4], x0, y0,
+                    maxIter, colorOffset);
+}
+
+// Zoom-video kernel. Same image as mandelbrotKernel, but also stores the
+// escape count of every pixel so the next frame can reuse it. Each pixel is
+// mapped back into the previous frame (scaled by the zoom step); when it lands
+// in a 3x3 neighbourhood that was entirely interior there, it is iterated with
+// Brent periodicity detection, which settles most interior points in a few
+// hundred steps instead of running all maxIter. The guess only selects the
+// loop; the escape test is unchanged. An orbit returning within periodEps
+// (videoPeriodEps) of a saved point is taken as interior. That is a
+// heuristic, not a proof: a boundary point escaping very slowly could
+// pass, so the tolerance is kept a thousandth of a pixel at every zoom.
+__global__ void mandelbrotVideoKernel(unsigned char* pixels, int* iters,
+                                      const int* prevIters, int* stats,
+                                      int width, int height,
+                                      double centerX, double centerY, double zoom,
+                                      int maxIter, float colorOffset,
+                                      double prevCenterX, double prevCenterY,
+                                      double prevZoom, int prevMaxIter, double periodEps) {
+    int px = blockIdx.x * blockDim.x + threadIdx.x;
+    int py = blockIdx.y * blockDim.y + threadIdx.y;
+    int valid = px < width && py < height;
+
+    double x0 = centerX + (px - width / 2.0) / zoom;
+    double y0 = centerY + (py - height / 2.0) / zoom;
+
+    int guessInterior = 0;
+    if (valid && prevIters) {
+        int qx = (int)floor((x0 - prevCenterX) * prevZoom + width / 2.0);
+        int qy = (int)floor((y0 - prevCenterY) * prevZoom + height / 2.0);
+        if (qx >= 1 && qy >= 1 && qx < width - 1 && qy < height - 1) {
+            guessInterior = 1;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (prevIters[(qy + dy) * width + qx + dx] < prevMaxIter) {
+                        guessInterior = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    double x = 0.0;
+    double y = 0.0;
+    int iter = 0;
+    int periodic = 0;
+
+    if (valid && guessInterior) {
+        // Brent: compare against a saved orbit point, re-saved at powers of 2
+        double sx = 0.0, sy = 0.0;
+        int check = 1, since = 0;
+        while (x*x + y*y <= 4.0 && iter < maxIter) {
+            double xtemp = x*x - y*y + x0;
+            y = 2.0*x*y + y0;
+            x = xtemp;
+            iter++;
+
+            if (fabs(x - sx) < periodEps && fabs(y - sy) < periodEps) {
+                iter = maxIter;
+                periodic = 1;
+                break;
+            }
+            if (++since == check) {
+                sx = x; sy = y;
+                since = 0;
+                check <<= 1;
+            }
+        }
+    } else if (valid) {
+        while (x*x + y*y <= 4.0 && iter < maxIter) {
+            double xtemp = x*x - y*y + x0;
+            y = 2.0*x*y + y0;
+            x = xtemp;
+            iter++;
+        }
+    }
+
+    // One atomic per block for the reuse statistics
+    int guessed = __syncthreads_count(guessInterior);
+    int proven = __syncthreads_count(periodic);
+    if (threadIdx.x == 0 && threadIdx.y == 0) {
+        atomicAdd(&stats[0], guessed);
+        atomicAdd(&stats[1], proven);
+    }
+
+    if (!valid) return;
+
+    int idx = py * width + px;
+    iters[idx] = iter;
+    colorMandelbrot(&pixels[idx * 4], x, y, iter, maxIter, colorOffset);
+}
+#endif
+
+#define PERIOD_EPS 1e-13                // Largest periodicity tolerance
+
+// Periodicity tolerance for a view of 'zoom' pixels per unit: PERIOD_EPS,
+// or a thousandth of a pixel once pixels get smaller than that
+double videoPeriodEps(double zoom) {
+    return fmin(PERIOD_EPS, 1e-3 / zoom);
+}
+
+// ============== HOST SIMD RENDERER ==============
+// CPU fallback for mandelbrotKernel/mandelbrotTileKernel. A lane group of
+// pixels from one row is iterated together in GCC vector registers (8 floats
+// or 4 doubles per group, which maps onto AVX on x86 and 2x NEON on the
+// Jetson's Cortex-A57). Escaped lanes are frozen by a per-lane mask so each
+// lane ends with the same orbit point and count as the scalar loop. Pixel
+// coordinates are formed with the kernels' "/ zoom", and the Makefile builds
+// this path with -ffp-contract=off, so double lanes match the scalar loop
+// bit for bit; on the GPU nvcc may fuse multiply-adds and move the last bit.
+// Rows are handed out in small tiles from a shared counter: rows crossing
+// the set interior cost maxIter per pixel while exterior rows escape in a
+// few steps, so static partitioning leaves most threads idle.
+
+#define HOST_ROW_TILE 2                 // Rows claimed per work item
+
+typedef float vfloat8 __attribute__((vector_size(32)));
+typedef int vint8 __attribute__((vector_size(32)));
+typedef double vdouble4 __attribute__((vector_size(32)));
+typedef long long vlong4 __attribute__((vector_size(32)));
+
+// Iterates one lane group; x0/y0 per lane, results written back to x/y/iter.
+// V is the float vector type, M the same-width integer mask type.
+template <typename V, typename M, int LANES>
+static inline void iterateLanes(const V x0, const V y0, int maxIter,
+                                V& xOut, V& yOut, M& iterOut) {
+    V x = {};
+    V y = {};
+    M iter = {};
+    M limit = iter + maxIter;
+    V four = x + 4;
+
+    for (;;) {
+        V x2 = x * x;
+        V y2 = y * y;
+        M active = (x2 + y2 <= four) & (iter < limit);   // -1 where still iterating
+
+        int any = 0;
+        for (int l = 0; l < LANES; l++) any |= (int)active[l];
+        if (!any) break;
+
+        V xn = x2 - y2 + x0;
+        V yn = (x + x) * y + y0;
+        x = active ? xn : x;
+        y = active ? yn : y;
+        iter -= active;
+    }
+
+    xOut = x;
+    yOut = y;
+    iterOut = iter;
+}
+
+struct HostRenderJob {
+    unsigned char* pixels;              // BGRA, 'pitch' bytes per row
+    int pitch;
+    int tileW, tileH;                   // Region to render...
+    int originX, originY;               // ...at this offset in the full image
+    int imageW, imageH;
+    double centerX, centerY, zoom;
+    int maxIter;
+    float colorOffset;
+    int useFloat;                       // 8 float lanes instead of 4 double lanes
+
+    // Zoom video only (iters NULL otherwise): escape counts are stored, and
+    // pixels inside an interior neighbourhood of the previous frame get the
+    // same periodicity check as mandelbrotVideoKernel
+    int* iters;
+    const int* prevIters;               // NULL on the first frame
+    double prevCenterX, prevCenterY, prevZoom;
+    int prevMaxIter;
+    double periodEps;
+    long long guessed, proven;          // Reuse statistics
+
+    int nextRow;                        // Shared work counter
+    int numThreads;
+    pthread_t threads[HOST_MAX_THREADS];
+};
+
+// Scalar escape loop with Brent periodicity detection, the host side of
+// mandelbrotVideoKernel's guessed branch. Same arithmetic as iterateLanes,
+// so a point that is not caught escapes with the same orbit and count
+template <typename S>
+static int iterateBrent(S x0, S y0, int maxIter, S eps, S* xOut, S* yOut, int* periodic) {
+    S x = 0, y = 0, sx = 0, sy = 0;
+    int iter = 0, check = 1, since = 0;
+    *periodic = 0;
+    while (x*x + y*y <= (S)4 && iter < maxIter) {
+        S xn = x*x - y*y + x0;
+        y = (x + x) * y + y0;
+        x = xn;
+        iter++;
+        if (fabs(x - sx) < eps && fabs(y - sy) < eps) {
+            iter = maxIter;
+            *periodic = 1;
+            break;
+        }
+        if (++since == check) {
+            sx = x; sy = y;
+            since = 0;
+            check <<= 1;
+        }
+    }
+    *xOut = x;
+    *yOut = y;
+    return iter;
+}
+
+// Whether (x0, y0) lands in a 3x3 block of the previous frame that was all
+// interior, as in mandelbrotVideoKernel
+static int guessInteriorHost(const HostRenderJob* job, double x0, double y0) {
+    int w = job->imageW, h = job->imageH;
+    int qx = (int)floor((x0 - job->prevCenterX) * job->prevZoom + w / 2.0);
+    int qy = (int)floor((y0 - job->prevCenterY) * job->prevZoom + h / 2.0);
+    if (qx < 1 || qy < 1 || qx >= w - 1 || qy >= h - 1) return 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (job->prevIters[(qy + dy) * w + qx + dx] < job->prevMaxIter) return 0;
+        }
+    }
+    return 1;
+}
+
+template <typename V, typename M, int LANES, typename S>
+static void renderRowsHost(HostRenderJob* job, int ty) {
+    double y0 = job->centerY + (job->originY + ty - job->imageH / 2.0) / job->zoom;
+    unsigned char* row = job->pixels + (size_t)ty * job->pitch;
+
+    int* iterRow = job->iters ? job->iters + (size_t)(job->originY + ty) * job->imageW : NULL;
+    long long guessed = 0, proven = 0;
+
+    for (int tx = 0; tx < job->tileW; tx += LANES) {
+        V vx0 = {}, vy0 = {};
+        int lanes = job->tileW - tx < LANES ? job->tileW - tx : LANES;
+        int guess[LANES] = {};
+        for (int l = 0; l < LANES; l++) {
+            double x0 = job->centerX + (job->originX + tx + l - job->imageW / 2.0) / job->zoom;
+            vx0[l] = (S)x0;
+            vy0[l] = (S)y0;
+            // Guessed lanes run the scalar check below; in the vector they
+            // start outside the set and drop out after one step
+            if (job->prevIters && l < lanes && guessInteriorHost(job, x0, y0)) {
+                guess[l] = 1;
+                vx0[l] = 4;
+            }
+        }
+
+        V x, y;
+        M iter;
+        iterateLanes<V, M, LANES>(vx0, vy0, job->maxIter, x, y, iter);
+
+        for (int l = 0; l < lanes; l++) {
+            S px = x[l], py = y[l];
+            int n = (int)iter[l];
+            if (guess[l]) {
+                int periodic;
+                n = iterateBrent<S>((S)(job->centerX + (job->originX + tx + l -
+                                                        job->imageW / 2.0) / job->zoom),
+                                    (S)y0, job->maxIter, (S)job->periodEps, &px, &py,
+                                    &periodic);
+                guessed++;
+                proven += periodic;
+            }
+            if (iterRow) iterRow[job->originX + tx + l] = n;
+            colorMandelbrot(&row[(size_t)(job->originX + tx + l) * 4],
+                            px, py, n, job->maxIter, job->colorOffset);
+        }
+    }
+
+    if (guessed) {
+        __atomic_fetch_add(&job->guessed, guessed, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->proven, proven, __ATOMIC_RELAXED);
+    }
+}
+
+static void* hostRenderWorker(void* arg) {
+    HostRenderJob* job = (HostRenderJob*)arg;
+
+    for (;;) {
+        int start = __atomic_fetch_add(&job->nextRow, HOST_ROW_TILE, __ATOMIC_RELAXED);
+        if (start >= job->tileH) break;
+        int end = start + HOST_ROW_TILE < job->tileH ? start + HOST_ROW_TILE : job->tileH;
+
+        for (int ty = start; ty < end; ty++) {
+            if (job->useFloat) {
+                renderRowsHost<vfloat8, vint8, 8, float>(job, ty);
+            } else {
+                renderRowsHost<vdouble4, vlong4, 4, double>(job, ty);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Float lanes are only used while a pixel step still spans many float ulps
+// at the view's magnitude; deeper zooms fall back to double lanes
+int hostUseFloat(double centerX, double centerY, double zoom) {
+    double mag = fmax(2.0, fmax(fabs(centerX), fabs(centerY)));
+    return (1.0 / zoom) > 64.0 * FLT_EPSILON * mag;
+}
+
+// Fills in a job for one region without iteration-count reuse
+void hostRenderSetup(HostRenderJob* job, unsigned char* pixels, int pitch,
+                     int tileW, int tileH, int originX, int originY,
+                     int imageW, int imageH,
+                     double centerX, double centerY, double zoom,
+                     int maxIter, float colorOffset) {
+    job->pixels = pixels;
+    job->pitch = pitch;
+    job->tileW = tileW;
+    job->tileH = tileH;
+    job->originX = originX;
+    job->originY = originY;
+    job->imageW = imageW;
+    job->imageH = imageH;
+    job->centerX = centerX;
+    job->centerY = centerY;
+    job->zoom = zoom;
+    job->maxIter = maxIter;
+    job->colorOffset = colorOffset;
+    job->useFloat = hostUseFloat(centerX, centerY, zoom);
+    job->iters = NULL;
+    job->prevIters = NULL;
+    job->guessed = job->proven = 0;
+}
+
+// Starts a prepared job in the background; pair with hostRenderWait()
+void hostRenderLaunch(HostRenderJob* job) {
+    job->nextRow = 0;
+    job->numThreads = hostThreadCount();
+    for (int i = 0; i < job->numThreads; i++) {
+        pthread_create(&job->threads[i], NULL, hostRenderWorker, job);
+    }
+}
+
+// Starts rendering in the background; pair with hostRenderWait()
+void hostRenderStart(HostRenderJob* job, unsigned char* pixels, int pitch,
+                     int tileW, int tileH, int originX, int originY,
+                     int imageW, int imageH,
+                     double centerX, double centerY, double zoom,
+                     int maxIter, float colorOffset) {
+    hostRenderSetup(job, pixels, pitch, tileW, tileH, originX, originY, imageW, imageH,
+                    centerX, centerY, zoom, maxIter, colorOffset);
+    hostRenderLaunch(job);
+}
+
+void hostRenderWait(HostRenderJob* job) {
+    for (int i = 0; i < job->numThreads; i++) {
+        pthread_join(job->threads[i], NULL);
+    }
+    job->numThreads = 0;
 }
 
 double getTime() {
@@ -105,7 +525,630 @@ double getTime() {
     return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-int main() {
+// ============== POSTER RENDERER (BATCH MODE) ==============
+// Renders views far larger than one framebuffer: the picture is produced in
+// full-width bands of rows, each band split into GPU tiles. Two bands are in
+// flight so the GPU computes band N+1 while the host compresses and writes
+// band N. Memory use is bounded by POSTER_BAND_BYTES regardless of image size.
+
+#define POSTER_TILE_W 2048              // Columns per kernel launch (keeps launches short)
+#define POSTER_BAND_BYTES (8 << 20)     // Target size of one BGRA band buffer
+#define PNG_CHUNK_BYTES (256 << 10)     // Deflate output flushed as one IDAT chunk
+
+struct PosterParams {
+    const char* path;
+    int width, height;
+    double centerX, centerY, zoom;      // zoom as printed by the explorer (800 px wide)
+    int maxIter;
+    float colorOffset;
+    int useHost;                        // Render on the CPU instead of the GPU
+    const char* videoPattern;           // Zoom video: printf pattern for frame files
+    const char* keyPath;                // Zoom video: keyframe list
+    int framesPerKey;
+};
+
+// Streaming image writer: PNG (zlib, one IDAT per filled buffer) or binary PPM
+struct ImageWriter {
+    FILE* file;
+    int png;
+    int width;
+    unsigned char* row;                 // Filtered RGB scanline (PNG) or RGB row (PPM)
+    unsigned char* zbuf;
+    z_stream zs;
+    unsigned long long bytesOut;
+};
+
+static void pngWriteU32(unsigned char* p, unsigned int v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void pngWriteChunk(ImageWriter* w, const char* type,
+                          const unsigned char* data, unsigned int len) {
+    unsigned char hdr[8];
+    pngWriteU32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    unsigned long crc = crc32(0L, (const Bytef*)type, 4);
+    if (len) crc = crc32(crc, data, len);
+    unsigned char tail[4];
+    pngWriteU32(tail, (unsigned int)crc);
+
+    fwrite(hdr, 1, 8, w->file);
+    if (len) fwrite(data, 1, len, w->file);
+    fwrite(tail, 1, 4, w->file);
+    w->bytesOut += 12 + len;
+}
+
+// Drain the deflate output buffer into IDAT chunks
+static void pngDeflate(ImageWriter* w, int flush) {
+    do {
+        w->zs.next_out = w->zbuf;
+        w->zs.avail_out = PNG_CHUNK_BYTES;
+        deflate(&w->zs, flush);
+        unsigned int have = PNG_CHUNK_BYTES - w->zs.avail_out;
+        if (have) pngWriteChunk(w, "IDAT", w->zbuf, have);
+    } while (w->zs.avail_out == 0);
+}
+
+int imageWriterOpen(ImageWriter* w, const char* path, int width, int height) {
+    memset(w, 0, sizeof(*w));
+    const char* ext = strrchr(path, '.');
+    w->png = ext && (strcmp(ext, ".png") == 0 || strcmp(ext, ".PNG") == 0);
+    w->width = width;
+
+    w->file = fopen(path, "wb");
+    if (!w->file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return 0;
+    }
+
+    w->row = (unsigned char*)malloc((size_t)width * 3 + 1);
+
+    if (!w->png) {
+        w->bytesOut = fprintf(w->file, "P6\n%d %d\n255\n", width, height);
+        return 1;
+    }
+
+    // Signature + IHDR: 8-bit RGB, no interlace
+    static const unsigned char sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    fwrite(sig, 1, 8, w->file);
+    w->bytesOut = 8;
+
+    unsigned char ihdr[13];
+    pngWriteU32(ihdr, width);
+    pngWriteU32(ihdr + 4, height);
+    ihdr[8] = 8;    // Bit depth
+    ihdr[9] = 2;    // Colour type RGB
+    ihdr[10] = 0;   // Deflate
+    ihdr[11] = 0;   // Adaptive filtering
+    ihdr[12] = 0;   // No interlace
+    pngWriteChunk(w, "IHDR", ihdr, 13);
+
+    // Level 1: fractal bands compress well even at the fastest setting,
+    // and deflate is the bottleneck of the whole pipeline at higher levels
+    w->zbuf = (unsigned char*)malloc(PNG_CHUNK_BYTES);
+    deflateInit(&w->zs, Z_BEST_SPEED);
+    return 1;
+}
+
+// Append 'rows' BGRA scanlines (tightly packed, width*4 bytes each)
+void imageWriterRows(ImageWriter* w, const unsigned char* bgra, int rows) {
+    int width = w->width;
+
+    for (int y = 0; y < rows; y++) {
+        const unsigned char* src = bgra + (size_t)y * width * 4;
+
+        if (!w->png) {
+            unsigned char* dst = w->row;
+            for (int x = 0; x < width; x++) {
+                dst[x * 3 + 0] = src[x * 4 + 2];
+                dst[x * 3 + 1] = src[x * 4 + 1];
+                dst[x * 3 + 2] = src[x * 4 + 0];
+            }
+            fwrite(dst, 1, (size_t)width * 3, w->file);
+            w->bytesOut += (size_t)width * 3;
+            continue;
+        }
+
+        // PNG "Sub" filter: each byte minus the byte one pixel to the left
+        unsigned char* dst = w->row;
+        dst[0] = 1;
+        unsigned char pr = 0, pg = 0, pb = 0;
+        for (int x = 0; x < width; x++) {
+            unsigned char r = src[x * 4 + 2];
+            unsigned char g = src[x * 4 + 1];
+            unsigned char b = src[x * 4 + 0];
+            dst[1 + x * 3 + 0] = r - pr;
+            dst[1 + x * 3 + 1] = g - pg;
+            dst[1 + x * 3 + 2] = b - pb;
+            pr = r; pg = g; pb = b;
+        }
+
+        w->zs.next_in = dst;
+        w->zs.avail_in = (uInt)((size_t)width * 3 + 1);
+        pngDeflate(w, Z_NO_FLUSH);
+    }
+}
+
+int imageWriterClose(ImageWriter* w) {
+    if (w->png) {
+        pngDeflate(w, Z_FINISH);
+        deflateEnd(&w->zs);
+        pngWriteChunk(w, "IEND", NULL, 0);
+        free(w->zbuf);
+    }
+    int ok = !ferror(w->file);
+    fclose(w->file);
+    free(w->row);
+    return ok;
+}
+
+int renderPoster(const PosterParams* p) {
+    int width = p->width;
+    int height = p->height;
+
+    // The explorer's zoom is pixels per unit at 800 px; scale so the poster
+    // covers exactly the same region of the complex plane
+    double zoom = p->zoom * (double)width / WIDTH;
+
+    size_t rowBytes = (size_t)width * 4;
+    int bandRows = (int)(POSTER_BAND_BYTES / rowBytes);
+    if (bandRows < 1) bandRows = 1;
+    if (bandRows > height) bandRows = height;
+    int numBands = (height + bandRows - 1) / bandRows;
+    size_t bandBytes = rowBytes * bandRows;
+
+    printf("Poster: %s\n", p->path);
+    printf("  %d x %d (%.1f Mpixel), %d bands of %d rows, %.1f MB per band\n",
+           width, height, (double)width * height / 1e6, numBands, bandRows,
+           bandBytes / (1024.0 * 1024.0));
+    printf("  Center: (%.10f, %.10f) Zoom: %.2e Iter: %d\n",
+           p->centerX, p->centerY, p->zoom, p->maxIter);
+    if (p->useHost) {
+        printf("  Backend: host, %d threads, %s lanes\n\n", hostThreadCount(),
+               hostUseFloat(p->centerX, p->centerY, zoom) ? "8 float" : "4 double");
+    } else {
+        printf("  Backend: GPU\n\n");
+    }
+
+    ImageWriter writer;
+    if (!imageWriterOpen(&writer, p->path, width, height)) return 1;
+
+    // Double-buffered bands: one being computed (GPU or host worker
+    // threads), one being written
+    unsigned char* h_band[2];
+    HostRenderJob hostJob[2];
+    for (int i = 0; i < 2; i++) {
+        cudaMallocHost(&h_band[i], bandBytes);
+    }
+#ifndef CPU_ONLY
+    unsigned char* d_band[2];
+    cudaStream_t stream[2];
+    for (int i = 0; i < 2 && !p->useHost; i++) {
+        cudaMalloc(&d_band[i], bandBytes);
+        cudaStreamCreate(&stream[i]);
+    }
+
+    dim3 blockSize(16, 16);
+#endif
+    double startTime = getTime();
+    double waitTime = 0.0, writeTime = 0.0;
+
+    for (int band = 0; band <= numBands; band++) {
+        // Queue band N...
+        if (band < numBands) {
+            int slot = band & 1;
+            int rowStart = band * bandRows;
+            int rows = height - rowStart < bandRows ? height - rowStart : bandRows;
+
+            if (p->useHost) {
+                hostRenderStart(&hostJob[slot], h_band[slot], (int)rowBytes,
+                                width, rows, 0, rowStart, width, height,
+                                p->centerX, p->centerY, zoom,
+                                p->maxIter, p->colorOffset);
+            }
+#ifndef CPU_ONLY
+            for (int x = 0; x < width && !p->useHost; x += POSTER_TILE_W) {
+                int tileW = width - x < POSTER_TILE_W ? width - x : POSTER_TILE_W;
+                dim3 gridSize((tileW + blockSize.x - 1) / blockSize.x,
+                              (rows + blockSize.y - 1) / blockSize.y);
+                mandelbrotTileKernel<<<gridSize, blockSize, 0, stream[slot]>>>(
+                    d_band[slot], (int)rowBytes, tileW, rows, x, rowStart,
+                    width, height, p->centerX, p->centerY, zoom,
+                    p->maxIter, p->colorOffset);
+            }
+            if (!p->useHost) {
+                cudaMemcpyAsync(h_band[slot], d_band[slot], rowBytes * rows,
+                                cudaMemcpyDeviceToHost, stream[slot]);
+            }
+#endif
+        }
+
+        // ...while band N-1 is compressed and streamed to disk
+        if (band > 0) {
+            int prev = band - 1;
+            int slot = prev & 1;
+            int rowStart = prev * bandRows;
+            int rows = height - rowStart < bandRows ? height - rowStart : bandRows;
+
+            double t0 = getTime();
+            if (p->useHost) {
+                hostRenderWait(&hostJob[slot]);
+            }
+#ifndef CPU_ONLY
+            else {
+                cudaStreamSynchronize(stream[slot]);
+            }
+#endif
+            double t1 = getTime();
+            imageWriterRows(&writer, h_band[slot], rows);
+            double t2 = getTime();
+            waitTime += t1 - t0;
+            writeTime += t2 - t1;
+
+            double elapsed = t2 - startTime;
+            double done = (double)(rowStart + rows) * width;
+            printf("\r  Band %d/%d  %5.1f%%  %.1f Mpixel/s  %.1f MB written",
+                   band, numBands, 100.0 * (rowStart + rows) / height,
+                   done / elapsed / 1e6, writer.bytesOut / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+    }
+
+    int ok = imageWriterClose(&writer);
+    double total = getTime() - startTime;
+
+    printf("\n\nDone in %.2f s: %.1f Mpixel/s, %.1f MB on disk\n",
+           total, (double)width * height / total / 1e6,
+           writer.bytesOut / (1024.0 * 1024.0));
+    printf("  Waiting on render: %.2f s, compress+write: %.2f s (%s-bound)\n",
+           waitTime, writeTime, waitTime > writeTime ? "render" : "disk");
+
+    for (int i = 0; i < 2; i++) {
+#ifndef CPU_ONLY
+        if (!p->useHost) {
+            cudaStreamDestroy(stream[i]);
+            cudaFree(d_band[i]);
+        }
+#endif
+        cudaFreeHost(h_band[i]);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error writing %s\n", p->path);
+        return 1;
+    }
+    return 0;
+}
+
+// ============== ZOOM VIDEO (BATCH MODE) ==============
+// Renders an image sequence between keyframes. Zoom is interpolated
+// exponentially (constant zoom speed), the center so that it moves at a
+// constant rate on screen, and maxIter linearly in log-zoom.
+
+#define MAX_KEYFRAMES 256
+
+struct Keyframe {
+    double centerX, centerY, zoom;
+    int maxIter;
+};
+
+// One keyframe per line, either "cx cy zoom iter" or a line pasted from the
+// explorer output: "Center: (cx, cy) Zoom: z Iter: n". '#' starts a comment.
+int loadKeyframes(const char* path, Keyframe* keys, int maxKeys) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open keyframe file %s\n", path);
+        return 0;
+    }
+
+    char line[256];
+    int count = 0;
+    while (fgets(line, sizeof(line), f) && count < maxKeys) {
+        Keyframe k;
+        const char* s = line;
+        while (*s == ' ' || *s == '\t') s++;
+        if (*s == '#' || *s == '\n' || *s == 0) continue;
+
+        if (sscanf(s, "Center: (%lf, %lf) Zoom: %lf Iter: %d",
+                   &k.centerX, &k.centerY, &k.zoom, &k.maxIter) == 4 ||
+            sscanf(s, "%lf %lf %lf %d",
+                   &k.centerX, &k.centerY, &k.zoom, &k.maxIter) == 4) {
+            keys[count++] = k;
+        } else {
+            fprintf(stderr, "Skipping keyframe line: %s", line);
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+Keyframe interpolateKeyframes(const Keyframe* a, const Keyframe* b, double t) {
+    Keyframe k;
+    double la = log(a->zoom), lb = log(b->zoom);
+    k.zoom = exp(la + (lb - la) * t);
+
+    // The view width is 1/zoom; moving the center in proportion to the change
+    // in view width keeps on-screen motion uniform while zooming
+    double wa = 1.0 / a->zoom, wb = 1.0 / b->zoom;
+    double f = fabs(wb - wa) > 1e-300 ? (wa - 1.0 / k.zoom) / (wa - wb) : t;
+    k.centerX = a->centerX + (b->centerX - a->centerX) * f;
+    k.centerY = a->centerY + (b->centerY - a->centerY) * f;
+
+    k.maxIter = (int)(a->maxIter + (b->maxIter - a->maxIter) * t + 0.5);
+    return k;
+}
+
+int renderVideo(const PosterParams* p) {
+    static Keyframe keys[MAX_KEYFRAMES];
+    int numKeys = loadKeyframes(p->keyPath, keys, MAX_KEYFRAMES);
+    if (numKeys < 2) {
+        fprintf(stderr, "Need at least 2 keyframes in %s\n", p->keyPath);
+        return 1;
+    }
+
+    int width = p->width;
+    int height = p->height;
+    int numFrames = (numKeys - 1) * p->framesPerKey + 1;
+    size_t frameBytes = (size_t)width * height * 4;
+
+    printf("Zoom video: %s\n", p->videoPattern);
+    printf("  %d x %d, %d keyframes, %d frames\n", width, height, numKeys, numFrames);
+
+    unsigned char* h_frame[2];
+    for (int i = 0; i < 2; i++) {
+        cudaMallocHost(&h_frame[i], frameBytes);
+    }
+    HostRenderJob hostJob[2];
+    hostJob[0].numThreads = hostJob[1].numThreads = 0;
+    // Host escape counts ping-pong like d_iters below
+    int* h_iters[2] = {NULL, NULL};
+    if (p->useHost) {
+        for (int i = 0; i < 2; i++) h_iters[i] = (int*)malloc((size_t)width * height * sizeof(int));
+    }
+    Keyframe hostPrev = keys[0];
+    double hostPrevZoom = 0.0;
+
+#ifndef CPU_ONLY
+    // Pixels double-buffered for the write pipeline; iteration counts
+    // ping-pong so each frame reads the previous one
+    unsigned char* d_frame[2];
+    int* d_iters[2];
+    int* d_stats[2];
+    int* h_stats[2];
+    cudaEvent_t done[2];
+    cudaStream_t stream;
+    if (!p->useHost) {
+        for (int i = 0; i < 2; i++) {
+            cudaMalloc(&d_frame[i], frameBytes);
+            cudaMalloc(&d_iters[i], (size_t)width * height * sizeof(int));
+            cudaMalloc(&d_stats[i], 2 * sizeof(int));
+            cudaMallocHost(&h_stats[i], 2 * sizeof(int));
+            cudaEventCreate(&done[i]);
+        }
+        cudaStreamCreate(&stream);
+    }
+
+    dim3 blockSize(16, 16);
+    dim3 gridSize((width + blockSize.x - 1) / blockSize.x,
+                  (height + blockSize.y - 1) / blockSize.y);
+
+    Keyframe prev = keys[0];
+    double prevZoom = 0.0;
+#endif
+
+    double startTime = getTime();
+    long long guessed = 0, proven = 0;
+    int ok = 1;
+
+    for (int frame = 0; frame <= numFrames; frame++) {
+        // Queue frame N...
+        if (frame < numFrames) {
+            int slot = frame & 1;
+            int seg = frame / p->framesPerKey;
+            if (seg >= numKeys - 1) seg = numKeys - 2;
+            double t = (double)(frame - seg * p->framesPerKey) / p->framesPerKey;
+            Keyframe k = interpolateKeyframes(&keys[seg], &keys[seg + 1], t);
+            double zoom = k.zoom * (double)width / WIDTH;
+
+            if (p->useHost) {
+                // Frame N reads frame N-1's counts, so N-1 must be finished;
+                // its file is still written while N renders
+                if (frame > 0) hostRenderWait(&hostJob[slot ^ 1]);
+                HostRenderJob* job = &hostJob[slot];
+                hostRenderSetup(job, h_frame[slot], width * 4, width, height,
+                                0, 0, width, height, k.centerX, k.centerY, zoom,
+                                k.maxIter, p->colorOffset);
+                job->iters = h_iters[slot];
+                job->prevIters = frame > 0 ? h_iters[slot ^ 1] : NULL;
+                job->prevCenterX = hostPrev.centerX;
+                job->prevCenterY = hostPrev.centerY;
+                job->prevZoom = hostPrevZoom;
+                job->prevMaxIter = hostPrev.maxIter;
+                job->periodEps = videoPeriodEps(zoom);
+                hostRenderLaunch(job);
+                hostPrev = k;
+                hostPrevZoom = zoom;
+            }
+#ifndef CPU_ONLY
+            else {
+                cudaMemsetAsync(d_stats[slot], 0, 2 * sizeof(int), stream);
+                mandelbrotVideoKernel<<<gridSize, blockSize, 0, stream>>>(
+                    d_frame[slot], d_iters[slot], frame > 0 ? d_iters[slot ^ 1] : NULL,
+                    d_stats[slot], width, height, k.centerX, k.centerY, zoom,
+                    k.maxIter, p->colorOffset,
+                    prev.centerX, prev.centerY, prevZoom, prev.maxIter,
+                    videoPeriodEps(zoom));
+                cudaMemcpyAsync(h_frame[slot], d_frame[slot], frameBytes,
+                                cudaMemcpyDeviceToHost, stream);
+                cudaMemcpyAsync(h_stats[slot], d_stats[slot], 2 * sizeof(int),
+                                cudaMemcpyDeviceToHost, stream);
+                cudaEventRecord(done[slot], stream);
+                prev = k;
+                prevZoom = zoom;
+            }
+#endif
+        }
+
+        // ...while frame N-1 is compressed and written
+        if (frame > 0) {
+            int slot = (frame - 1) & 1;
+            if (p->useHost) {
+                hostRenderWait(&hostJob[slot]);
+                guessed += hostJob[slot].guessed;
+                proven += hostJob[slot].proven;
+            }
+#ifndef CPU_ONLY
+            else {
+                cudaEventSynchronize(done[slot]);
+                guessed += h_stats[slot][0];
+                proven += h_stats[slot][1];
+            }
+#endif
+
+            char path[1024];
+            snprintf(path, sizeof(path), p->videoPattern, frame - 1);
+            ImageWriter writer;
+            if (!imageWriterOpen(&writer, path, width, height)) {
+                ok = 0;
+                break;
+            }
+            imageWriterRows(&writer, h_frame[slot], height);
+            ok = imageWriterClose(&writer);
+            if (!ok) {
+                fprintf(stderr, "\nError writing %s\n", path);
+                break;
+            }
+
+            double elapsed = getTime() - startTime;
+            printf("\r  Frame %d/%d  %.1f frames/min", frame, numFrames,
+                   frame / elapsed * 60.0);
+            fflush(stdout);
+        }
+    }
+
+    // Drain work still in flight if the loop stopped early
+    for (int i = 0; i < 2 && p->useHost; i++) {
+        hostRenderWait(&hostJob[i]);
+    }
+#ifndef CPU_ONLY
+    if (!p->useHost) cudaStreamSynchronize(stream);
+#endif
+
+    double total = getTime() - startTime;
+    printf("\n\nDone: %d frames in %.1f s (%.1f frames/min)\n",
+           numFrames, total, numFrames / total * 60.0);
+    printf("  Interior guessed from previous frame: %.1f%% of pixels, "
+           "%.1f%% found periodic early\n",
+           100.0 * guessed / ((double)width * height * numFrames),
+           guessed ? 100.0 * proven / guessed : 0.0);
+
+#ifndef CPU_ONLY
+    if (!p->useHost) {
+        for (int i = 0; i < 2; i++) {
+            cudaFree(d_frame[i]);
+            cudaFree(d_iters[i]);
+            cudaFree(d_stats[i]);
+            cudaFreeHost(h_stats[i]);
+            cudaEventDestroy(done[i]);
+        }
+        cudaStreamDestroy(stream);
+    }
+#endif
+    for (int i = 0; i < 2; i++) {
+        cudaFreeHost(h_frame[i]);
+        free(h_iters[i]);
+    }
+    return ok ? 0 : 1;
+}
+
+// The --video pattern is used as a printf format, so it may hold exactly one
+// integer conversion (%d or %0Nd) and no other '%'
+static int validFramePattern(const char* pattern) {
+    int conversions = 0;
+    for (const char* c = pattern; *c; c++) {
+        if (*c != '%') continue;
+        c++;
+        if (*c == '0') c++;
+        while (*c >= '0' && *c <= '9') c++;
+        if (*c != 'd') return 0;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// Parses --poster / --video options; returns 1 if batch mode was requested
+int parsePosterArgs(int argc, char** argv, PosterParams* p) {
+    p->path = NULL;
+    p->videoPattern = NULL;
+    p->keyPath = NULL;
+    p->framesPerKey = 60;
+    p->width = 0;
+    p->height = 0;
+    p->centerX = -0.5;
+    p->centerY = 0.0;
+    p->zoom = 200.0;
+    p->maxIter = 256;
+    p->colorOffset = 0.0f;
+#ifdef CPU_ONLY
+    p->useHost = 1;
+#else
+    p->useHost = 0;
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--poster") == 0 && i + 1 < argc) {
+            p->path = argv[++i];
+        } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            p->width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+            p->height = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--center") == 0 && i + 2 < argc) {
+            p->centerX = atof(argv[++i]);
+            p->centerY = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+            p->zoom = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--iter") == 0 && i + 1 < argc) {
+            p->maxIter = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--color") == 0 && i + 1 < argc) {
+            p->colorOffset = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc) {
+            p->videoPattern = argv[++i];
+        } else if (strcmp(argv[i], "--keyframes") == 0 && i + 1 < argc) {
+            p->keyPath = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            p->framesPerKey = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            p->useHost = 1;
+        } else {
+            fprintf(stderr, "Unknown or incomplete option: %s\n", argv[i]);
+        }
+    }
+
+    if (p->width <= 0) p->width = p->videoPattern ? 1280 : 16384;
+    if (p->height <= 0) p->height = (int)((double)p->width * HEIGHT / WIDTH);
+    if (p->maxIter < 1) p->maxIter = 1;
+    if (p->framesPerKey < 1) p->framesPerKey = 1;
+
+    if (p->videoPattern && !validFramePattern(p->videoPattern)) {
+        fprintf(stderr, "--video pattern needs exactly one %%d or %%0Nd and no other '%%'\n");
+        p->videoPattern = NULL;
+    } else if (p->videoPattern && !p->keyPath) {
+        fprintf(stderr, "--video needs --keyframes FILE\n");
+        p->videoPattern = NULL;
+    }
+
+    return p->path != NULL || p->videoPattern != NULL;
+}
+
+int main(int argc, char** argv) {
+    PosterParams poster;
+    if (parsePosterArgs(argc, argv, &poster)) {
+        return poster.videoPattern ? renderVideo(&poster) : renderPoster(&poster);
+    }
+
     printf("=== Jetson Nano CUDA Mandelbrot Explorer ===\n\n");
     printf("Controls:\n");
     printf("  Left click   - Zoom in at cursor\n");
@@ -114,12 +1157,23 @@ int main() {
     printf("  +/-          - More/fewer iterations (detail)\n");
     printf("  C            - Cycle colors\n");
     printf("  R            - Reset view\n");
+#ifndef CPU_ONLY
+    printf("  H            - Toggle GPU / host SIMD renderer\n");
+#endif
     printf("  Q/Escape     - Quit\n\n");
 
+    // --cpu (or a CPU_ONLY build) renders with the host SIMD path
+    int useHost = poster.useHost;
+    HostRenderJob hostJob;
+
+#ifndef CPU_ONLY
     // CUDA device info
     cudaDeviceProp prop;
     cudaGetDeviceProperties(&prop, 0);
     printf("GPU: %s\n\n", prop.name);
+#else
+    printf("Host-only build: %d render threads\n\n", hostThreadCount());
+#endif
 
     // Open X11 display
     Display* display = XOpenDisplay(NULL);
@@ -154,10 +1208,14 @@ int main() {
 
     // Allocate memory
     unsigned char* h_pixels;
+#ifndef CPU_ONLY
     unsigned char* d_pixels;
+#endif
 
     cudaMallocHost(&h_pixels, WIDTH * HEIGHT * 4);
+#ifndef CPU_ONLY
     cudaMalloc(&d_pixels, WIDTH * HEIGHT * 4);
+#endif
 
     // Create XImage
     Visual* visual = DefaultVisual(display, screen);
@@ -167,10 +1225,12 @@ int main() {
 
     GC gc = XCreateGC(display, window, 0, NULL);
 
+#ifndef CPU_ONLY
     // CUDA grid configuration
     dim3 blockSize(16, 16);
     dim3 gridSize((WIDTH + blockSize.x - 1) / blockSize.x,
                   (HEIGHT + blockSize.y - 1) / blockSize.y);
+#endif
 
     // Mandelbrot parameters
     double centerX = -0.5;
@@ -232,6 +1292,14 @@ int main() {
                     if (colorOffset > 1.0f) colorOffset -= 1.0f;
                     needsRedraw = 1;
                 }
+
+#ifndef CPU_ONLY
+                if (key == XK_h) {
+                    useHost = !useHost;
+                    needsRedraw = 1;
+                    printf("Renderer: %s\n", useHost ? "host SIMD" : "GPU");
+                }
+#endif
             }
 
             if (event.type == ButtonPress) {
@@ -275,10 +1343,20 @@ int main() {
         if (needsRedraw) {
             double startRender = getTime();
 
-            mandelbrotKernel<<<gridSize, blockSize>>>(d_pixels, WIDTH, HEIGHT,
-                centerX, centerY, zoom, maxIter, colorOffset);
+            if (useHost) {
+                hostRenderStart(&hostJob, h_pixels, WIDTH * 4, WIDTH, HEIGHT,
+                                0, 0, WIDTH, HEIGHT, centerX, centerY, zoom,
+                                maxIter, colorOffset);
+                hostRenderWait(&hostJob);
+            }
+#ifndef CPU_ONLY
+            else {
+                mandelbrotKernel<<<gridSize, blockSize>>>(d_pixels, WIDTH, HEIGHT,
+                    centerX, centerY, zoom, maxIter, colorOffset);
 
-            cudaMemcpy(h_pixels, d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
+                cudaMemcpy(h_pixels, d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
+            }
+#endif
 
             double renderTime = getTime() - startRender;
 
@@ -313,7 +1391,9 @@ cleanup:
     XDestroyWindow(display, window);
     XCloseDisplay(display);
 
+#ifndef CPU_ONLY
     cudaFree(d_pixels);
+#endif
     cudaFreeHost(h_pixels);
 
     printf("Done!\n");
@@ -6,9 +6,16 @@
  *
  * Features:
  *   - Tiled shared-memory acceleration
+ *   - Multithreaded SIMD host version of the direct sum
+ *   - Barnes-Hut tree solver for 100k-1M bodies
+ *   - Fast multipole solver (GPU near field, host far field)
+ *   - Leapfrog and 4th-order Hermite integrators
+ *   - Individual power-of-two block time steps
  *   - Multiple galaxy presets
  *   - Softened gravity (prevents singularities)
- *   - Trail rendering
+ *   - Optional mergers found with a sorted spatial hash grid
+ *   - Multi-process direct sum over TCP (local or networked ranks)
+ *   - HDR Gaussian density splats, tile-binned, with trails
  *   - Interactive camera
  *   - Mass-based coloring
  *
@@ -18,12 +25,47 @@
  *   W/S         - Zoom in/out
  *   +/-         - Adjust time step
  *   T           - Toggle trails
+ *   G           - Toggle HDR density splats / plain points
+ *   M           - Toggle collisions (touching bodies merge)
+ *   B           - Cycle force solver (direct / Barnes-Hut / FMM)
+ *   V           - Check solver accuracy against the direct sum
+ *   [ / ]       - Barnes-Hut opening angle theta
+ *   , / .       - Halve / double body count (up to 1M)
+ *   I           - Cycle integrator (Euler / leapfrog / Hermite)
+ *   H           - Toggle hierarchical block time steps
+ *   E           - Toggle energy / momentum diagnostics
+ *   K / L       - Save / load checkpoint (nbody_checkpoint.nbs)
  *   Space       - Pause/resume
  *   R           - Reset current preset
  *   Q/Escape    - Quit
+ *
+ * Command line:
+ *   --restart FILE      Resume from a checkpoint or trajectory (last frame)
+ *   --trajectory FILE   Stream the state to FILE while running
+ *   --every K           Trajectory frame interval in steps (default 10)
+ *   --diag K            Energy/momentum diagnostics every K steps
+ *   --telemetry FILE    Also write the diagnostics and step times as CSV
+ *   --bench-host N      Time the host SIMD direct sum (SoA and float4 AoS)
+ *                       against the GPU kernel on N bodies, then exit
+ *   --ranks P           Split the direct sum over P processes (forks P-1
+ *                       local workers; rank 0 keeps the window)
+ *   --remote            With --ranks, wait for workers started elsewhere
+ *   --port N            Port rank 0 listens on (default 5923)
+ *   --worker HOST:PORT  Run as a headless worker of rank 0 at HOST:PORT
+ *
+ * Building with -DCPU_ONLY (make cuda_nbody_cpu) needs no CUDA at all and
+ * gives a headless host driver: [--bodies N] [--preset P] [--steps K]
+ * [--dt DT] [--merge] [--solver direct|fmm] or --bench N.
  */
 
+#ifndef CPU_ONLY
 #include <cuda_runtime.h>
+#include <thrust/device_ptr.h>
+#include <thrust/sort.h>
+#include <thrust/scan.h>
+#include <thrust/reduce.h>
+#include <thrust/functional.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,16 +75,67 @@
 #include <X11/keysym.h>
 #include <sys/time.h>
 #include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <vector>
+#include <algorithm>
+#include "host_threads.h"
+#if defined(CPU_ONLY) && defined(__AVX__)
+#define HOST_AVX
+#include <immintrin.h>
+#elif defined(CPU_ONLY) && defined(__ARM_NEON)
+#define HOST_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef CPU_ONLY
+// Host-only build (make cuda_nbody_cpu): no CUDA toolkit required. Only the
+// host solvers, the merger, the presets and a headless driver are compiled;
+// float4 and int2 are the CUDA types they share with the device code.
+#define __host__
+#define __device__
+struct float4 { float x, y, z, w; };
+struct int2 { int x, y; };
+static inline float4 make_float4(float x, float y, float z, float w) {
+    float4 v = { x, y, z, w };
+    return v;
+}
+static inline int2 make_int2(int x, int y) {
+    int2 v = { x, y };
+    return v;
+}
+#endif
 
 #define WIDTH 900
 #define HEIGHT 700
 
 // Simulation parameters
-#define MAX_BODIES 8192
+#define MAX_BODIES (1 << 20)
+#define REFERENCE_BODIES 4096   // Presets keep their total mass above this count
 #define TILE_SIZE 128       // Bodies per shared memory tile
 #define SOFTENING 0.5f      // Softening factor to prevent singularities
 #define G 0.5f              // Gravitational constant
 
+// Force solvers
+#define SOLVER_DIRECT 0     // Tiled all-pairs, O(N^2)
+#define SOLVER_BARNES_HUT 1 // Radix octree + stackless walk, O(N log N)
+#define SOLVER_FMM 2        // Fast multipole method, O(N)
+#define NUM_SOLVERS 3
+
+// Integrators for the global time step (block time steps use leapfrog)
+#define INTEGRATOR_EULER 0      // Symplectic Euler, 1st order
+#define INTEGRATOR_LEAPFROG 1   // Kick-drift-kick, 2nd order
+#define INTEGRATOR_HERMITE 2    // Predictor-corrector with jerk, 4th order
+#define NUM_INTEGRATORS 3
+
 // Body structure (SoA for coalesced memory access)
 struct Bodies {
     float* x;
@@ -55,26 +148,25 @@ struct Bodies {
     int count;
 };
 
+#ifndef CPU_ONLY
 // ============== FORCE COMPUTATION (TILED) ==============
-__global__ void computeForcesKernel(
-    float* ax, float* ay, float* az,
+// Accumulates the acceleration at (myX, myY, myZ) from all n bodies, one
+// shared-memory tile at a time. Every thread of the block must call this
+// (it synchronizes); threads without a target pass valid = 0. The potential
+// (own pair included) goes to outPot if non-NULL; callers passing NULL get
+// the accumulation compiled out once this is inlined.
+__device__ void tiledAcceleration(
+    float myX, float myY, float myZ, int valid,
     const float* px, const float* py, const float* pz,
     const float* mass,
-    int n, float softening2, float grav)
+    int n, float softening2, float grav,
+    float* outX, float* outY, float* outZ, float* outPot)
 {
     // Shared memory tile for body positions and masses
     __shared__ float4 tile[TILE_SIZE];  // x, y, z, mass
 
-    int i = blockIdx.x * blockDim.x + threadIdx.x;
-
     float accx = 0.0f, accy = 0.0f, accz = 0.0f;
-    float myX, myY, myZ;
-
-    if (i < n) {
-        myX = px[i];
-        myY = py[i];
-        myZ = pz[i];
-    }
+    float phi = 0.0f;
 
     // Process all tiles
     int numTiles = (n + TILE_SIZE - 1) / TILE_SIZE;
@@ -90,7 +182,7 @@ __global__ void computeForcesKernel(
         __syncthreads();
 
         // Compute forces from this tile
-        if (i < n) {
+        if (valid) {
             #pragma unroll 8
             for (int k = 0; k < TILE_SIZE; k++) {
                 float dx = tile[k].x - myX;
@@ -101,24 +193,341 @@ __global__ void computeForcesKernel(
                 float invDist = rsqrtf(dist2);
                 float invDist3 = invDist * invDist * invDist;
 
-                float force = G * tile[k].w * invDist3;
+                float force = grav * tile[k].w * invDist3;
 
                 accx += dx * force;
                 accy += dy * force;
                 accz += dz * force;
+                phi -= grav * tile[k].w * invDist;
             }
         }
         __syncthreads();
     }
 
+    *outX = accx;
+    *outY = accy;
+    *outZ = accz;
+    if (outPot) *outPot = phi;
+}
+
+__global__ void computeForcesKernel(
+    float* ax, float* ay, float* az,
+    const float* px, const float* py, const float* pz,
+    const float* mass,
+    int n, float softening2, float grav)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+
+    float myX = 0.0f, myY = 0.0f, myZ = 0.0f;
+    if (i < n) {
+        myX = px[i];
+        myY = py[i];
+        myZ = pz[i];
+    }
+
+    float accx, accy, accz;
+    tiledAcceleration(myX, myY, myZ, i < n, px, py, pz, mass,
+                      n, softening2, grav, &accx, &accy, &accz, NULL);
+
+    if (i < n) {
+        ax[i] = accx;
+        ay[i] = accy;
+        az[i] = accz;
+    }
+}
+
+// Same, plus the potential of each body (diagnostics steps)
+__global__ void computeForcesPotentialKernel(
+    float* ax, float* ay, float* az, float* pot,
+    const float* px, const float* py, const float* pz,
+    const float* mass,
+    int n, float softening2, float grav)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+
+    float myX = 0.0f, myY = 0.0f, myZ = 0.0f;
+    if (i < n) {
+        myX = px[i];
+        myY = py[i];
+        myZ = pz[i];
+    }
+
+    float accx, accy, accz, phi;
+    tiledAcceleration(myX, myY, myZ, i < n, px, py, pz, mass,
+                      n, softening2, grav, &accx, &accy, &accz, &phi);
+
     if (i < n) {
         ax[i] = accx;
         ay[i] = accy;
         az[i] = accz;
+        // Remove the body's own -G m / eps term
+        pot[i] = phi + grav * mass[i] * rsqrtf(softening2);
+    }
+}
+
+// Targets [first, first + count) against sources [srcFirst, srcFirst +
+// srcCount) only, stored or added (distributed mode splits the sum by slab)
+__global__ void computeForcesRangeKernel(
+    float* ax, float* ay, float* az,
+    const float* px, const float* py, const float* pz,
+    const float* mass,
+    int first, int count, int srcFirst, int srcCount,
+    float softening2, float grav, int accumulate)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    int i = first + k;
+
+    float myX = 0.0f, myY = 0.0f, myZ = 0.0f;
+    if (k < count) {
+        myX = px[i];
+        myY = py[i];
+        myZ = pz[i];
+    }
+
+    float accx, accy, accz;
+    tiledAcceleration(myX, myY, myZ, k < count, px + srcFirst, py + srcFirst, pz + srcFirst,
+                      mass + srcFirst, srcCount, softening2, grav, &accx, &accy, &accz, NULL);
+
+    if (k < count) {
+        if (accumulate) {
+            ax[i] += accx;
+            ay[i] += accy;
+            az[i] += accz;
+        } else {
+            ax[i] = accx;
+            ay[i] = accy;
+            az[i] = accz;
+        }
+    }
+}
+
+// Same sum for a compacted list of target bodies (block time steps)
+__global__ void computeForcesActiveKernel(
+    float* ax, float* ay, float* az,
+    const float* px, const float* py, const float* pz,
+    const float* mass,
+    const int* targets, int numTargets,
+    int n, float softening2, float grav)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    int i = k < numTargets ? targets[k] : 0;
+
+    float accx, accy, accz;
+    tiledAcceleration(px[i], py[i], pz[i], k < numTargets, px, py, pz, mass,
+                      n, softening2, grav, &accx, &accy, &accz, NULL);
+
+    if (k < numTargets) {
+        ax[i] = accx;
+        ay[i] = accy;
+        az[i] = accz;
+    }
+}
+
+#endif
+
+// ============== HOST SIMD SOLVER ==============
+// CPU version of computeForcesKernel for machines without a GPU (and for
+// comparing against it). The kernel's structure carries over: a work item
+// is TILE_SIZE targets, like a thread block, and sources are streamed in
+// HOST_TILE-body blocks small enough to stay in L1 while every target of
+// the item reuses them, like the shared-memory tile. Targets are processed
+// 8 at a time in GCC vector registers (AVX on x86, 2x NEON on the Jetson's
+// Cortex-A57) and items are handed out to threads from a shared counter.
+//
+// Two layouts of the same bodies are supported so they can be benchmarked
+// against each other: SoA (separate x, y, z, mass arrays as on the device)
+// and AoS (one float4 x, y, z, mass per body, float4 ax, ay, az, potential
+// per result).
+
+#define HOST_LANES 8
+#define HOST_TILE 1024          // Sources per L1 block (16 KB of x, y, z, m)
+
+typedef float vfloat8 __attribute__((vector_size(32)));
+typedef int vint8 __attribute__((vector_size(32)));
+
+// 1/sqrt(x): hardware estimate refined by Newton-Raphson steps. The AVX
+// estimate has 12 bits, NEON's only 8 and the integer-trick fallback 4, so
+// those take a second step to stay close to the GPU's rsqrtf. The intrinsic
+// headers are only used in the g++ build; nvcc builds take the fallback.
+static inline vfloat8 hostRsqrt(vfloat8 x) {
+    vfloat8 half = x * 0.5f;
+#if defined(HOST_AVX)
+    vfloat8 y = (vfloat8)_mm256_rsqrt_ps((__m256)x);
+#else
+#if defined(HOST_NEON)
+    union { vfloat8 v; float32x4_t q[2]; } u;
+    u.v = x;
+    u.q[0] = vrsqrteq_f32(u.q[0]);
+    u.q[1] = vrsqrteq_f32(u.q[1]);
+    vfloat8 y = u.v;
+#else
+    vfloat8 y = (vfloat8)(0x5f3759df - ((vint8)x >> 1));
+#endif
+    y = y * (1.5f - half * y * y);
+#endif
+    return y * (1.5f - half * y * y);
+}
+
+struct HostForceJob {
+    // SoA inputs / outputs (pot may be NULL)...
+    const float *px, *py, *pz, *mass;
+    float *ax, *ay, *az, *pot;
+    // ...or AoS: x, y, z, mass in, ax, ay, az, potential out
+    const float4* bodies;
+    float4* acc;
+
+    int n;
+    float softening2, grav;
+    int nextItem;                       // Shared work counter
+};
+
+// Accumulates sources [j0, j1) onto HOST_LANES targets, reading source k
+// from the float4 array (AOS) or from the SoA columns
+template <bool AOS>
+static inline void hostAccumulate(vfloat8 x, vfloat8 y, vfloat8 z,
+                                  const float* px, const float* py, const float* pz,
+                                  const float* mass, const float4* bodies,
+                                  int j0, int j1, float softening2,
+                                  vfloat8& accX, vfloat8& accY, vfloat8& accZ,
+                                  vfloat8& phi)
+{
+    for (int k = j0; k < j1; k++) {
+        float sx, sy, sz, sm;
+        if (AOS) {
+            float4 b = bodies[k];
+            sx = b.x; sy = b.y; sz = b.z; sm = b.w;
+        } else {
+            sx = px[k]; sy = py[k]; sz = pz[k]; sm = mass[k];
+        }
+        vfloat8 dx = sx - x;
+        vfloat8 dy = sy - y;
+        vfloat8 dz = sz - z;
+        vfloat8 dist2 = dx * dx + dy * dy + dz * dz + softening2;
+        vfloat8 invDist = hostRsqrt(dist2);
+        vfloat8 mInv = sm * invDist;
+        vfloat8 force = mInv * invDist * invDist;
+        accX += dx * force;
+        accY += dy * force;
+        accZ += dz * force;
+        phi -= mInv;
+    }
+}
+
+template <bool AOS>
+static void hostForceItem(HostForceJob* job, int i0) {
+    const int groups = TILE_SIZE / HOST_LANES;
+    int n = job->n;
+    vfloat8 x[groups], y[groups], z[groups];
+    vfloat8 accX[groups], accY[groups], accZ[groups], phi[groups];
+
+    // Gather targets; lanes past n repeat the last body and are not stored
+    for (int g = 0; g < groups; g++) {
+        for (int l = 0; l < HOST_LANES; l++) {
+            int i = i0 + g * HOST_LANES + l;
+            i = i < n ? i : n - 1;
+            if (AOS) {
+                x[g][l] = job->bodies[i].x;
+                y[g][l] = job->bodies[i].y;
+                z[g][l] = job->bodies[i].z;
+            } else {
+                x[g][l] = job->px[i];
+                y[g][l] = job->py[i];
+                z[g][l] = job->pz[i];
+            }
+        }
+        accX[g] = accY[g] = accZ[g] = phi[g] = (vfloat8){};
+    }
+
+    // Each L1 block of sources is used by all target groups before moving on
+    for (int j0 = 0; j0 < n; j0 += HOST_TILE) {
+        int j1 = j0 + HOST_TILE < n ? j0 + HOST_TILE : n;
+        for (int g = 0; g < groups && i0 + g * HOST_LANES < n; g++) {
+            hostAccumulate<AOS>(x[g], y[g], z[g], job->px, job->py, job->pz, job->mass,
+                           job->bodies, j0, j1, job->softening2,
+                           accX[g], accY[g], accZ[g], phi[g]);
+        }
+    }
+
+    float grav = job->grav;
+    float selfPot = grav / sqrtf(job->softening2);
+    for (int g = 0; g < groups; g++) {
+        for (int l = 0; l < HOST_LANES; l++) {
+            int i = i0 + g * HOST_LANES + l;
+            if (i >= n) return;
+            // Remove the body's own -G m / eps term, as on the device
+            float m = AOS ? job->bodies[i].w : job->mass[i];
+            float p = grav * phi[g][l] + selfPot * m;
+            if (AOS) {
+                job->acc[i] = make_float4(grav * accX[g][l], grav * accY[g][l],
+                                          grav * accZ[g][l], p);
+            } else {
+                job->ax[i] = grav * accX[g][l];
+                job->ay[i] = grav * accY[g][l];
+                job->az[i] = grav * accZ[g][l];
+                if (job->pot) job->pot[i] = p;
+            }
+        }
     }
 }
 
-// ============== INTEGRATION (Leapfrog) ==============
+static void* hostForceWorker(void* arg) {
+    HostForceJob* job = (HostForceJob*)arg;
+    for (;;) {
+        int item = __atomic_fetch_add(&job->nextItem, 1, __ATOMIC_RELAXED);
+        if (item * TILE_SIZE >= job->n) break;
+        if (job->bodies) {
+            hostForceItem<true>(job, item * TILE_SIZE);
+        } else {
+            hostForceItem<false>(job, item * TILE_SIZE);
+        }
+    }
+    return NULL;
+}
+
+static void hostRunForceJob(HostForceJob* job) {
+    int items = (job->n + TILE_SIZE - 1) / TILE_SIZE;
+    job->nextItem = 0;
+    int numThreads = hostThreadCount();
+    if (numThreads > items) numThreads = items;
+    if (numThreads <= 1) {
+        hostForceWorker(job);
+        return;
+    }
+    hostRunThreads(hostForceWorker, job, numThreads);
+}
+
+// Direct sum on host SoA arrays; pot may be NULL
+void hostComputeForces(float* ax, float* ay, float* az, float* pot,
+                       const float* px, const float* py, const float* pz,
+                       const float* mass, int n, float softening2, float grav)
+{
+    HostForceJob job;
+    memset(&job, 0, sizeof(job));
+    job.px = px; job.py = py; job.pz = pz; job.mass = mass;
+    job.ax = ax; job.ay = ay; job.az = az; job.pot = pot;
+    job.n = n;
+    job.softening2 = softening2;
+    job.grav = grav;
+    hostRunForceJob(&job);
+}
+
+// Same sum on float4 bodies (x, y, z, mass); acc gets ax, ay, az, potential
+void hostComputeForcesAos(float4* acc, const float4* bodies, int n,
+                          float softening2, float grav)
+{
+    HostForceJob job;
+    memset(&job, 0, sizeof(job));
+    job.bodies = bodies;
+    job.acc = acc;
+    job.n = n;
+    job.softening2 = softening2;
+    job.grav = grav;
+    hostRunForceJob(&job);
+}
+
+#ifndef CPU_ONLY
+// ============== INTEGRATION ==============
+// First-order symplectic Euler (kick then drift with the same acceleration)
 __global__ void integrateKernel(
     float* px, float* py, float* pz,
     float* vx, float* vy, float* vz,
@@ -139,6 +548,2926 @@ __global__ void integrateKernel(
     pz[i] += vz[i] * dt;
 }
 
+// Kick-drift-kick leapfrog, split around the force evaluation:
+// half kick with the old acceleration plus full drift, then the closing
+// half kick with the new one
+__global__ void leapfrogKickDriftKernel(
+    float* px, float* py, float* pz,
+    float* vx, float* vy, float* vz,
+    const float* ax, const float* ay, const float* az,
+    int n, float dt)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    float halfDt = 0.5f * dt;
+    float nvx = vx[i] + ax[i] * halfDt;
+    float nvy = vy[i] + ay[i] * halfDt;
+    float nvz = vz[i] + az[i] * halfDt;
+    vx[i] = nvx;
+    vy[i] = nvy;
+    vz[i] = nvz;
+
+    px[i] += nvx * dt;
+    py[i] += nvy * dt;
+    pz[i] += nvz * dt;
+}
+
+__global__ void leapfrogKickKernel(
+    float* vx, float* vy, float* vz,
+    const float* ax, const float* ay, const float* az,
+    int n, float dt)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    float halfDt = 0.5f * dt;
+    vx[i] += ax[i] * halfDt;
+    vy[i] += ay[i] * halfDt;
+    vz[i] += az[i] * halfDt;
+}
+
+// ============== BARNES-HUT TREE SOLVER ==============
+// O(N log N) alternative to computeForcesKernel for large N.
+//   1. Bounding box of all bodies (block reduction + float atomics)
+//   2. 30-bit Morton code per body, bodies sorted along the Z-order curve
+//   3. Radix tree over the sorted codes built in parallel (Karras 2012):
+//      one thread per internal node finds its key range and split. Every
+//      3 levels of this binary tree is one level of the implicit octree,
+//      and nodes carry tight bounding boxes, so opening tests behave like
+//      an octree's while the build needs no per-level passes.
+//   4. Bottom-up pass from the leaves computing mass, centre of mass and
+//      bounds; the second child to arrive at a node finishes it.
+//   5. Stackless walk: every node has a "rope" to the next node after its
+//      subtree, so a thread either descends to the left child or follows
+//      the rope. Bodies are walked in Morton order so warps take nearly
+//      identical paths through the tree.
+// Node numbering: internal nodes 0..n-2 (root is 0), leaf k is n-1+k.
+
+#define BH_BLOCK 256
+#define BH_DEFAULT_THETA 0.6f
+
+struct BHTree {
+    unsigned int* codes;                // Morton code per sorted body
+    int* order;                         // Sorted position -> original body index
+    float4* sortedPos;                  // x, y, z, mass in Morton order
+    int* childA;                        // Internal nodes: left child
+    int* childB;                        // Internal nodes: right child
+    int* first;                         // Internal nodes: first leaf of range
+    int* last;                          // Internal nodes: last leaf of range
+    int* parent;                        // All nodes
+    int* rope;                          // All nodes: next node after subtree, -1 at end
+    int* arrivals;                      // Bottom-up pass counters
+    float4* com;                        // All nodes: centre of mass + total mass
+    float4* boxMin;                     // All nodes: bounds (w unused)
+    float4* boxMax;
+    float* bounds;                      // Global min xyz, max xyz
+    int capacity;
+};
+
+__device__ void atomicMinFloat(float* addr, float v) {
+    // Ordered-int trick: positive floats compare like ints, negative reversed
+    if (v >= 0.0f) atomicMin((int*)addr, __float_as_int(v));
+    else atomicMax((unsigned int*)addr, __float_as_uint(v));
+}
+
+__device__ void atomicMaxFloat(float* addr, float v) {
+    if (v >= 0.0f) atomicMax((int*)addr, __float_as_int(v));
+    else atomicMin((unsigned int*)addr, __float_as_uint(v));
+}
+
+__global__ void bhResetBoundsKernel(float* bounds) {
+    bounds[0] = bounds[1] = bounds[2] = 1e30f;
+    bounds[3] = bounds[4] = bounds[5] = -1e30f;
+}
+
+__global__ void bhBoundsKernel(float* bounds,
+                               const float* px, const float* py, const float* pz, int n)
+{
+    __shared__ float sMin[3][BH_BLOCK];
+    __shared__ float sMax[3][BH_BLOCK];
+
+    int tid = threadIdx.x;
+    float mnx = 1e30f, mny = 1e30f, mnz = 1e30f;
+    float mxx = -1e30f, mxy = -1e30f, mxz = -1e30f;
+
+    for (int i = blockIdx.x * blockDim.x + tid; i < n; i += blockDim.x * gridDim.x) {
+        mnx = fminf(mnx, px[i]); mxx = fmaxf(mxx, px[i]);
+        mny = fminf(mny, py[i]); mxy = fmaxf(mxy, py[i]);
+        mnz = fminf(mnz, pz[i]); mxz = fmaxf(mxz, pz[i]);
+    }
+    sMin[0][tid] = mnx; sMin[1][tid] = mny; sMin[2][tid] = mnz;
+    sMax[0][tid] = mxx; sMax[1][tid] = mxy; sMax[2][tid] = mxz;
+    __syncthreads();
+
+    for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) {
+        if (tid < stride) {
+            for (int a = 0; a < 3; a++) {
+                sMin[a][tid] = fminf(sMin[a][tid], sMin[a][tid + stride]);
+                sMax[a][tid] = fmaxf(sMax[a][tid], sMax[a][tid + stride]);
+            }
+        }
+        __syncthreads();
+    }
+
+    if (tid == 0) {
+        for (int a = 0; a < 3; a++) {
+            atomicMinFloat(&bounds[a], sMin[a][0]);
+            atomicMaxFloat(&bounds[3 + a], sMax[a][0]);
+        }
+    }
+}
+
+// Spread the low 10 bits of v so there are two zero bits between each
+__device__ unsigned int expandBits(unsigned int v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+__global__ void bhMortonKernel(unsigned int* codes, int* order,
+                               const float* px, const float* py, const float* pz,
+                               const float* bounds, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    // Cubic cells: scale every axis by the largest extent
+    float extent = fmaxf(bounds[3] - bounds[0],
+                   fmaxf(bounds[4] - bounds[1], bounds[5] - bounds[2]));
+    float inv = extent > 0.0f ? 1023.0f / extent : 0.0f;
+
+    unsigned int cx = (unsigned int)((px[i] - bounds[0]) * inv);
+    unsigned int cy = (unsigned int)((py[i] - bounds[1]) * inv);
+    unsigned int cz = (unsigned int)((pz[i] - bounds[2]) * inv);
+
+    codes[i] = (expandBits(cx) << 2) | (expandBits(cy) << 1) | expandBits(cz);
+    order[i] = i;
+}
+
+__global__ void bhGatherKernel(float4* sortedPos, const int* order,
+                               const float* px, const float* py, const float* pz,
+                               const float* mass, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    int j = order[i];
+    sortedPos[i] = make_float4(px[j], py[j], pz[j], mass[j]);
+}
+
+// Length of the common prefix of keys i and j; duplicates are made unique by
+// falling back to the index bits. -1 outside [0, n).
+__device__ int bhDelta(const unsigned int* codes, int n, int i, int j) {
+    if (j < 0 || j >= n) return -1;
+    unsigned int a = codes[i], b = codes[j];
+    if (a == b) return 32 + __clz(i ^ j);
+    return __clz(a ^ b);
+}
+
+__global__ void bhBuildKernel(BHTree t, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n - 1) return;
+
+    const unsigned int* codes = t.codes;
+
+    // Direction of this node's range
+    int d = bhDelta(codes, n, i, i + 1) - bhDelta(codes, n, i, i - 1) >= 0 ? 1 : -1;
+    int deltaMin = bhDelta(codes, n, i, i - d);
+
+    // Upper bound for the range length, then binary search the other end
+    int lMax = 2;
+    while (bhDelta(codes, n, i, i + lMax * d) > deltaMin) lMax <<= 1;
+
+    int l = 0;
+    for (int step = lMax >> 1; step > 0; step >>= 1) {
+        if (bhDelta(codes, n, i, i + (l + step) * d) > deltaMin) l += step;
+    }
+    int j = i + l * d;
+
+    // Binary search the split position inside [i, j]
+    int deltaNode = bhDelta(codes, n, i, j);
+    int s = 0;
+    int step = l;
+    do {
+        step = (step + 1) >> 1;
+        if (bhDelta(codes, n, i, i + (s + step) * d) > deltaNode) s += step;
+    } while (step > 1);
+    int split = i + s * d + min(d, 0);
+
+    int lo = min(i, j), hi = max(i, j);
+    int a = (lo == split) ? n - 1 + split : split;
+    int b = (hi == split + 1) ? n - 1 + split + 1 : split + 1;
+
+    t.childA[i] = a;
+    t.childB[i] = b;
+    t.first[i] = lo;
+    t.last[i] = hi;
+    t.parent[a] = i;
+    t.parent[b] = i;
+    if (i == 0) t.parent[0] = -1;
+}
+
+// Rope = next node in depth-first order after this subtree. A subtree ending
+// at leaf k continues at the right child of the node that splits at k, which
+// is internal node k+1 if that node's range starts at k+1, otherwise leaf k+1.
+__global__ void bhRopeKernel(BHTree t, int n)
+{
+    int node = blockIdx.x * blockDim.x + threadIdx.x;
+    if (node >= 2 * n - 1) return;
+
+    int next = (node >= n - 1 ? node - (n - 1) : t.last[node]) + 1;
+    if (next >= n) {
+        t.rope[node] = -1;
+    } else if (next < n - 1 && t.first[next] == next) {
+        t.rope[node] = next;
+    } else {
+        t.rope[node] = n - 1 + next;
+    }
+}
+
+__global__ void bhSummarizeKernel(BHTree t, int n)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= n) return;
+
+    int node = n - 1 + k;
+    float4 p = t.sortedPos[k];
+    t.com[node] = p;
+    t.boxMin[node] = p;
+    t.boxMax[node] = p;
+    __threadfence();
+
+    // Climb while we are the second child to finish
+    node = t.parent[node];
+    while (node >= 0) {
+        if (atomicAdd(&t.arrivals[node], 1) == 0) return;
+
+        volatile float4* com = t.com;
+        volatile float4* bmin = t.boxMin;
+        volatile float4* bmax = t.boxMax;
+        int a = t.childA[node], b = t.childB[node];
+
+        float ma = com[a].w, mb = com[b].w;
+        float m = ma + mb;
+        float inv = m > 0.0f ? 1.0f / m : 0.0f;
+        t.com[node] = make_float4((com[a].x * ma + com[b].x * mb) * inv,
+                                  (com[a].y * ma + com[b].y * mb) * inv,
+                                  (com[a].z * ma + com[b].z * mb) * inv, m);
+        t.boxMin[node] = make_float4(fminf(bmin[a].x, bmin[b].x),
+                                     fminf(bmin[a].y, bmin[b].y),
+                                     fminf(bmin[a].z, bmin[b].z), 0.0f);
+        t.boxMax[node] = make_float4(fmaxf(bmax[a].x, bmax[b].x),
+                                     fmaxf(bmax[a].y, bmax[b].y),
+                                     fmaxf(bmax[a].z, bmax[b].z), 0.0f);
+        __threadfence();
+
+        node = t.parent[node];
+    }
+}
+
+// Walks the tree for every body in Morton order, or for a list of target
+// bodies (original indices) when targets is non-NULL
+// Also writes the potential to pot (if non-NULL; all-body mode only)
+__global__ void bhForcesKernel(float* ax, float* ay, float* az, float* pot, BHTree t,
+                               const float* px, const float* py, const float* pz,
+                               const int* targets, int numTargets,
+                               int n, float softening2, float grav, float theta2)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= numTargets) return;
+
+    int i;
+    float4 me;
+    if (targets) {
+        i = targets[k];
+        me = make_float4(px[i], py[i], pz[i], 0.0f);
+    } else {
+        i = t.order[k];
+        me = t.sortedPos[k];
+    }
+    float accx = 0.0f, accy = 0.0f, accz = 0.0f;
+    float phi = 0.0f;
+
+    int node = 0;
+    while (node >= 0) {
+        float4 c = t.com[node];
+        float dx = c.x - me.x;
+        float dy = c.y - me.y;
+        float dz = c.z - me.z;
+        float dist2 = dx * dx + dy * dy + dz * dz;
+
+        int open = 0;
+        if (node < n - 1) {
+            // Open if the node looks large from here (size^2 >= theta^2 * d^2)
+            // or contains this body, where the COM approximation breaks down
+            float4 lo = t.boxMin[node], hi = t.boxMax[node];
+            float size = fmaxf(hi.x - lo.x, fmaxf(hi.y - lo.y, hi.z - lo.z));
+            open = size * size >= theta2 * dist2 ||
+                   (me.x >= lo.x && me.x <= hi.x && me.y >= lo.y && me.y <= hi.y &&
+                    me.z >= lo.z && me.z <= hi.z);
+        }
+
+        if (open) {
+            node = t.childA[node];
+        } else {
+            float invDist = rsqrtf(dist2 + softening2);
+            float force = grav * c.w * invDist * invDist * invDist;
+            accx += dx * force;
+            accy += dy * force;
+            accz += dz * force;
+            phi -= grav * c.w * invDist;
+            node = t.rope[node];
+        }
+    }
+
+    ax[i] = accx;
+    ay[i] = accy;
+    az[i] = accz;
+    // The walk includes the body's own leaf: remove its -G m / eps
+    if (pot) pot[i] = phi + grav * me.w * rsqrtf(softening2);
+}
+
+void bhAlloc(BHTree* t, int maxBodies) {
+    int nodes = 2 * maxBodies - 1;
+    t->capacity = maxBodies;
+    cudaMalloc(&t->codes, maxBodies * sizeof(unsigned int));
+    cudaMalloc(&t->order, maxBodies * sizeof(int));
+    cudaMalloc(&t->sortedPos, maxBodies * sizeof(float4));
+    cudaMalloc(&t->childA, maxBodies * sizeof(int));
+    cudaMalloc(&t->childB, maxBodies * sizeof(int));
+    cudaMalloc(&t->first, maxBodies * sizeof(int));
+    cudaMalloc(&t->last, maxBodies * sizeof(int));
+    cudaMalloc(&t->arrivals, maxBodies * sizeof(int));
+    cudaMalloc(&t->parent, nodes * sizeof(int));
+    cudaMalloc(&t->rope, nodes * sizeof(int));
+    cudaMalloc(&t->com, nodes * sizeof(float4));
+    cudaMalloc(&t->boxMin, nodes * sizeof(float4));
+    cudaMalloc(&t->boxMax, nodes * sizeof(float4));
+    cudaMalloc(&t->bounds, 6 * sizeof(float));
+}
+
+void bhFree(BHTree* t) {
+    cudaFree(t->codes); cudaFree(t->order); cudaFree(t->sortedPos);
+    cudaFree(t->childA); cudaFree(t->childB); cudaFree(t->first); cudaFree(t->last);
+    cudaFree(t->arrivals); cudaFree(t->parent); cudaFree(t->rope);
+    cudaFree(t->com); cudaFree(t->boxMin); cudaFree(t->boxMax);
+    cudaFree(t->bounds);
+}
+
+// Rebuild the tree from current positions and evaluate accelerations for
+// all bodies, or only for 'targets' (numTargets entries) if non-NULL.
+// pot (optional, all bodies only) receives the potential
+void bhComputeForces(BHTree* t,
+                     float* ax, float* ay, float* az, float* pot,
+                     const float* px, const float* py, const float* pz,
+                     const float* mass, int n,
+                     const int* targets, int numTargets,
+                     float softening2, float grav, float theta)
+{
+    if (n < 2) {
+        cudaMemset(ax, 0, n * sizeof(float));
+        cudaMemset(ay, 0, n * sizeof(float));
+        cudaMemset(az, 0, n * sizeof(float));
+        return;
+    }
+
+    int bodyBlocks = (n + BH_BLOCK - 1) / BH_BLOCK;
+    int nodeBlocks = (2 * n - 1 + BH_BLOCK - 1) / BH_BLOCK;
+    int boundsBlocks = bodyBlocks < 64 ? bodyBlocks : 64;
+
+    bhResetBoundsKernel<<<1, 1>>>(t->bounds);
+    bhBoundsKernel<<<boundsBlocks, BH_BLOCK>>>(t->bounds, px, py, pz, n);
+    bhMortonKernel<<<bodyBlocks, BH_BLOCK>>>(t->codes, t->order, px, py, pz, t->bounds, n);
+
+    thrust::sort_by_key(thrust::device_ptr<unsigned int>(t->codes),
+                        thrust::device_ptr<unsigned int>(t->codes + n),
+                        thrust::device_ptr<int>(t->order));
+
+    bhGatherKernel<<<bodyBlocks, BH_BLOCK>>>(t->sortedPos, t->order, px, py, pz, mass, n);
+    bhBuildKernel<<<bodyBlocks, BH_BLOCK>>>(*t, n);
+    bhRopeKernel<<<nodeBlocks, BH_BLOCK>>>(*t, n);
+    cudaMemset(t->arrivals, 0, (n - 1) * sizeof(int));
+    bhSummarizeKernel<<<bodyBlocks, BH_BLOCK>>>(*t, n);
+    if (!targets) numTargets = n;
+    int targetBlocks = (numTargets + BH_BLOCK - 1) / BH_BLOCK;
+    bhForcesKernel<<<targetBlocks, BH_BLOCK>>>(ax, ay, az, targets ? NULL : pot, *t, px, py, pz,
+                                               targets, numTargets, n,
+                                               softening2, grav, theta * theta);
+}
+
+#endif
+
+// ============== FAST MULTIPOLE METHOD ==============
+// O(N) solver on an adaptive octree (cells split above FMM_LEAF_SIZE bodies)
+// using Cartesian Taylor expansions of order FMM_ORDER:
+//   P2M/M2M   multipoles up the tree
+//   M2L       same-level well-separated cells (V list). Their offsets are
+//             integer vectors in [-3,3]^3, so the derivative tensors of the
+//             kernel are precomputed once per level for all 343 offsets
+//   P2L/M2P   coarse leaf <-> finer cell pairs (X and W lists)
+//   L2L/L2P   locals down the tree and out to the bodies
+//   P2P       adjacent leaves (U list), on the GPU when available
+// The Plummer-softened kernel 1/sqrt(r^2 + eps^2) is expanded directly, so
+// the far field matches computeForcesKernel rather than bare 1/r.
+// Tree, expansions and far field run on the host threads while the GPU
+// computes the near field; fmmComputeForcesHost does both halves on the host
+// and is all the CPU_ONLY build compiles.
+
+#define FMM_ORDER 4
+#define FMM_LEAF_SIZE 64
+#define FMM_MAX_DEPTH 16
+#define FMM_DIRECT_MAX 24               // Sparser W/X-list cells are summed directly
+#define FMM_NCOEF ((FMM_ORDER + 1) * (FMM_ORDER + 2) * (FMM_ORDER + 3) / 6)
+#define FMM_NDERIV ((2 * FMM_ORDER + 1) * (2 * FMM_ORDER + 2) * (2 * FMM_ORDER + 3) / 6)
+
+struct FmmCell {
+    int level;
+    int ix, iy, iz;                     // Integer coordinates at its level
+    int first, count;                   // Body range in Morton order
+    int child[8];                       // -1 where empty
+    int numChildren;
+    int parent;
+    double cx, cy, cz;                  // Geometric centre
+    double M[FMM_NCOEF];                // Multipole moments
+    double L[FMM_NCOEF];                // Local expansion (kernel derivatives)
+};
+
+struct FmmSolver {
+    std::vector<FmmCell> cells;         // Pre-order: parents before children
+    std::vector<int> order;             // Sorted position -> body index
+    std::vector<unsigned long long> keys;
+    std::vector<float4> sorted;         // x, y, z, mass in Morton order
+    std::vector<int> leaves;
+    std::vector<std::vector<int> > levelCells;
+    // Interaction lists, built top-down
+    std::vector<std::vector<int> > neighbors;   // Adjacent: same level or coarser leaf
+    std::vector<std::vector<int> > vList;       // M2L
+    std::vector<std::vector<int> > xList;       // P2L
+    std::vector<std::vector<int> > direct;      // Leaves summed directly into the subtree
+    // Near field in CSR form: body ranges of the source leaves per leaf
+    std::vector<int2> targetRange;
+    std::vector<int> nearStart;
+    std::vector<int2> nearRange;
+    std::vector<int> wStart;                    // M2P sources per leaf
+    std::vector<int> wCells;
+    std::vector<float4> far;                    // Accelerations, Morton order
+    std::vector<double> m2lTables;              // [level][offset][FMM_NDERIV]
+    double originX, originY, originZ, size;
+    double softening2;
+    int numThreads;
+
+#ifndef CPU_ONLY
+    // Device side: near field and the combined result
+    float *h_x, *h_y, *h_z, *h_mass;            // Pinned position staging
+    float4* d_sorted;
+    float4* d_near;
+    float4* d_far;
+    int* d_order;
+    int2* d_targetRange;
+    int* d_nearStart;
+    int2* d_nearRange;
+    int leafCapacity, rangeCapacity;
+#endif
+};
+
+// Multi-index tables, ordered by total degree
+static int g_mi[FMM_NDERIV][3];
+static int g_miDegree[FMM_NDERIV];
+static int g_miIndex[2 * FMM_ORDER + 1][2 * FMM_ORDER + 1][2 * FMM_ORDER + 1];
+static double g_invFact[FMM_NDERIV];
+static int g_recPrev1[FMM_NDERIV][3], g_recPrev2[FMM_NDERIV][3];
+static double g_recA[FMM_NDERIV][3], g_recB[FMM_NDERIV][3];
+static int g_m2lStart[FMM_NCOEF + 1];
+static int g_m2lTerm[FMM_NCOEF * FMM_NCOEF][2];
+static int g_fmmTablesReady = 0;
+
+static void fmmInitTables() {
+    if (g_fmmTablesReady) return;
+    double fact[2 * FMM_ORDER + 1];
+    fact[0] = 1.0;
+    for (int i = 1; i <= 2 * FMM_ORDER; i++) fact[i] = fact[i - 1] * i;
+
+    int k = 0;
+    for (int m = 0; m <= 2 * FMM_ORDER; m++) {
+        for (int a = m; a >= 0; a--) {
+            for (int b = m - a; b >= 0; b--) {
+                int c = m - a - b;
+                g_mi[k][0] = a; g_mi[k][1] = b; g_mi[k][2] = c;
+                g_miDegree[k] = m;
+                g_miIndex[a][b][c] = k;
+                g_invFact[k] = 1.0 / (fact[a] * fact[b] * fact[c]);
+                k++;
+            }
+        }
+    }
+
+    // Recurrence terms for fmmDerivatives; missing predecessors point at
+    // T_0 with a zero coefficient
+    for (k = 1; k < FMM_NDERIV; k++) {
+        int m = g_miDegree[k];
+        for (int i = 0; i < 3; i++) {
+            int n[3] = { g_mi[k][0], g_mi[k][1], g_mi[k][2] };
+            int ni = n[i];
+            g_recPrev1[k][i] = g_recPrev2[k][i] = 0;
+            g_recA[k][i] = g_recB[k][i] = 0.0;
+            if (ni >= 1) {
+                n[i] = ni - 1;
+                g_recPrev1[k][i] = g_miIndex[n[0]][n[1]][n[2]];
+                g_recA[k][i] = -(2.0 * m - 1.0) * ni / m;
+            }
+            if (ni >= 2) {
+                n[i] = ni - 2;
+                g_recPrev2[k][i] = g_miIndex[n[0]][n[1]][n[2]];
+                g_recB[k][i] = -(m - 1.0) * ni * (ni - 1) / m;
+            }
+        }
+    }
+
+    int t = 0;
+    for (int l = 0; l < FMM_NCOEF; l++) {
+        g_m2lStart[l] = t;
+        for (int n = 0; n < FMM_NCOEF && g_miDegree[n] + g_miDegree[l] <= FMM_ORDER; n++) {
+            g_m2lTerm[t][0] = n;
+            g_m2lTerm[t][1] = g_miIndex[g_mi[n][0] + g_mi[l][0]]
+                                       [g_mi[n][1] + g_mi[l][1]]
+                                       [g_mi[n][2] + g_mi[l][2]];
+            t++;
+        }
+    }
+    g_m2lStart[FMM_NCOEF] = t;
+    g_fmmTablesReady = 1;
+}
+
+// Derivative tensors T_n = d^n/dx^n (r^2 + eps^2)^(-1/2) for |n| <= maxDeg,
+// by the recurrence
+//   m rho T_n = -(2m-1) sum_i n_i x_i T_{n-e_i} - (m-1) sum_i n_i(n_i-1) T_{n-2e_i}
+// with rho = r^2 + eps^2 (the same form holds for the softened kernel).
+// Predecessor indices and coefficients are tabulated in fmmInitTables
+static void fmmDerivatives(double x, double y, double z, double eps2,
+                           int maxDeg, double* T) {
+    double r[3] = { x, y, z };
+    double invRho = 1.0 / (x * x + y * y + z * z + eps2);
+    T[0] = sqrt(invRho);
+
+    int count = (maxDeg + 1) * (maxDeg + 2) * (maxDeg + 3) / 6;
+    for (int k = 1; k < count; k++) {
+        double sum = 0.0;
+        for (int i = 0; i < 3; i++) {
+            sum += g_recA[k][i] * r[i] * T[g_recPrev1[k][i]]
+                 + g_recB[k][i] * T[g_recPrev2[k][i]];
+        }
+        T[k] = sum * invRho;
+    }
+}
+
+// x^a y^b z^c / (a! b! c!) for all |n| <= deg
+static void fmmScaledPowers(double x, double y, double z, int deg, double* out) {
+    double px[2 * FMM_ORDER + 1], py[2 * FMM_ORDER + 1], pz[2 * FMM_ORDER + 1];
+    px[0] = py[0] = pz[0] = 1.0;
+    for (int i = 1; i <= deg; i++) {
+        px[i] = px[i - 1] * x;
+        py[i] = py[i - 1] * y;
+        pz[i] = pz[i - 1] * z;
+    }
+    int count = (deg + 1) * (deg + 2) * (deg + 3) / 6;
+    for (int k = 0; k < count; k++) {
+        out[k] = px[g_mi[k][0]] * py[g_mi[k][1]] * pz[g_mi[k][2]] * g_invFact[k];
+    }
+}
+
+static inline int fmmSign(int k) { return (g_miDegree[k] & 1) ? -1 : 1; }
+
+static int fmmAdjacent(const FmmCell& a, const FmmCell& b) {
+    // Compare in units of the finest level; touching counts as adjacent
+    int sa = FMM_MAX_DEPTH - a.level, sb = FMM_MAX_DEPTH - b.level;
+    int ca[3] = { a.ix, a.iy, a.iz }, cb[3] = { b.ix, b.iy, b.iz };
+    for (int i = 0; i < 3; i++) {
+        long long a0 = (long long)ca[i] << sa, a1 = (long long)(ca[i] + 1) << sa;
+        long long b0 = (long long)cb[i] << sb, b1 = (long long)(cb[i] + 1) << sb;
+        if (a0 > b1 || b0 > a1) return 0;
+    }
+    return 1;
+}
+
+static unsigned long long fmmSpread(unsigned int v) {
+    unsigned long long x = v & 0x1FFFFF;
+    x = (x | x << 32) & 0x1F00000000FFFFull;
+    x = (x | x << 16) & 0x1F0000FF0000FFull;
+    x = (x | x << 8) & 0x100F00F00F00F00Full;
+    x = (x | x << 4) & 0x10C30C30C30C30C3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Recursively splits the Morton-sorted range [first, first+count) of a cell
+static int fmmBuildCell(FmmSolver* s, int parent, int level, int ix, int iy, int iz,
+                        int first, int count) {
+    int id = (int)s->cells.size();
+    s->cells.push_back(FmmCell());
+    FmmCell& c = s->cells[id];
+    memset(&c, 0, sizeof(c));
+    c.level = level;
+    c.ix = ix; c.iy = iy; c.iz = iz;
+    c.first = first;
+    c.count = count;
+    c.parent = parent;
+    double h = s->size / (1 << level);
+    c.cx = s->originX + (ix + 0.5) * h;
+    c.cy = s->originY + (iy + 0.5) * h;
+    c.cz = s->originZ + (iz + 0.5) * h;
+    for (int k = 0; k < 8; k++) c.child[k] = -1;
+
+    if ((int)s->levelCells.size() <= level) s->levelCells.resize(level + 1);
+    s->levelCells[level].push_back(id);
+
+    if (count <= FMM_LEAF_SIZE || level == FMM_MAX_DEPTH) {
+        s->leaves.push_back(id);
+        return id;
+    }
+
+    // Children are consecutive sub-ranges: the 3 key bits below this level
+    int shift = 3 * (FMM_MAX_DEPTH - level - 1);
+    int start = first, end = first + count;
+    int numChildren = 0;
+    for (int octant = 0; octant < 8; octant++) {
+        int stop = start;
+        while (stop < end && (int)((s->keys[stop] >> shift) & 7) == octant) stop++;
+        if (stop > start) {
+            int child = fmmBuildCell(s, id, level + 1,
+                                     ix * 2 + ((octant >> 2) & 1),
+                                     iy * 2 + ((octant >> 1) & 1),
+                                     iz * 2 + (octant & 1),
+                                     start, stop - start);
+            s->cells[id].child[numChildren++] = child;
+        }
+        start = stop;
+    }
+    s->cells[id].numChildren = numChildren;
+    return id;
+}
+
+static void fmmBuildTree(FmmSolver* s, const float* px, const float* py, const float* pz,
+                         const float* mass, int n) {
+    double mn[3] = { 1e30, 1e30, 1e30 }, mx[3] = { -1e30, -1e30, -1e30 };
+    for (int i = 0; i < n; i++) {
+        mn[0] = fmin(mn[0], px[i]); mx[0] = fmax(mx[0], px[i]);
+        mn[1] = fmin(mn[1], py[i]); mx[1] = fmax(mx[1], py[i]);
+        mn[2] = fmin(mn[2], pz[i]); mx[2] = fmax(mx[2], pz[i]);
+    }
+    double size = fmax(mx[0] - mn[0], fmax(mx[1] - mn[1], mx[2] - mn[2])) * 1.0001 + 1e-6;
+    s->originX = mn[0];
+    s->originY = mn[1];
+    s->originZ = mn[2];
+    s->size = size;
+
+    // FMM_MAX_DEPTH-bit (16) cell coordinates per axis, sorted along the Morton curve
+    double scale = (1 << FMM_MAX_DEPTH) / size;
+    std::vector<std::pair<unsigned long long, int> > kv(n);
+    for (int i = 0; i < n; i++) {
+        unsigned int cx = (unsigned int)((px[i] - mn[0]) * scale);
+        unsigned int cy = (unsigned int)((py[i] - mn[1]) * scale);
+        unsigned int cz = (unsigned int)((pz[i] - mn[2]) * scale);
+        kv[i].first = (fmmSpread(cx) << 2) | (fmmSpread(cy) << 1) | fmmSpread(cz);
+        kv[i].second = i;
+    }
+    std::sort(kv.begin(), kv.end());
+
+    s->keys.resize(n);
+    s->order.resize(n);
+    s->sorted.resize(n);
+    for (int k = 0; k < n; k++) {
+        int i = kv[k].second;
+        s->keys[k] = kv[k].first;
+        s->order[k] = i;
+        s->sorted[k] = make_float4(px[i], py[i], pz[i], mass[i]);
+    }
+
+    s->cells.clear();
+    s->leaves.clear();
+    for (size_t l = 0; l < s->levelCells.size(); l++) s->levelCells[l].clear();
+    fmmBuildCell(s, -1, 0, 0, 0, 0, 0, n);
+}
+
+// Interaction lists for every cell, top-down from its parent's neighbours
+static void fmmBuildLists(FmmSolver* s) {
+    int numCells = (int)s->cells.size();
+    s->neighbors.assign(numCells, std::vector<int>());
+    s->vList.assign(numCells, std::vector<int>());
+    s->xList.assign(numCells, std::vector<int>());
+    s->direct.assign(numCells, std::vector<int>());
+
+    for (int id = 1; id < numCells; id++) {
+        const FmmCell& c = s->cells[id];
+        const FmmCell& p = s->cells[c.parent];
+        s->direct[id] = s->direct[c.parent];
+
+        // Candidates: children of the parent and of its neighbours, or the
+        // neighbour itself when it is a coarser leaf
+        std::vector<int> candidates;
+        for (int k = 0; k < p.numChildren; k++) candidates.push_back(p.child[k]);
+        for (size_t q = 0; q < s->neighbors[c.parent].size(); q++) {
+            const FmmCell& nb = s->cells[s->neighbors[c.parent][q]];
+            if (nb.numChildren == 0) {
+                candidates.push_back(s->neighbors[c.parent][q]);
+            } else {
+                for (int k = 0; k < nb.numChildren; k++) candidates.push_back(nb.child[k]);
+            }
+        }
+
+        for (size_t q = 0; q < candidates.size(); q++) {
+            int k = candidates[q];
+            if (k == id) continue;
+            const FmmCell& o = s->cells[k];
+            if (fmmAdjacent(c, o)) {
+                s->neighbors[id].push_back(k);
+            } else if (o.level == c.level) {
+                s->vList[id].push_back(k);
+            } else if (c.count <= FMM_DIRECT_MAX) {
+                s->direct[id].push_back(k);
+            } else {
+                s->xList[id].push_back(k);
+            }
+        }
+    }
+
+    // Leaves: adjacent leaves are near field (P2P); adjacent finer subtrees
+    // are opened until their cells are separated (M2P) or leaves (P2P).
+    // Sparse separated cells are cheaper to sum directly than to expand
+    s->targetRange.clear();
+    s->nearStart.assign(1, 0);
+    s->nearRange.clear();
+    s->wStart.assign(1, 0);
+    s->wCells.clear();
+
+    for (size_t li = 0; li < s->leaves.size(); li++) {
+        int id = s->leaves[li];
+        const FmmCell& c = s->cells[id];
+        s->targetRange.push_back(make_int2(c.first, c.count));
+        s->nearRange.push_back(make_int2(c.first, c.count));   // Self interaction
+        for (size_t q = 0; q < s->direct[id].size(); q++) {
+            const FmmCell& o = s->cells[s->direct[id][q]];
+            s->nearRange.push_back(make_int2(o.first, o.count));
+        }
+
+        std::vector<int> stack;
+        for (size_t q = 0; q < s->neighbors[id].size(); q++) {
+            stack.push_back(s->neighbors[id][q]);
+        }
+        while (!stack.empty()) {
+            int k = stack.back();
+            stack.pop_back();
+            const FmmCell& o = s->cells[k];
+            if (o.level > c.level && o.count > FMM_DIRECT_MAX && !fmmAdjacent(c, o)) {
+                s->wCells.push_back(k);
+            } else if (o.numChildren == 0) {
+                s->nearRange.push_back(make_int2(o.first, o.count));
+            } else {
+                for (int j = 0; j < o.numChildren; j++) stack.push_back(o.child[j]);
+            }
+        }
+        s->nearStart.push_back((int)s->nearRange.size());
+        s->wStart.push_back((int)s->wCells.size());
+    }
+}
+
+static void fmmP2M(FmmSolver* s, FmmCell& c) {
+    double pw[FMM_NCOEF];
+    memset(c.M, 0, sizeof(c.M));
+    for (int j = c.first; j < c.first + c.count; j++) {
+        float4 b = s->sorted[j];
+        fmmScaledPowers(b.x - c.cx, b.y - c.cy, b.z - c.cz, FMM_ORDER, pw);
+        for (int k = 0; k < FMM_NCOEF; k++) c.M[k] += b.w * pw[k];
+    }
+}
+
+static void fmmM2M(FmmCell& parent, const FmmCell& child) {
+    double pw[FMM_NCOEF];
+    fmmScaledPowers(child.cx - parent.cx, child.cy - parent.cy, child.cz - parent.cz,
+                    FMM_ORDER, pw);
+    for (int n = 0; n < FMM_NCOEF; n++) {
+        double sum = 0.0;
+        for (int k = 0; k <= n; k++) {
+            int a = g_mi[n][0] - g_mi[k][0];
+            int b = g_mi[n][1] - g_mi[k][1];
+            int c = g_mi[n][2] - g_mi[k][2];
+            if (a < 0 || b < 0 || c < 0) continue;
+            sum += child.M[k] * pw[g_miIndex[a][b][c]];
+        }
+        parent.M[n] += sum;
+    }
+}
+
+// L_l += sum_n (-1)^|n| M_n T_{n+l}, |n| + |l| <= ORDER, flattened into
+// (l, n, n+l) triples by fmmInitTables
+static void fmmM2LApply(double* L, const double* M, const double* T) {
+    double sm[FMM_NCOEF];
+    for (int n = 0; n < FMM_NCOEF; n++) sm[n] = fmmSign(n) * M[n];
+    for (int l = 0; l < FMM_NCOEF; l++) {
+        double sum = 0.0;
+        for (int k = g_m2lStart[l]; k < g_m2lStart[l + 1]; k++) {
+            sum += sm[g_m2lTerm[k][0]] * T[g_m2lTerm[k][1]];
+        }
+        L[l] += sum;
+    }
+}
+
+static void fmmL2L(FmmCell& child, const FmmCell& parent) {
+    double pw[FMM_NCOEF];
+    fmmScaledPowers(child.cx - parent.cx, child.cy - parent.cy, child.cz - parent.cz,
+                    FMM_ORDER, pw);
+    for (int l = 0; l < FMM_NCOEF; l++) {
+        double sum = 0.0;
+        for (int k = 0; k < FMM_NCOEF; k++) {
+            int a = g_mi[k][0] - g_mi[l][0];
+            int b = g_mi[k][1] - g_mi[l][1];
+            int c = g_mi[k][2] - g_mi[l][2];
+            if (a < 0 || b < 0 || c < 0) continue;
+            sum += parent.L[k] * pw[g_miIndex[a][b][c]];
+        }
+        child.L[l] += sum;
+    }
+}
+
+// Simple parallel-for over [0, count) with dynamic scheduling
+struct FmmTask {
+    FmmSolver* s;
+    const std::vector<int>* items;
+    void (*fn)(FmmSolver*, int);
+    int next;
+};
+
+static void* fmmWorker(void* arg) {
+    FmmTask* t = (FmmTask*)arg;
+    for (;;) {
+        int k = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if (k >= (int)t->items->size()) break;
+        t->fn(t->s, (*t->items)[k]);
+    }
+    return NULL;
+}
+
+static void fmmParallelFor(FmmSolver* s, const std::vector<int>& items,
+                           void (*fn)(FmmSolver*, int)) {
+    FmmTask task = { s, &items, fn, 0 };
+    int threads = s->numThreads;
+    if ((int)items.size() < 64 || threads <= 1) {
+        fmmWorker(&task);
+        return;
+    }
+    hostRunThreads(fmmWorker, &task, threads);
+}
+
+static void fmmUpwardCell(FmmSolver* s, int id) {
+    FmmCell& c = s->cells[id];
+    if (c.numChildren == 0) {
+        fmmP2M(s, c);
+    } else {
+        memset(c.M, 0, sizeof(c.M));
+        for (int k = 0; k < c.numChildren; k++) fmmM2M(c, s->cells[c.child[k]]);
+    }
+}
+
+// M2L operators: derivative tensors for all 343 same-level offsets, per
+// level. The softening does not scale with the cell size, so the tables are
+// rebuilt each step (levels x 343 tensors), then shared by every V-list pair
+static void fmmPrecomputeM2L(FmmSolver* s) {
+    int levels = (int)s->levelCells.size();
+    s->m2lTables.assign((size_t)levels * 343 * FMM_NDERIV, 0.0);
+    for (int l = 2; l < levels; l++) {
+        double h = s->size / (1 << l);
+        for (int o = 0; o < 343; o++) {
+            int dx = o / 49 - 3, dy = (o / 7) % 7 - 3, dz = o % 7 - 3;
+            if (abs(dx) <= 1 && abs(dy) <= 1 && abs(dz) <= 1) continue;
+            fmmDerivatives(dx * h, dy * h, dz * h, s->softening2, 2 * FMM_ORDER,
+                           &s->m2lTables[((size_t)l * 343 + o) * FMM_NDERIV]);
+        }
+    }
+}
+
+static void fmmDownwardCell(FmmSolver* s, int id) {
+    FmmCell& c = s->cells[id];
+    memset(c.L, 0, sizeof(c.L));
+    if (c.parent >= 0) fmmL2L(c, s->cells[c.parent]);
+
+    // V list: precomputed operators indexed by the integer offset
+    for (size_t q = 0; q < s->vList[id].size(); q++) {
+        const FmmCell& o = s->cells[s->vList[id][q]];
+        int off = (c.ix - o.ix + 3) * 49 + (c.iy - o.iy + 3) * 7 + (c.iz - o.iz + 3);
+        fmmM2LApply(c.L, o.M, &s->m2lTables[((size_t)c.level * 343 + off) * FMM_NDERIV]);
+    }
+
+    // X list: bodies of a coarser leaf straight into this local expansion
+    double T[FMM_NDERIV];
+    for (size_t q = 0; q < s->xList[id].size(); q++) {
+        const FmmCell& o = s->cells[s->xList[id][q]];
+        for (int j = o.first; j < o.first + o.count; j++) {
+            float4 b = s->sorted[j];
+            fmmDerivatives(c.cx - b.x, c.cy - b.y, c.cz - b.z, s->softening2, FMM_ORDER, T);
+            for (int l = 0; l < FMM_NCOEF; l++) c.L[l] += b.w * T[l];
+        }
+    }
+}
+
+// Far field for the bodies of one leaf: L2P plus W list (M2P). The
+// potential goes into the w component
+static void fmmLeafFarField(FmmSolver* s, int leafIndex) {
+    int id = s->leaves[leafIndex];
+    const FmmCell& c = s->cells[id];
+    double pw[FMM_NCOEF];
+    double T[FMM_NDERIV];
+
+    for (int j = c.first; j < c.first + c.count; j++) {
+        float4 b = s->sorted[j];
+        double g[3] = { 0.0, 0.0, 0.0 };
+        double phi = 0.0;
+
+        fmmScaledPowers(b.x - c.cx, b.y - c.cy, b.z - c.cz, FMM_ORDER, pw);
+        for (int l = 0; l < FMM_NCOEF; l++) phi += c.L[l] * pw[l];
+        for (int l = 0; g_miDegree[l] <= FMM_ORDER - 1; l++) {
+            g[0] += c.L[g_miIndex[g_mi[l][0] + 1][g_mi[l][1]][g_mi[l][2]]] * pw[l];
+            g[1] += c.L[g_miIndex[g_mi[l][0]][g_mi[l][1] + 1][g_mi[l][2]]] * pw[l];
+            g[2] += c.L[g_miIndex[g_mi[l][0]][g_mi[l][1]][g_mi[l][2] + 1]] * pw[l];
+        }
+
+        for (int w = s->wStart[leafIndex]; w < s->wStart[leafIndex + 1]; w++) {
+            const FmmCell& o = s->cells[s->wCells[w]];
+            fmmDerivatives(b.x - o.cx, b.y - o.cy, b.z - o.cz, s->softening2,
+                           FMM_ORDER + 1, T);
+            for (int n = 0; n < FMM_NCOEF; n++) {
+                double m = fmmSign(n) * o.M[n];
+                phi += m * T[n];
+                g[0] += m * T[g_miIndex[g_mi[n][0] + 1][g_mi[n][1]][g_mi[n][2]]];
+                g[1] += m * T[g_miIndex[g_mi[n][0]][g_mi[n][1] + 1][g_mi[n][2]]];
+                g[2] += m * T[g_miIndex[g_mi[n][0]][g_mi[n][1]][g_mi[n][2] + 1]];
+            }
+        }
+
+        s->far[j] = make_float4((float)(G * g[0]), (float)(G * g[1]), (float)(G * g[2]),
+                                (float)(-G * phi));
+    }
+}
+
+// Near field for one leaf on the host: softened direct sum over its U list
+static void fmmLeafNearFieldHost(FmmSolver* s, int leafIndex) {
+    const FmmCell& c = s->cells[s->leaves[leafIndex]];
+    float eps2 = (float)s->softening2;
+
+    for (int j = c.first; j < c.first + c.count; j++) {
+        float4 me = s->sorted[j];
+        float accx = 0.0f, accy = 0.0f, accz = 0.0f;
+        float phi = G * me.w / sqrtf(eps2);     // Cancels the self pair below
+        for (int q = s->nearStart[leafIndex]; q < s->nearStart[leafIndex + 1]; q++) {
+            int2 src = s->nearRange[q];
+            for (int k = src.x; k < src.x + src.y; k++) {
+                float4 b = s->sorted[k];
+                float dx = b.x - me.x, dy = b.y - me.y, dz = b.z - me.z;
+                float invDist = 1.0f / sqrtf(dx * dx + dy * dy + dz * dz + eps2);
+                float force = G * b.w * invDist * invDist * invDist;
+                accx += dx * force;
+                accy += dy * force;
+                accz += dz * force;
+                phi -= G * b.w * invDist;
+            }
+        }
+        s->far[j].x += accx;
+        s->far[j].y += accy;
+        s->far[j].z += accz;
+        s->far[j].w += phi;
+    }
+}
+
+// Tree and interaction lists for the current positions
+static void fmmPrepare(FmmSolver* s, const float* px, const float* py, const float* pz,
+                       const float* mass, int n, float softening2) {
+    fmmInitTables();
+    s->softening2 = softening2;
+    fmmBuildTree(s, px, py, pz, mass, n);
+    fmmBuildLists(s);
+    fmmPrecomputeM2L(s);
+}
+
+// Expansions and far field; afterwards s->far holds it in Morton order
+static void fmmEvaluateFarField(FmmSolver* s) {
+    // Upward pass, finest level first; cells of one level are independent
+    for (int l = (int)s->levelCells.size() - 1; l >= 0; l--) {
+        fmmParallelFor(s, s->levelCells[l], fmmUpwardCell);
+    }
+    // Downward pass, coarsest level first
+    for (size_t l = 0; l < s->levelCells.size(); l++) {
+        fmmParallelFor(s, s->levelCells[l], fmmDownwardCell);
+    }
+
+    s->far.resize(s->sorted.size());
+    std::vector<int> leafIds(s->leaves.size());
+    for (size_t i = 0; i < leafIds.size(); i++) leafIds[i] = (int)i;
+    fmmParallelFor(s, leafIds, fmmLeafFarField);
+}
+
+// Host-only solve (CPU-only runs): far field plus host near field,
+// scattered back to body order. pot is optional
+void fmmComputeForcesHost(FmmSolver* s, float* ax, float* ay, float* az, float* pot,
+                          const float* px, const float* py, const float* pz,
+                          const float* mass, int n, float softening2) {
+    fmmPrepare(s, px, py, pz, mass, n, softening2);
+    fmmEvaluateFarField(s);
+
+    std::vector<int> leafIds(s->leaves.size());
+    for (size_t i = 0; i < leafIds.size(); i++) leafIds[i] = (int)i;
+    fmmParallelFor(s, leafIds, fmmLeafNearFieldHost);
+
+    for (int k = 0; k < n; k++) {
+        int i = s->order[k];
+        ax[i] = s->far[k].x;
+        ay[i] = s->far[k].y;
+        az[i] = s->far[k].z;
+        if (pot) pot[i] = s->far[k].w;
+    }
+}
+
+void fmmAlloc(FmmSolver* s, int maxBodies) {
+    fmmInitTables();
+    s->numThreads = hostThreadCount();
+    s->softening2 = 0.0;
+#ifndef CPU_ONLY
+    cudaMallocHost(&s->h_x, maxBodies * sizeof(float));
+    cudaMallocHost(&s->h_y, maxBodies * sizeof(float));
+    cudaMallocHost(&s->h_z, maxBodies * sizeof(float));
+    cudaMallocHost(&s->h_mass, maxBodies * sizeof(float));
+    cudaMalloc(&s->d_sorted, maxBodies * sizeof(float4));
+    cudaMalloc(&s->d_near, maxBodies * sizeof(float4));
+    cudaMalloc(&s->d_far, maxBodies * sizeof(float4));
+    cudaMalloc(&s->d_order, maxBodies * sizeof(int));
+    s->d_targetRange = NULL;
+    s->d_nearStart = NULL;
+    s->d_nearRange = NULL;
+    s->leafCapacity = s->rangeCapacity = 0;
+#else
+    (void)maxBodies;
+#endif
+}
+
+void fmmFree(FmmSolver* s) {
+#ifndef CPU_ONLY
+    cudaFreeHost(s->h_x); cudaFreeHost(s->h_y); cudaFreeHost(s->h_z);
+    cudaFreeHost(s->h_mass);
+    cudaFree(s->d_sorted); cudaFree(s->d_near); cudaFree(s->d_far);
+    cudaFree(s->d_order);
+    cudaFree(s->d_targetRange); cudaFree(s->d_nearStart); cudaFree(s->d_nearRange);
+#else
+    (void)s;
+#endif
+}
+
+#ifndef CPU_ONLY
+// One block per target leaf; source leaves are staged through shared memory.
+// Leaves at FMM_MAX_DEPTH may exceed FMM_LEAF_SIZE, hence the outer loops
+__global__ void fmmNearFieldKernel(float4* nearAcc, const float4* sorted,
+                                   const int2* targetRange, const int* nearStart,
+                                   const int2* nearRange, float softening2, float grav)
+{
+    __shared__ float4 shared[FMM_LEAF_SIZE];
+    int2 target = targetRange[blockIdx.x];
+
+    for (int t0 = 0; t0 < target.y; t0 += FMM_LEAF_SIZE) {
+        int j = target.x + t0 + threadIdx.x;
+        int valid = t0 + threadIdx.x < target.y;
+        float4 me = valid ? sorted[j] : make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+        float accx = 0.0f, accy = 0.0f, accz = 0.0f;
+        float phi = grav * me.w * rsqrtf(softening2);  // Cancels the self pair
+
+        for (int q = nearStart[blockIdx.x]; q < nearStart[blockIdx.x + 1]; q++) {
+            int2 src = nearRange[q];
+            for (int s0 = 0; s0 < src.y; s0 += FMM_LEAF_SIZE) {
+                int count = min(FMM_LEAF_SIZE, src.y - s0);
+                __syncthreads();
+                if (threadIdx.x < count) shared[threadIdx.x] = sorted[src.x + s0 + threadIdx.x];
+                __syncthreads();
+
+                for (int k = 0; k < count; k++) {
+                    float4 b = shared[k];
+                    float dx = b.x - me.x;
+                    float dy = b.y - me.y;
+                    float dz = b.z - me.z;
+                    float distSqr = dx * dx + dy * dy + dz * dz + softening2;
+                    float invDist = rsqrtf(distSqr);
+                    float force = grav * b.w * invDist * invDist * invDist;
+                    accx += dx * force;
+                    accy += dy * force;
+                    accz += dz * force;
+                    phi -= grav * b.w * invDist;
+                }
+            }
+        }
+
+        if (valid) nearAcc[j] = make_float4(accx, accy, accz, phi);
+    }
+}
+
+__global__ void fmmCombineKernel(float* ax, float* ay, float* az, float* pot,
+                                 const float4* nearAcc, const float4* farAcc,
+                                 const int* order, int n)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= n) return;
+
+    int i = order[k];
+    ax[i] = nearAcc[k].x + farAcc[k].x;
+    ay[i] = nearAcc[k].y + farAcc[k].y;
+    az[i] = nearAcc[k].z + farAcc[k].z;
+    if (pot) pot[i] = nearAcc[k].w + farAcc[k].w;
+}
+
+// Accelerations (and optionally potentials) for all bodies. The near field
+// runs on the GPU while the host threads evaluate the expansions; the two
+// halves meet in fmmCombineKernel
+void fmmComputeForces(FmmSolver* s,
+                      float* ax, float* ay, float* az, float* pot,
+                      const float* px, const float* py, const float* pz,
+                      const float* mass, int n, float softening2)
+{
+    cudaMemcpy(s->h_x, px, n * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(s->h_y, py, n * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(s->h_z, pz, n * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(s->h_mass, mass, n * sizeof(float), cudaMemcpyDeviceToHost);
+    fmmPrepare(s, s->h_x, s->h_y, s->h_z, s->h_mass, n, softening2);
+
+    // Interaction lists vary per step; grow the device copies as needed
+    int numLeaves = (int)s->leaves.size();
+    int numRanges = (int)s->nearRange.size();
+    if (numLeaves > s->leafCapacity) {
+        cudaFree(s->d_targetRange);
+        cudaFree(s->d_nearStart);
+        s->leafCapacity = numLeaves * 2;
+        cudaMalloc(&s->d_targetRange, s->leafCapacity * sizeof(int2));
+        cudaMalloc(&s->d_nearStart, (s->leafCapacity + 1) * sizeof(int));
+    }
+    if (numRanges > s->rangeCapacity) {
+        cudaFree(s->d_nearRange);
+        s->rangeCapacity = numRanges * 2;
+        cudaMalloc(&s->d_nearRange, s->rangeCapacity * sizeof(int2));
+    }
+
+    cudaMemcpy(s->d_sorted, &s->sorted[0], n * sizeof(float4), cudaMemcpyHostToDevice);
+    cudaMemcpy(s->d_order, &s->order[0], n * sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(s->d_targetRange, &s->targetRange[0], numLeaves * sizeof(int2),
+               cudaMemcpyHostToDevice);
+    cudaMemcpy(s->d_nearStart, &s->nearStart[0], (numLeaves + 1) * sizeof(int),
+               cudaMemcpyHostToDevice);
+    cudaMemcpy(s->d_nearRange, &s->nearRange[0], numRanges * sizeof(int2),
+               cudaMemcpyHostToDevice);
+
+    // Asynchronous launch: the host far field below overlaps with it
+    fmmNearFieldKernel<<<numLeaves, FMM_LEAF_SIZE>>>(s->d_near, s->d_sorted,
+        s->d_targetRange, s->d_nearStart, s->d_nearRange, softening2, G);
+
+    fmmEvaluateFarField(s);
+
+    cudaMemcpy(s->d_far, &s->far[0], n * sizeof(float4), cudaMemcpyHostToDevice);
+    fmmCombineKernel<<<(n + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+        ax, ay, az, pot, s->d_near, s->d_far, s->d_order, n);
+}
+
+// ============== SOLVER DISPATCH ==============
+// Accelerations for all bodies with the selected solver; each solver can
+// produce the potential in the same pass (pot non-NULL, for diagnostics)
+void computeForces(int solver, BHTree* tree, FmmSolver* fmm,
+                   float* ax, float* ay, float* az, float* pot,
+                   const float* px, const float* py, const float* pz,
+                   const float* mass, int n, float softening2, float theta)
+{
+    int blocks = (n + TILE_SIZE - 1) / TILE_SIZE;
+    if (solver == SOLVER_FMM) {
+        fmmComputeForces(fmm, ax, ay, az, pot, px, py, pz, mass, n, softening2);
+    } else if (solver == SOLVER_BARNES_HUT) {
+        bhComputeForces(tree, ax, ay, az, pot, px, py, pz, mass, n,
+                        NULL, 0, softening2, G, theta);
+    } else if (pot) {
+        computeForcesPotentialKernel<<<blocks, TILE_SIZE>>>(
+            ax, ay, az, pot, px, py, pz, mass, n, softening2, G);
+    } else {
+        computeForcesKernel<<<blocks, TILE_SIZE>>>(
+            ax, ay, az, px, py, pz, mass, n, softening2, G);
+    }
+}
+
+// ============== HERMITE / LEAPFROG STEPPERS ==============
+// 4th-order Hermite predictor-corrector (Makino & Aarseth 1992):
+//   predict  x_p = x + v dt + a dt^2/2 + j dt^3/6,   v_p = v + a dt + j dt^2/2
+//   evaluate a1, j1 at (x_p, v_p) with the tiled direct sum
+//   correct  v1 = v + (a0 + a1) dt/2 + (j0 - j1) dt^2/12
+//            x1 = x + (v + v1) dt/2 + (a0 - a1) dt^2/12
+// The jerk j = G m [dv/r^3 - 3 (dr.dv) dr/r^5] needs velocities and is only
+// available from the direct sum, so Hermite ignores the tree solvers.
+
+struct Hermite {
+    float4* predPos;        // Predicted x, y, z and mass
+    float4* predVel;
+    float4* acc1;           // Acceleration and jerk at the predicted state
+    float4* jerk1;
+    float4* jerk;           // Jerk at the start of the step (acceleration in ax/ay/az)
+};
+
+__global__ void hermitePredictKernel(
+    float4* predPos, float4* predVel,
+    const float* px, const float* py, const float* pz,
+    const float* vx, const float* vy, const float* vz,
+    const float* ax, const float* ay, const float* az,
+    const float4* jerk, const float* mass, int n, float dt)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    float dt2 = dt * dt * 0.5f;
+    float dt3 = dt * dt * dt / 6.0f;
+    float4 j = jerk[i];
+    predPos[i] = make_float4(px[i] + vx[i] * dt + ax[i] * dt2 + j.x * dt3,
+                             py[i] + vy[i] * dt + ay[i] * dt2 + j.y * dt3,
+                             pz[i] + vz[i] * dt + az[i] * dt2 + j.z * dt3,
+                             mass[i]);
+    predVel[i] = make_float4(vx[i] + ax[i] * dt + j.x * dt2,
+                             vy[i] + ay[i] * dt + j.y * dt2,
+                             vz[i] + az[i] * dt + j.z * dt2,
+                             0.0f);
+}
+
+// Tiled direct sum of acceleration and jerk (positions and velocities
+// staged together through shared memory)
+__global__ void hermiteForceKernel(
+    float4* acc, float4* jerk,
+    const float4* pos, const float4* vel,
+    int n, float softening2, float grav)
+{
+    __shared__ float4 tilePos[TILE_SIZE];
+    __shared__ float4 tileVel[TILE_SIZE];
+
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    float4 myPos = i < n ? pos[i] : make_float4(0, 0, 0, 0);
+    float4 myVel = i < n ? vel[i] : make_float4(0, 0, 0, 0);
+
+    float accx = 0.0f, accy = 0.0f, accz = 0.0f;
+    float jx = 0.0f, jy = 0.0f, jz = 0.0f;
+
+    int numTiles = (n + TILE_SIZE - 1) / TILE_SIZE;
+    for (int tile_idx = 0; tile_idx < numTiles; tile_idx++) {
+        int j = tile_idx * TILE_SIZE + threadIdx.x;
+        tilePos[threadIdx.x] = j < n ? pos[j] : make_float4(0, 0, 0, 0);
+        tileVel[threadIdx.x] = j < n ? vel[j] : make_float4(0, 0, 0, 0);
+        __syncthreads();
+
+        #pragma unroll 4
+        for (int k = 0; k < TILE_SIZE; k++) {
+            float dx = tilePos[k].x - myPos.x;
+            float dy = tilePos[k].y - myPos.y;
+            float dz = tilePos[k].z - myPos.z;
+            float dvx = tileVel[k].x - myVel.x;
+            float dvy = tileVel[k].y - myVel.y;
+            float dvz = tileVel[k].z - myVel.z;
+
+            float dist2 = dx * dx + dy * dy + dz * dz + softening2;
+            float invDist = rsqrtf(dist2);
+            float invDist2 = invDist * invDist;
+            float force = grav * tilePos[k].w * invDist2 * invDist;
+            float rv = 3.0f * (dx * dvx + dy * dvy + dz * dvz) * invDist2;
+
+            accx += dx * force;
+            accy += dy * force;
+            accz += dz * force;
+            jx += (dvx - rv * dx) * force;
+            jy += (dvy - rv * dy) * force;
+            jz += (dvz - rv * dz) * force;
+        }
+        __syncthreads();
+    }
+
+    if (i < n) {
+        acc[i] = make_float4(accx, accy, accz, 0.0f);
+        jerk[i] = make_float4(jx, jy, jz, 0.0f);
+    }
+}
+
+// Corrector; also makes a1/j1 the start values of the next step
+__global__ void hermiteCorrectKernel(
+    float* px, float* py, float* pz,
+    float* vx, float* vy, float* vz,
+    float* ax, float* ay, float* az, float4* jerk,
+    const float4* acc1, const float4* jerk1, int n, float dt)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    float4 j0 = jerk[i];
+    float4 a1 = acc1[i];
+    float4 j1 = jerk1[i];
+    float half = 0.5f * dt;
+    float dt2 = dt * dt / 12.0f;
+
+    float nvx = vx[i] + (ax[i] + a1.x) * half + (j0.x - j1.x) * dt2;
+    float nvy = vy[i] + (ay[i] + a1.y) * half + (j0.y - j1.y) * dt2;
+    float nvz = vz[i] + (az[i] + a1.z) * half + (j0.z - j1.z) * dt2;
+    px[i] += (vx[i] + nvx) * half + (ax[i] - a1.x) * dt2;
+    py[i] += (vy[i] + nvy) * half + (ay[i] - a1.y) * dt2;
+    pz[i] += (vz[i] + nvz) * half + (az[i] - a1.z) * dt2;
+    vx[i] = nvx;
+    vy[i] = nvy;
+    vz[i] = nvz;
+
+    ax[i] = a1.x;
+    ay[i] = a1.y;
+    az[i] = a1.z;
+    jerk[i] = j1;
+}
+
+void hermiteAlloc(Hermite* h, int maxBodies) {
+    cudaMalloc(&h->predPos, maxBodies * sizeof(float4));
+    cudaMalloc(&h->predVel, maxBodies * sizeof(float4));
+    cudaMalloc(&h->acc1, maxBodies * sizeof(float4));
+    cudaMalloc(&h->jerk1, maxBodies * sizeof(float4));
+    cudaMalloc(&h->jerk, maxBodies * sizeof(float4));
+}
+
+void hermiteFree(Hermite* h) {
+    cudaFree(h->predPos); cudaFree(h->predVel);
+    cudaFree(h->acc1); cudaFree(h->jerk1); cudaFree(h->jerk);
+}
+
+// One Hermite step. Without valid start values (haveAcc = 0) they are first
+// evaluated at the current state by a zero-length predict/correct
+void hermiteStep(Hermite* h,
+                 float* px, float* py, float* pz,
+                 float* vx, float* vy, float* vz,
+                 float* ax, float* ay, float* az,
+                 const float* mass, int n, float dt, float softening2, int haveAcc)
+{
+    int blocks = (n + TILE_SIZE - 1) / TILE_SIZE;
+
+    if (!haveAcc) {
+        cudaMemset(ax, 0, n * sizeof(float));
+        cudaMemset(ay, 0, n * sizeof(float));
+        cudaMemset(az, 0, n * sizeof(float));
+        cudaMemset(h->jerk, 0, n * sizeof(float4));
+        hermitePredictKernel<<<blocks, TILE_SIZE>>>(h->predPos, h->predVel,
+            px, py, pz, vx, vy, vz, ax, ay, az, h->jerk, mass, n, 0.0f);
+        hermiteForceKernel<<<blocks, TILE_SIZE>>>(h->acc1, h->jerk1,
+            h->predPos, h->predVel, n, softening2, G);
+        hermiteCorrectKernel<<<blocks, TILE_SIZE>>>(px, py, pz, vx, vy, vz,
+            ax, ay, az, h->jerk, h->acc1, h->jerk1, n, 0.0f);
+    }
+
+    hermitePredictKernel<<<blocks, TILE_SIZE>>>(h->predPos, h->predVel,
+        px, py, pz, vx, vy, vz, ax, ay, az, h->jerk, mass, n, dt);
+    hermiteForceKernel<<<blocks, TILE_SIZE>>>(h->acc1, h->jerk1,
+        h->predPos, h->predVel, n, softening2, G);
+    hermiteCorrectKernel<<<blocks, TILE_SIZE>>>(px, py, pz, vx, vy, vz,
+        ax, ay, az, h->jerk, h->acc1, h->jerk1, n, dt);
+}
+
+// One kick-drift-kick step with any force solver
+// (pot, if non-NULL, receives the potential at the end of the step)
+void leapfrogStep(int solver, BHTree* tree, FmmSolver* fmm,
+                  float* px, float* py, float* pz,
+                  float* vx, float* vy, float* vz,
+                  float* ax, float* ay, float* az, float* pot,
+                  const float* mass, int n, float dt, float softening2, float theta,
+                  int haveAcc)
+{
+    int blocks = (n + TILE_SIZE - 1) / TILE_SIZE;
+    if (!haveAcc) {
+        computeForces(solver, tree, fmm, ax, ay, az, NULL, px, py, pz, mass, n,
+                      softening2, theta);
+    }
+    leapfrogKickDriftKernel<<<blocks, TILE_SIZE>>>(px, py, pz, vx, vy, vz, ax, ay, az, n, dt);
+    computeForces(solver, tree, fmm, ax, ay, az, pot, px, py, pz, mass, n, softening2, theta);
+    leapfrogKickKernel<<<blocks, TILE_SIZE>>>(vx, vy, vz, ax, ay, az, n, dt);
+}
+
+// ============== HIERARCHICAL BLOCK TIME STEPS ==============
+// Each body advances with its own step dt / 2^level (level 0..MAX_LEVEL) on
+// an integer timeline of 2^MAX_LEVEL ticks per frame step. Kick-drift-kick:
+// all bodies drift every sub-step (cheap), but only bodies whose step ends
+// on the current tick get new forces and kicks, so a handful of close
+// encounters no longer force the whole system onto the smallest step.
+//
+// Step selection per body, the smaller of:
+//   acceleration:  sqrt(2 * ETA_ACC * softening / |a|)
+//   jerk:          ETA_JERK * |a| / |j|, jerk estimated from the change in
+//                  acceleration across the body's last step
+// A body may move to a finer level at any sync point but only to a coarser
+// one when the tick is aligned to the coarser step.
+
+#define MAX_LEVEL 6                 // Up to 64 sub-steps per frame step
+#define ETA_ACC 0.05f
+#define ETA_JERK 0.1f
+
+struct BlockSteps {
+    int* level;                     // Per-body step level
+    int* active;                    // Compacted list of bodies synced this tick
+    int* stats;                     // [0] active count, [1] max level
+    int* h_stats;
+    float *axNew, *ayNew, *azNew;   // Fresh accelerations for active bodies
+    int initialized;
+    int maxLevel;
+    long long forceEvals;           // Target evaluations since last report
+    long long substeps;
+};
+
+__device__ int chooseLevel(float ax, float ay, float az,
+                           float jx, float jy, float jz, int haveJerk,
+                           float dtBase, float softening)
+{
+    float a = sqrtf(ax * ax + ay * ay + az * az);
+    float dt = dtBase;
+    if (a > 0.0f) dt = fminf(dt, sqrtf(2.0f * ETA_ACC * softening / a));
+    if (haveJerk) {
+        float j = sqrtf(jx * jx + jy * jy + jz * jz);
+        if (j > 0.0f) dt = fminf(dt, ETA_JERK * a / j);
+    }
+
+    int level = (int)ceilf(log2f(dtBase / dt));
+    return max(0, min(MAX_LEVEL, level));
+}
+
+__global__ void blockDriftKernel(
+    float* px, float* py, float* pz,
+    const float* vx, const float* vy, const float* vz,
+    int n, float h)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    px[i] += vx[i] * h;
+    py[i] += vy[i] * h;
+    pz[i] += vz[i] * h;
+}
+
+// Collect bodies whose step ends at 'tick', counting them in stats[0],
+// which must start at zero (see blockMarkActive)
+__global__ void blockMarkActiveKernel(int* active, int* stats, const int* level,
+                                      int n, int tick)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    int ticks = (1 << MAX_LEVEL) >> level[i];
+    if (tick % ticks == 0) {
+        active[atomicAdd(&stats[0], 1)] = i;
+    }
+}
+
+// Closing half-kick of the finished step, new level, opening half-kick
+__global__ void blockKickKernel(
+    float* vx, float* vy, float* vz,
+    float* ax, float* ay, float* az,
+    const float* axNew, const float* ayNew, const float* azNew,
+    int* level, const int* active, int numActive,
+    int tick, int first, float dtBase, float softening)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= numActive) return;
+
+    int i = active[k];
+    float nx = axNew[i], ny = ayNew[i], nz = azNew[i];
+
+    int oldLevel = level[i];
+    float dtOld = dtBase / (1 << oldLevel);
+    if (!first) {
+        vx[i] += nx * dtOld * 0.5f;
+        vy[i] += ny * dtOld * 0.5f;
+        vz[i] += nz * dtOld * 0.5f;
+    }
+
+    float inv = first ? 0.0f : 1.0f / dtOld;
+    int newLevel = chooseLevel(nx, ny, nz,
+                               (nx - ax[i]) * inv, (ny - ay[i]) * inv, (nz - az[i]) * inv,
+                               !first, dtBase, softening);
+
+    // Coarsen only where the timeline lines up with the coarser step
+    while (!first && newLevel < oldLevel && tick % ((1 << MAX_LEVEL) >> newLevel) != 0) {
+        newLevel++;
+    }
+    level[i] = newLevel;
+
+    float dtNew = dtBase / (1 << newLevel);
+    vx[i] += nx * dtNew * 0.5f;
+    vy[i] += ny * dtNew * 0.5f;
+    vz[i] += nz * dtNew * 0.5f;
+
+    ax[i] = nx;
+    ay[i] = ny;
+    az[i] = nz;
+}
+
+__global__ void blockMaxLevelKernel(int* stats, const int* level, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+    atomicMax(&stats[1], level[i]);
+}
+
+void blockStepsAlloc(BlockSteps* b, int maxBodies) {
+    cudaMalloc(&b->level, maxBodies * sizeof(int));
+    cudaMalloc(&b->active, maxBodies * sizeof(int));
+    cudaMalloc(&b->stats, 2 * sizeof(int));
+    cudaMallocHost(&b->h_stats, 2 * sizeof(int));
+    cudaMalloc(&b->axNew, maxBodies * sizeof(float));
+    cudaMalloc(&b->ayNew, maxBodies * sizeof(float));
+    cudaMalloc(&b->azNew, maxBodies * sizeof(float));
+    b->initialized = 0;
+    b->maxLevel = 0;
+    b->forceEvals = 0;
+    b->substeps = 0;
+}
+
+void blockStepsFree(BlockSteps* b) {
+    cudaFree(b->level); cudaFree(b->active); cudaFree(b->stats);
+    cudaFreeHost(b->h_stats);
+    cudaFree(b->axNew); cudaFree(b->ayNew); cudaFree(b->azNew);
+}
+
+// Accelerations for the bodies in b->active (count numActive) into b->axNew
+// (FMM has no per-target path and evaluates every body, so it is charged
+// all n and block steps save it nothing)
+void blockActiveForces(BlockSteps* b, int numActive, int solver, BHTree* tree,
+                       FmmSolver* fmm,
+                       const float* px, const float* py, const float* pz,
+                       const float* mass, int n, float softening2, float theta)
+{
+    if (solver == SOLVER_FMM) {
+        fmmComputeForces(fmm, b->axNew, b->ayNew, b->azNew, NULL, px, py, pz, mass, n,
+                         softening2);
+        b->forceEvals += n;
+        return;
+    }
+    if (solver == SOLVER_BARNES_HUT) {
+        bhComputeForces(tree, b->axNew, b->ayNew, b->azNew, NULL, px, py, pz, mass, n,
+                        b->active, numActive, softening2, G, theta);
+    } else {
+        computeForcesActiveKernel<<<(numActive + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+            b->axNew, b->ayNew, b->azNew, px, py, pz, mass,
+            b->active, numActive, n, softening2, G);
+    }
+    b->forceEvals += numActive;
+}
+
+// Clears both stats (the active count and the max level that
+// blockMaxLevelKernel raises afterwards) and collects the bodies due at tick
+static void blockMarkActive(BlockSteps* b, int n, int tick) {
+    cudaMemset(b->stats, 0, 2 * sizeof(int));
+    blockMarkActiveKernel<<<(n + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+        b->active, b->stats, b->level, n, tick);
+}
+
+// Advances all bodies by one frame step dtBase using individual block steps
+void blockStep(BlockSteps* b, int solver, BHTree* tree, FmmSolver* fmm,
+               float* px, float* py, float* pz,
+               float* vx, float* vy, float* vz,
+               float* ax, float* ay, float* az,
+               const float* mass, int n,
+               float dtBase, float softening, float theta)
+{
+    int blocks = (n + TILE_SIZE - 1) / TILE_SIZE;
+    int ticksPerStep = 1 << MAX_LEVEL;
+    float softening2 = softening * softening;
+
+    // Start of a run: everyone is active, pick levels, opening half-kick
+    if (!b->initialized) {
+        cudaMemset(b->level, 0, n * sizeof(int));
+        blockMarkActive(b, n, 0);
+        blockActiveForces(b, n, solver, tree, fmm, px, py, pz, mass, n, softening2, theta);
+        blockKickKernel<<<blocks, TILE_SIZE>>>(vx, vy, vz, ax, ay, az,
+            b->axNew, b->ayNew, b->azNew, b->level, b->active, n,
+            0, 1, dtBase, softening);
+        blockMaxLevelKernel<<<blocks, TILE_SIZE>>>(b->stats, b->level, n);
+        cudaMemcpy(b->h_stats, b->stats, 2 * sizeof(int), cudaMemcpyDeviceToHost);
+        b->maxLevel = b->h_stats[1];
+        b->initialized = 1;
+    }
+
+    int tick = 0;
+    while (tick < ticksPerStep) {
+        // Next sync point of the finest level currently in use (after a
+        // level coarsens the current tick need not be aligned to it)
+        int stepTicks = ticksPerStep >> b->maxLevel;
+        int next = (tick / stepTicks + 1) * stepTicks;
+        float h = dtBase * (next - tick) / ticksPerStep;
+        tick = next;
+
+        blockDriftKernel<<<blocks, TILE_SIZE>>>(px, py, pz, vx, vy, vz, n, h);
+
+        blockMarkActive(b, n, tick);
+        cudaMemcpy(b->h_stats, b->stats, 2 * sizeof(int), cudaMemcpyDeviceToHost);
+        int numActive = b->h_stats[0];
+
+        if (numActive > 0) {
+            blockActiveForces(b, numActive, solver, tree, fmm, px, py, pz, mass, n,
+                              softening2, theta);
+            blockKickKernel<<<(numActive + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+                vx, vy, vz, ax, ay, az, b->axNew, b->ayNew, b->azNew,
+                b->level, b->active, numActive, tick, 0, dtBase, softening);
+        }
+
+        blockMaxLevelKernel<<<blocks, TILE_SIZE>>>(b->stats, b->level, n);
+        cudaMemcpy(&b->maxLevel, &b->stats[1], sizeof(int), cudaMemcpyDeviceToHost);
+        b->substeps++;
+    }
+}
+
+// ============== DIAGNOSTICS ==============
+// Conserved quantities every k steps: kinetic and potential energy, linear
+// and angular momentum, and the virial ratio 2K/|W| with W = sum m r.a.
+// The O(N^2) / tree part, the per-body potential, comes out of the force
+// pass the step runs anyway (computeForces with pot); what remains is one
+// O(N) block-reduction kernel after the step, once velocities are in sync
+// with positions. Integrators without a fused pass (Hermite, block steps)
+// get an extra force evaluation on diagnostics steps.
+
+#define DIAG_BLOCKS 64
+#define DIAG_DEFAULT_EVERY 10
+
+// Reduced fields
+#define DIAG_KINETIC 0
+#define DIAG_POTENTIAL 1
+#define DIAG_VIRIAL 2
+#define DIAG_MOMENTUM 3         // 3 components
+#define DIAG_ANGULAR 6          // 3 components
+#define DIAG_MOMENTUM_SCALE 9   // sum m|v|, for relative momentum drift
+#define DIAG_ANGULAR_SCALE 10   // sum m|r x v|
+#define DIAG_FIELDS 11
+
+struct Diagnostics {
+    int enabled;
+    int every;                      // Measure every k-th step
+    float* pot;                     // Potential per body
+    float *ax, *ay, *az;            // Scratch accelerations for extra passes
+    float* partials;                // DIAG_BLOCKS x DIAG_FIELDS block sums
+    float* h_partials;
+    double values[DIAG_FIELDS];     // Last measurement
+    double reference[DIAG_FIELDS];  // First measurement since reset
+    int haveReference;
+    int measured;                   // A measurement is ready to report
+    double energyDrift, momentumDrift, angularDrift, virialRatio;
+    FILE* csv;
+};
+
+__global__ void diagnosticsKernel(
+    float* partials,
+    const float* px, const float* py, const float* pz,
+    const float* vx, const float* vy, const float* vz,
+    const float* ax, const float* ay, const float* az,
+    const float* pot, const float* mass, int n)
+{
+    __shared__ float sums[DIAG_FIELDS][TILE_SIZE];
+    float v[DIAG_FIELDS];
+    for (int f = 0; f < DIAG_FIELDS; f++) v[f] = 0.0f;
+
+    for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += blockDim.x * gridDim.x) {
+        float m = mass[i];
+        float x = px[i], y = py[i], z = pz[i];
+        float u = vx[i], w = vy[i], q = vz[i];
+        float lx = y * q - z * w;
+        float ly = z * u - x * q;
+        float lz = x * w - y * u;
+
+        v[DIAG_KINETIC] += 0.5f * m * (u * u + w * w + q * q);
+        v[DIAG_POTENTIAL] += 0.5f * m * pot[i];
+        v[DIAG_VIRIAL] += m * (x * ax[i] + y * ay[i] + z * az[i]);
+        v[DIAG_MOMENTUM + 0] += m * u;
+        v[DIAG_MOMENTUM + 1] += m * w;
+        v[DIAG_MOMENTUM + 2] += m * q;
+        v[DIAG_ANGULAR + 0] += m * lx;
+        v[DIAG_ANGULAR + 1] += m * ly;
+        v[DIAG_ANGULAR + 2] += m * lz;
+        v[DIAG_MOMENTUM_SCALE] += m * sqrtf(u * u + w * w + q * q);
+        v[DIAG_ANGULAR_SCALE] += m * sqrtf(lx * lx + ly * ly + lz * lz);
+    }
+
+    for (int f = 0; f < DIAG_FIELDS; f++) sums[f][threadIdx.x] = v[f];
+    __syncthreads();
+    for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) {
+        if (threadIdx.x < stride) {
+            for (int f = 0; f < DIAG_FIELDS; f++) {
+                sums[f][threadIdx.x] += sums[f][threadIdx.x + stride];
+            }
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x < DIAG_FIELDS) {
+        partials[blockIdx.x * DIAG_FIELDS + threadIdx.x] = sums[threadIdx.x][0];
+    }
+}
+
+void diagnosticsAlloc(Diagnostics* d, int maxBodies) {
+    memset(d, 0, sizeof(*d));
+    d->every = DIAG_DEFAULT_EVERY;
+    cudaMalloc(&d->pot, maxBodies * sizeof(float));
+    cudaMalloc(&d->ax, maxBodies * sizeof(float));
+    cudaMalloc(&d->ay, maxBodies * sizeof(float));
+    cudaMalloc(&d->az, maxBodies * sizeof(float));
+    cudaMalloc(&d->partials, DIAG_BLOCKS * DIAG_FIELDS * sizeof(float));
+    cudaMallocHost(&d->h_partials, DIAG_BLOCKS * DIAG_FIELDS * sizeof(float));
+}
+
+void diagnosticsFree(Diagnostics* d) {
+    if (d->csv) fclose(d->csv);
+    cudaFree(d->pot);
+    cudaFree(d->ax); cudaFree(d->ay); cudaFree(d->az);
+    cudaFree(d->partials);
+    cudaFreeHost(d->h_partials);
+}
+
+int diagnosticsOpenCsv(Diagnostics* d, const char* path) {
+    d->csv = fopen(path, "w");
+    if (!d->csv) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return -1;
+    }
+    fprintf(d->csv, "step,time,bodies,solver,integrator,dt,step_ms,kinetic,potential,"
+                    "total,energy_drift,momentum_drift,angular_drift,virial_ratio\n");
+    return 0;
+}
+
+// Reduces the state (accelerations and d->pot must match the positions) and
+// updates the drifts relative to the first measurement
+void diagnosticsReduce(Diagnostics* d,
+                       const float* px, const float* py, const float* pz,
+                       const float* vx, const float* vy, const float* vz,
+                       const float* ax, const float* ay, const float* az,
+                       const float* mass, int n)
+{
+    diagnosticsKernel<<<DIAG_BLOCKS, TILE_SIZE>>>(d->partials, px, py, pz, vx, vy, vz,
+                                                  ax, ay, az, d->pot, mass, n);
+    cudaMemcpy(d->h_partials, d->partials, DIAG_BLOCKS * DIAG_FIELDS * sizeof(float),
+               cudaMemcpyDeviceToHost);
+
+    double* v = d->values;
+    for (int f = 0; f < DIAG_FIELDS; f++) {
+        v[f] = 0.0;
+        for (int b = 0; b < DIAG_BLOCKS; b++) v[f] += d->h_partials[b * DIAG_FIELDS + f];
+    }
+    if (!d->haveReference) {
+        memcpy(d->reference, v, sizeof(d->reference));
+        d->haveReference = 1;
+    }
+
+    const double* r = d->reference;
+    double e0 = r[DIAG_KINETIC] + r[DIAG_POTENTIAL];
+    double e = v[DIAG_KINETIC] + v[DIAG_POTENTIAL];
+    double dp[3], dl[3];
+    for (int c = 0; c < 3; c++) {
+        dp[c] = v[DIAG_MOMENTUM + c] - r[DIAG_MOMENTUM + c];
+        dl[c] = v[DIAG_ANGULAR + c] - r[DIAG_ANGULAR + c];
+    }
+    d->energyDrift = (e - e0) / fmax(fabs(e0), 1e-30);
+    d->momentumDrift = sqrt(dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2]) /
+                       fmax(r[DIAG_MOMENTUM_SCALE], 1e-30);
+    d->angularDrift = sqrt(dl[0] * dl[0] + dl[1] * dl[1] + dl[2] * dl[2]) /
+                      fmax(r[DIAG_ANGULAR_SCALE], 1e-30);
+    d->virialRatio = 2.0 * v[DIAG_KINETIC] / fmax(fabs(v[DIAG_VIRIAL]), 1e-30);
+    d->measured = 1;
+}
+
+// Measurement with its own force pass, for integrators that do not leave
+// potentials behind
+void diagnosticsEvaluate(Diagnostics* d, int solver, BHTree* tree, FmmSolver* fmm,
+                         const float* px, const float* py, const float* pz,
+                         const float* vx, const float* vy, const float* vz,
+                         const float* mass, int n, float softening2, float theta)
+{
+    computeForces(solver, tree, fmm, d->ax, d->ay, d->az, d->pot, px, py, pz, mass, n,
+                  softening2, theta);
+    diagnosticsReduce(d, px, py, pz, vx, vy, vz, d->ax, d->ay, d->az, mass, n);
+}
+
+void diagnosticsWriteCsv(Diagnostics* d, unsigned long long step, double time, int n,
+                         const char* solver, const char* integrator, float dt, float stepMs)
+{
+    if (!d->csv) return;
+    const double* v = d->values;
+    fprintf(d->csv, "%llu,%.6f,%d,%s,%s,%.6f,%.3f,%.9e,%.9e,%.9e,%.3e,%.3e,%.3e,%.5f\n",
+            step, time, n, solver, integrator, dt, stepMs,
+            v[DIAG_KINETIC], v[DIAG_POTENTIAL], v[DIAG_KINETIC] + v[DIAG_POTENTIAL],
+            d->energyDrift, d->momentumDrift, d->angularDrift, d->virialRatio);
+}
+
+// ============== SNAPSHOTS & TRAJECTORY ==============
+// One on-disk record format serves both checkpoints and trajectories:
+//
+//   SnapshotHeader | pad | x | pad | y | ... | mass | pad
+//
+// Every column starts on a SNAPSHOT_ALIGN boundary from the record start and
+// recordBytes is a multiple of it, so a file of concatenated records (a
+// trajectory) can be mmap'ed and each column used as a plain float array.
+// Restart reads the last complete record of a file.
+
+#define SNAPSHOT_MAGIC "NBODYSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 4096
+#define SNAPSHOT_CHUNK_BYTES (4 << 20)  // Largest single write()
+#define SNAPSHOT_COLUMNS 7              // x y z vx vy vz mass
+#define TRAJECTORY_DEFAULT_EVERY 10
+#define CHECKPOINT_PATH "nbody_checkpoint.nbs"
+
+struct SnapshotHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int headerBytes;
+    unsigned long long recordBytes;     // Header + columns + padding
+    unsigned int numBodies;
+    unsigned int numColumns;
+    unsigned long long step;
+    double time;
+    float dt;
+    int preset;
+    unsigned long long columnOffset[SNAPSHOT_COLUMNS];
+};
+
+static unsigned long long alignUp(unsigned long long v) {
+    return (v + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+void snapshotHeaderInit(SnapshotHeader* h, int n, unsigned long long step,
+                        double time, float dt, int preset) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SNAPSHOT_MAGIC, 8);
+    h->version = SNAPSHOT_VERSION;
+    h->headerBytes = sizeof(SnapshotHeader);
+    h->numBodies = n;
+    h->numColumns = SNAPSHOT_COLUMNS;
+    h->step = step;
+    h->time = time;
+    h->dt = dt;
+    h->preset = preset;
+
+    unsigned long long offset = alignUp(sizeof(SnapshotHeader));
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        h->columnOffset[c] = offset;
+        offset = alignUp(offset + (unsigned long long)n * sizeof(float));
+    }
+    h->recordBytes = offset;
+}
+
+static int writeFully(int fd, const void* data, size_t bytes) {
+    const char* p = (const char*)data;
+    while (bytes > 0) {
+        size_t chunk = bytes < SNAPSHOT_CHUNK_BYTES ? bytes : SNAPSHOT_CHUNK_BYTES;
+        ssize_t written = write(fd, p, chunk);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        bytes -= written;
+    }
+    return 0;
+}
+
+static int writePadding(int fd, unsigned long long from, unsigned long long to) {
+    static const char zeros[SNAPSHOT_ALIGN] = { 0 };
+    return to > from ? writeFully(fd, zeros, to - from) : 0;
+}
+
+// Appends one record at the current file position
+int snapshotWriteRecord(int fd, const SnapshotHeader* h, float* const columns[SNAPSHOT_COLUMNS]) {
+    if (writeFully(fd, h, sizeof(*h)) < 0) return -1;
+    unsigned long long pos = sizeof(*h);
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        if (writePadding(fd, pos, h->columnOffset[c]) < 0) return -1;
+        if (writeFully(fd, columns[c], h->numBodies * sizeof(float)) < 0) return -1;
+        pos = h->columnOffset[c] + h->numBodies * sizeof(float);
+    }
+    return writePadding(fd, pos, h->recordBytes);
+}
+
+int snapshotSave(const char* path, const Bodies* b, int n, unsigned long long step,
+                 double time, float dt, int preset) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    SnapshotHeader h;
+    snapshotHeaderInit(&h, n, step, time, dt, preset);
+    float* const columns[SNAPSHOT_COLUMNS] = { b->x, b->y, b->z, b->vx, b->vy, b->vz, b->mass };
+    int result = snapshotWriteRecord(fd, &h, columns);
+    if (close(fd) < 0) result = -1;
+    if (result < 0) fprintf(stderr, "Error writing %s\n", path);
+    return result;
+}
+
+// A record is usable only if every column lies inside it
+static int snapshotHeaderValid(const SnapshotHeader* h) {
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0 || h->version != SNAPSHOT_VERSION ||
+        h->numColumns != SNAPSHOT_COLUMNS || h->recordBytes < sizeof(SnapshotHeader) ||
+        h->recordBytes % SNAPSHOT_ALIGN != 0) {
+        return 0;
+    }
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        if (h->columnOffset[c] < sizeof(SnapshotHeader) ||
+            h->columnOffset[c] > h->recordBytes ||
+            h->numBodies * (unsigned long long)sizeof(float) > h->recordBytes - h->columnOffset[c]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps the file and copies its last complete record into b (capacity
+// maxBodies). Returns the body count, or -1 on error
+int snapshotLoad(const char* path, Bodies* b, int maxBodies, SnapshotHeader* out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t fileBytes = st.st_size;
+    const char* base = (const char*)mmap(NULL, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Walk the records; a truncated final record (interrupted run) is ignored.
+    // The loop guard keeps pos <= fileBytes, so the remainder cannot wrap
+    const SnapshotHeader* last = NULL;
+    int records = 0;
+    size_t pos = 0;
+    while (pos + sizeof(SnapshotHeader) <= fileBytes) {
+        const SnapshotHeader* h = (const SnapshotHeader*)(base + pos);
+        if (!snapshotHeaderValid(h) || h->recordBytes > fileBytes - pos) break;
+        last = h;
+        records++;
+        pos += h->recordBytes;
+    }
+
+    int n = -1;
+    if (!last) {
+        fprintf(stderr, "%s: no complete snapshot record\n", path);
+    } else if (last->numBodies > (unsigned int)maxBodies) {
+        fprintf(stderr, "%s: %u bodies exceeds the maximum of %d\n", path,
+                last->numBodies, maxBodies);
+    } else {
+        n = last->numBodies;
+        float* columns[SNAPSHOT_COLUMNS] = { b->x, b->y, b->z, b->vx, b->vy, b->vz, b->mass };
+        for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+            memcpy(columns[c], (const char*)last + last->columnOffset[c], n * sizeof(float));
+        }
+        *out = *last;
+        printf("Loaded %s: %d bodies, step %llu (last of %d records)\n",
+               path, n, last->step, records);
+    }
+    munmap((void*)base, fileBytes);
+    return n;
+}
+
+// Trajectory stream: every k-th step the state is copied device-to-device
+// into one of two staging buffers (cheap, in stream order, so the next step
+// may overwrite the live arrays), then device-to-host on a separate stream.
+// A writer thread waits for each copy and appends the record in chunks, so
+// the simulation only blocks if the disk falls two frames behind.
+struct Trajectory {
+    int fd;
+    int every;
+    int capacity;                       // Bodies per staging buffer
+    float* d_stage[2];
+    float* h_stage[2];
+    SnapshotHeader header[2];
+    cudaStream_t stream;
+    cudaEvent_t staged[2], copied[2];
+    int pending[2];                     // Owned by the writer until written
+    int next;                           // Buffer for the next capture
+    int stop;
+    int failed;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long long frames, stalls;
+    unsigned long long bytes;
+};
+
+static void trajectoryAllocBuffers(Trajectory* t, int capacity) {
+    for (int i = 0; i < 2; i++) {
+        cudaMalloc(&t->d_stage[i], (size_t)SNAPSHOT_COLUMNS * capacity * sizeof(float));
+        cudaMallocHost(&t->h_stage[i], (size_t)SNAPSHOT_COLUMNS * capacity * sizeof(float));
+    }
+    t->capacity = capacity;
+}
+
+static void trajectoryFreeBuffers(Trajectory* t) {
+    for (int i = 0; i < 2; i++) {
+        cudaFree(t->d_stage[i]);
+        cudaFreeHost(t->h_stage[i]);
+    }
+}
+
+static void* trajectoryWriter(void* arg) {
+    Trajectory* t = (Trajectory*)arg;
+    int current = 0;
+    for (;;) {
+        pthread_mutex_lock(&t->lock);
+        while (!t->pending[current] && !t->stop) pthread_cond_wait(&t->cond, &t->lock);
+        if (!t->pending[current]) {
+            pthread_mutex_unlock(&t->lock);
+            break;
+        }
+        pthread_mutex_unlock(&t->lock);
+
+        cudaEventSynchronize(t->copied[current]);
+        const SnapshotHeader* h = &t->header[current];
+        float* columns[SNAPSHOT_COLUMNS];
+        for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+            columns[c] = t->h_stage[current] + (size_t)c * h->numBodies;
+        }
+        int ok = snapshotWriteRecord(t->fd, h, columns) == 0;
+
+        pthread_mutex_lock(&t->lock);
+        if (ok) {
+            t->frames++;
+            t->bytes += h->recordBytes;
+        } else {
+            t->failed = 1;
+        }
+        t->pending[current] = 0;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        current ^= 1;
+    }
+    return NULL;
+}
+
+int trajectoryOpen(Trajectory* t, const char* path, int every, int capacity) {
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    t->every = every > 0 ? every : TRAJECTORY_DEFAULT_EVERY;
+    trajectoryAllocBuffers(t, capacity);
+    cudaStreamCreateWithFlags(&t->stream, cudaStreamNonBlocking);
+    for (int i = 0; i < 2; i++) {
+        cudaEventCreateWithFlags(&t->staged[i], cudaEventDisableTiming);
+        cudaEventCreateWithFlags(&t->copied[i], cudaEventDisableTiming);
+        t->pending[i] = 0;
+    }
+    t->next = 0;
+    t->stop = 0;
+    t->failed = 0;
+    t->frames = t->stalls = 0;
+    t->bytes = 0;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    pthread_create(&t->writer, NULL, trajectoryWriter, t);
+    printf("Trajectory: %s, every %d steps\n", path, t->every);
+    return 0;
+}
+
+// Blocks until the writer has released both buffers
+static void trajectoryDrain(Trajectory* t) {
+    pthread_mutex_lock(&t->lock);
+    while (t->pending[0] || t->pending[1]) pthread_cond_wait(&t->cond, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Queues the current device state (call after the step, before the next)
+void trajectoryCapture(Trajectory* t, const float* const columns[SNAPSHOT_COLUMNS], int n,
+                       unsigned long long step, double time, float dt, int preset) {
+    if (n > t->capacity) {
+        trajectoryDrain(t);
+        trajectoryFreeBuffers(t);
+        trajectoryAllocBuffers(t, n);
+    }
+
+    int b = t->next;
+    pthread_mutex_lock(&t->lock);
+    if (t->pending[b]) t->stalls++;
+    while (t->pending[b]) pthread_cond_wait(&t->cond, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+
+    snapshotHeaderInit(&t->header[b], n, step, time, dt, preset);
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        cudaMemcpyAsync(t->d_stage[b] + (size_t)c * n, columns[c], n * sizeof(float),
+                        cudaMemcpyDeviceToDevice, 0);
+    }
+    cudaEventRecord(t->staged[b], 0);
+    cudaStreamWaitEvent(t->stream, t->staged[b], 0);
+    cudaMemcpyAsync(t->h_stage[b], t->d_stage[b], (size_t)SNAPSHOT_COLUMNS * n * sizeof(float),
+                    cudaMemcpyDeviceToHost, t->stream);
+    cudaEventRecord(t->copied[b], t->stream);
+
+    pthread_mutex_lock(&t->lock);
+    t->pending[b] = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    t->next ^= 1;
+}
+
+void trajectoryClose(Trajectory* t) {
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+
+    printf("Trajectory: %lld frames, %.1f MB, %lld stalls%s\n", t->frames,
+           t->bytes / (1024.0 * 1024.0), t->stalls, t->failed ? " (write errors)" : "");
+    close(t->fd);
+    trajectoryFreeBuffers(t);
+    cudaStreamDestroy(t->stream);
+    for (int i = 0; i < 2; i++) {
+        cudaEventDestroy(t->staged[i]);
+        cudaEventDestroy(t->copied[i]);
+    }
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+}
+
+#endif
+
+// ============== COLLISIONS & MERGERS ==============
+// Optional stage after each step that merges bodies closer than the sum of
+// their radii, r = MERGE_RADIUS * cbrt(m), into one body at their centre of
+// mass with their combined mass and momentum; survivors are compacted to
+// the front of the arrays, so collapsing presets shed bodies over time.
+//
+// Neighbours come from a uniform grid in a spatial hash: cell hashes are
+// radix sorted with the body indices and each hash slot gets its range in
+// the sorted order. A body searches cells out to twice its own radius and
+// claims lighter overlapping bodies (the heaviest claimant, by a mass:index
+// key, wins); chains of claims merge into the body at the end. Cells are
+// sized from the average mass but grown so that even the heaviest body's
+// search fits in MERGE_MAX_RANGE cells each way.
+//
+// The per-body steps are shared; mergeBodies runs them as kernels and
+// mergeBodiesHost serially for the host-only driver.
+
+#define MERGE_RADIUS 0.15f          // Radius of a unit mass body
+#define MERGE_MAX_RANGE 8           // Cells searched in each direction, at most
+#define MERGE_FIELDS 7              // Accumulated m, m x, m y, m z, m vx, m vy, m vz
+#define MERGE_COLUMNS 7             // x, y, z, vx, vy, vz, mass
+#define MERGE_CELL_LIMIT 1048576.0f // Cell coordinates are clamped to +-2^20
+
+__host__ __device__ inline unsigned int mergeHash(int cx, int cy, int cz, int tableSize) {
+    return ((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^
+            (unsigned int)cz * 83492791u) & (tableSize - 1);
+}
+
+// Grid coordinate of x. Escaped bodies far out share the edge cells (the
+// distance test sorts them out) instead of overflowing the int conversion.
+__host__ __device__ inline int mergeCell(float x, float invCell) {
+    float c = floorf(x * invCell);
+    return (int)fminf(fmaxf(c, -MERGE_CELL_LIMIT), MERGE_CELL_LIMIT);
+}
+
+// Masses are positive, so their bit patterns order like the floats
+__host__ __device__ inline unsigned long long mergeKey(float m, int i) {
+    union { float f; unsigned int u; } bits;
+    bits.f = m;
+    return ((unsigned long long)bits.u << 32) | (unsigned int)i;
+}
+
+float mergeCellSize(float totalMass, float maxMass, int n) {
+    float cell = 2.0f * MERGE_RADIUS * cbrtf(totalMass / n);
+    return fmaxf(cell, 2.0f * MERGE_RADIUS * cbrtf(maxMass) / (MERGE_MAX_RANGE - 1));
+}
+
+// Passes each lighter body overlapping sorted body k to claim(j, key of k)
+template <typename Claim>
+__host__ __device__ void mergeClaimBody(int k, const int* order, const int2* cellRange,
+                                        const float* px, const float* py, const float* pz,
+                                        const float* mass, float cell, int tableSize,
+                                        Claim claim)
+{
+    int i = order[k];
+    float x = px[i], y = py[i], z = pz[i], m = mass[i];
+    float radius = MERGE_RADIUS * cbrtf(m);
+    unsigned long long key = mergeKey(m, i);
+
+    // Partners are lighter, so their radius is at most ours. mergeCellSize
+    // keeps the range within MERGE_MAX_RANGE; the clamp is only a guard.
+    int range = (int)ceilf(2.0f * radius / cell);
+    range = range < 1 ? 1 : (range > MERGE_MAX_RANGE ? MERGE_MAX_RANGE : range);
+    float invCell = 1.0f / cell;
+    int cx = mergeCell(x, invCell), cy = mergeCell(y, invCell), cz = mergeCell(z, invCell);
+
+    for (int dz = -range; dz <= range; dz++) {
+        for (int dy = -range; dy <= range; dy++) {
+            for (int dx = -range; dx <= range; dx++) {
+                int2 r = cellRange[mergeHash(cx + dx, cy + dy, cz + dz, tableSize)];
+                for (int s = r.x; s < r.y; s++) {
+                    // Hash collisions bring in far bodies; the distance test
+                    // rejects them, and a body reached twice is harmless
+                    int j = order[s];
+                    float mj = mass[j];
+                    if (mergeKey(mj, j) >= key) continue;
+                    float ex = px[j] - x, ey = py[j] - y, ez = pz[j] - z;
+                    float reach = radius + MERGE_RADIUS * cbrtf(mj);
+                    if (ex * ex + ey * ey + ez * ez < reach * reach) claim(j, key);
+                }
+            }
+        }
+    }
+}
+
+// Seeds body i's sums with its own mass, position and momentum and returns
+// the body it merges into, -1 if it survives
+__host__ __device__ inline int mergeSeed(float* acc, int i, int n, unsigned long long claim,
+                                         const float* px, const float* py, const float* pz,
+                                         const float* vx, const float* vy, const float* vz,
+                                         const float* mass)
+{
+    float m = mass[i];
+    acc[i] = m;
+    acc[n + i] = m * px[i];
+    acc[2 * n + i] = m * py[i];
+    acc[3 * n + i] = m * pz[i];
+    acc[4 * n + i] = m * vx[i];
+    acc[5 * n + i] = m * vy[i];
+    acc[6 * n + i] = m * vz[i];
+    return claim ? (int)(claim & 0xffffffffu) : -1;
+}
+
+// Survivor at the end of body i's claim chain (keys increase along a
+// chain, so it ends)
+__host__ __device__ inline int mergeRoot(const int* target, int i) {
+    int root = target[i];
+    while (target[root] >= 0) root = target[root];
+    return root;
+}
+
+// Writes survivor i as body k of the compacted columns
+__host__ __device__ inline void mergeWriteSurvivor(float* const out[MERGE_COLUMNS], int k, int i,
+                                                   int n, int gained, const float* acc,
+                                                   const float* px, const float* py,
+                                                   const float* pz, const float* vx,
+                                                   const float* vy, const float* vz,
+                                                   const float* mass)
+{
+    if (gained) {
+        float m = acc[i];
+        float inv = 1.0f / m;
+        out[0][k] = acc[n + i] * inv;
+        out[1][k] = acc[2 * n + i] * inv;
+        out[2][k] = acc[3 * n + i] * inv;
+        out[3][k] = acc[4 * n + i] * inv;
+        out[4][k] = acc[5 * n + i] * inv;
+        out[5][k] = acc[6 * n + i] * inv;
+        out[6][k] = m;
+    } else {
+        out[0][k] = px[i];
+        out[1][k] = py[i];
+        out[2][k] = pz[i];
+        out[3][k] = vx[i];
+        out[4][k] = vy[i];
+        out[5][k] = vz[i];
+        out[6][k] = mass[i];
+    }
+}
+
+struct HostClaim {
+    unsigned long long* claim;
+    void operator()(int j, unsigned long long key) const {
+        if (key > claim[j]) claim[j] = key;
+    }
+};
+
+// Host version of mergeBodies, same steps in the same order (the sort is
+// by hash then index, as the stable radix sort leaves them)
+int mergeBodiesHost(float* const columns[MERGE_COLUMNS], int n) {
+    if (n < 2) return n;
+    const float *px = columns[0], *py = columns[1], *pz = columns[2];
+    const float *vx = columns[3], *vy = columns[4], *vz = columns[5];
+    const float* mass = columns[6];
+
+    float totalMass = 0.0f, maxMass = 0.0f;
+    for (int i = 0; i < n; i++) {
+        totalMass += mass[i];
+        maxMass = fmaxf(maxMass, mass[i]);
+    }
+    float cell = mergeCellSize(totalMass, maxMass, n);
+    float invCell = 1.0f / cell;
+    int tableSize = 1;
+    while (tableSize < 2 * n) tableSize <<= 1;
+
+    std::vector<std::pair<unsigned int, int> > sorted(n);
+    for (int i = 0; i < n; i++) {
+        sorted[i].first = mergeHash(mergeCell(px[i], invCell), mergeCell(py[i], invCell),
+                                    mergeCell(pz[i], invCell), tableSize);
+        sorted[i].second = i;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<int> order(n);
+    int2 empty = { 0, 0 };
+    std::vector<int2> cellRange(tableSize, empty);
+    for (int k = 0; k < n; k++) {
+        unsigned int key = sorted[k].first;
+        order[k] = sorted[k].second;
+        if (k == 0 || sorted[k - 1].first != key) cellRange[key].x = k;
+        if (k == n - 1 || sorted[k + 1].first != key) cellRange[key].y = k + 1;
+    }
+
+    std::vector<unsigned long long> claim(n, 0);
+    HostClaim claimer = { claim.data() };
+    for (int k = 0; k < n; k++) {
+        mergeClaimBody(k, order.data(), cellRange.data(), px, py, pz, mass, cell, tableSize,
+                       claimer);
+    }
+
+    std::vector<float> acc((size_t)MERGE_FIELDS * n);
+    std::vector<int> target(n), gained(n, 0);
+    for (int i = 0; i < n; i++) {
+        target[i] = mergeSeed(acc.data(), i, n, claim[i], px, py, pz, vx, vy, vz, mass);
+    }
+    int absorbed = 0;
+    for (int i = 0; i < n; i++) {
+        if (target[i] < 0) continue;
+        int root = mergeRoot(target.data(), i);
+        for (int f = 0; f < MERGE_FIELDS; f++) acc[f * n + root] += acc[f * n + i];
+        gained[root] = 1;
+        absorbed++;
+    }
+    if (absorbed == 0) return n;
+
+    int survivors = n - absorbed;
+    std::vector<float> scratch((size_t)MERGE_COLUMNS * survivors);
+    float* out[MERGE_COLUMNS];
+    for (int c = 0; c < MERGE_COLUMNS; c++) out[c] = scratch.data() + (size_t)c * survivors;
+    for (int i = 0, k = 0; i < n; i++) {
+        if (target[i] >= 0) continue;
+        mergeWriteSurvivor(out, k++, i, n, gained[i], acc.data(), px, py, pz, vx, vy, vz, mass);
+    }
+    for (int c = 0; c < MERGE_COLUMNS; c++) {
+        memcpy(columns[c], out[c], survivors * sizeof(float));
+    }
+    return survivors;
+}
+
+#ifndef CPU_ONLY
+struct Merger {
+    int enabled;
+    int tableSize;                  // Hash slots, power of two >= 2n
+    unsigned int* keys;             // Hash of each body's cell...
+    int* order;                     // ...sorted together with body indices
+    int2* cellRange;                // [start, end) of each hash slot in 'order'
+    unsigned long long* claim;      // Heaviest claimant's mass:index key, 0 = none
+    int* target;                    // Body this one merges into, -1 if it survives
+    int* gained;                    // Survivor absorbed at least one body
+    float* acc;                     // MERGE_FIELDS x n sums over each merged group
+    int* alive;                     // Survivor flags, then their scanned new indices
+    int* newIndex;
+    float* scratch;                 // MERGE_COLUMNS x n compaction buffer
+    int* d_count;
+    int merged;                     // Bodies absorbed since last reported
+};
+
+__global__ void mergeHashKernel(unsigned int* keys, int* order,
+                                const float* px, const float* py, const float* pz,
+                                int n, float invCell, int tableSize)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+    keys[i] = mergeHash(mergeCell(px[i], invCell), mergeCell(py[i], invCell),
+                        mergeCell(pz[i], invCell), tableSize);
+    order[i] = i;
+}
+
+__global__ void mergeRangeKernel(int2* cellRange, const unsigned int* keys, int n) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    unsigned int key = keys[i];
+    if (i == 0 || keys[i - 1] != key) cellRange[key].x = i;
+    if (i == n - 1 || keys[i + 1] != key) cellRange[key].y = i + 1;
+}
+
+struct AtomicClaim {
+    unsigned long long* claim;
+    __device__ void operator()(int j, unsigned long long key) const {
+        atomicMax(&claim[j], key);
+    }
+};
+
+// One thread per body in sorted order, so neighbouring threads walk the
+// same cells
+__global__ void mergeClaimKernel(unsigned long long* claim,
+                                 const int* order, const int2* cellRange,
+                                 const float* px, const float* py, const float* pz,
+                                 const float* mass, int n, float cell, int tableSize)
+{
+    int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= n) return;
+    AtomicClaim claimer = { claim };
+    mergeClaimBody(k, order, cellRange, px, py, pz, mass, cell, tableSize, claimer);
+}
+
+__global__ void mergeInitKernel(float* acc, int* target, int* gained,
+                                const unsigned long long* claim,
+                                const float* px, const float* py, const float* pz,
+                                const float* vx, const float* vy, const float* vz,
+                                const float* mass, int n)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    target[i] = mergeSeed(acc, i, n, claim[i], px, py, pz, vx, vy, vz, mass);
+    gained[i] = 0;
+}
+
+// Adds every claimed body to the survivor at the end of its claim chain
+__global__ void mergeAbsorbKernel(float* acc, int* gained, int* count, const int* target, int n) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n || target[i] < 0) return;
+
+    int root = mergeRoot(target, i);
+    for (int f = 0; f < MERGE_FIELDS; f++) atomicAdd(&acc[f * n + root], acc[f * n + i]);
+    gained[root] = 1;
+    atomicAdd(count, 1);
+}
+
+__global__ void mergeCompactKernel(float* scratch, const int* newIndex,
+                                   const int* target, const int* gained, const float* acc,
+                                   const float* px, const float* py, const float* pz,
+                                   const float* vx, const float* vy, const float* vz,
+                                   const float* mass, int n, int survivors)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n || target[i] >= 0) return;
+
+    float* out[MERGE_COLUMNS];
+    for (int c = 0; c < MERGE_COLUMNS; c++) out[c] = scratch + c * survivors;
+    mergeWriteSurvivor(out, newIndex[i], i, n, gained[i], acc, px, py, pz, vx, vy, vz, mass);
+}
+
+__global__ void mergeAliveKernel(int* alive, const int* target, int n) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < n) alive[i] = target[i] < 0;
+}
+
+void mergerAlloc(Merger* g, int maxBodies) {
+    memset(g, 0, sizeof(*g));
+    int maxTable = 1;
+    while (maxTable < 2 * maxBodies) maxTable <<= 1;
+    cudaMalloc(&g->keys, maxBodies * sizeof(unsigned int));
+    cudaMalloc(&g->order, maxBodies * sizeof(int));
+    cudaMalloc(&g->cellRange, maxTable * sizeof(int2));
+    cudaMalloc(&g->claim, maxBodies * sizeof(unsigned long long));
+    cudaMalloc(&g->target, maxBodies * sizeof(int));
+    cudaMalloc(&g->gained, maxBodies * sizeof(int));
+    cudaMalloc(&g->acc, (size_t)MERGE_FIELDS * maxBodies * sizeof(float));
+    cudaMalloc(&g->alive, maxBodies * sizeof(int));
+    cudaMalloc(&g->newIndex, maxBodies * sizeof(int));
+    cudaMalloc(&g->scratch, (size_t)MERGE_COLUMNS * maxBodies * sizeof(float));
+    cudaMalloc(&g->d_count, sizeof(int));
+}
+
+void mergerFree(Merger* g) {
+    cudaFree(g->keys); cudaFree(g->order); cudaFree(g->cellRange);
+    cudaFree(g->claim); cudaFree(g->target); cudaFree(g->gained);
+    cudaFree(g->acc); cudaFree(g->alive); cudaFree(g->newIndex);
+    cudaFree(g->scratch); cudaFree(g->d_count);
+}
+
+// Merges touching bodies in columns (x, y, z, vx, vy, vz, mass) in place
+// and returns the new body count
+int mergeBodies(Merger* g, float* const columns[MERGE_COLUMNS], int n) {
+    if (n < 2) return n;
+    const float *px = columns[0], *py = columns[1], *pz = columns[2];
+    const float *vx = columns[3], *vy = columns[4], *vz = columns[5];
+    const float* mass = columns[6];
+    int blocks = (n + 255) / 256;
+
+    float totalMass = thrust::reduce(thrust::device_ptr<const float>(mass),
+                                     thrust::device_ptr<const float>(mass + n));
+    float maxMass = thrust::reduce(thrust::device_ptr<const float>(mass),
+                                   thrust::device_ptr<const float>(mass + n), 0.0f,
+                                   thrust::maximum<float>());
+    float cell = mergeCellSize(totalMass, maxMass, n);
+    g->tableSize = 1;
+    while (g->tableSize < 2 * n) g->tableSize <<= 1;
+
+    mergeHashKernel<<<blocks, 256>>>(g->keys, g->order, px, py, pz, n, 1.0f / cell,
+                                     g->tableSize);
+    thrust::sort_by_key(thrust::device_ptr<unsigned int>(g->keys),
+                        thrust::device_ptr<unsigned int>(g->keys + n),
+                        thrust::device_ptr<int>(g->order));
+    cudaMemset(g->cellRange, 0, g->tableSize * sizeof(int2));
+    mergeRangeKernel<<<blocks, 256>>>(g->cellRange, g->keys, n);
+
+    cudaMemset(g->claim, 0, n * sizeof(unsigned long long));
+    mergeClaimKernel<<<blocks, 256>>>(g->claim, g->order, g->cellRange, px, py, pz, mass,
+                                      n, cell, g->tableSize);
+
+    cudaMemset(g->d_count, 0, sizeof(int));
+    mergeInitKernel<<<blocks, 256>>>(g->acc, g->target, g->gained, g->claim,
+                                     px, py, pz, vx, vy, vz, mass, n);
+    mergeAbsorbKernel<<<blocks, 256>>>(g->acc, g->gained, g->d_count, g->target, n);
+
+    int absorbed = 0;
+    cudaMemcpy(&absorbed, g->d_count, sizeof(int), cudaMemcpyDeviceToHost);
+    if (absorbed == 0) return n;
+
+    int survivors = n - absorbed;
+    mergeAliveKernel<<<blocks, 256>>>(g->alive, g->target, n);
+    thrust::exclusive_scan(thrust::device_ptr<int>(g->alive),
+                           thrust::device_ptr<int>(g->alive + n),
+                           thrust::device_ptr<int>(g->newIndex));
+    mergeCompactKernel<<<blocks, 256>>>(g->scratch, g->newIndex, g->target, g->gained, g->acc,
+                                        px, py, pz, vx, vy, vz, mass, n, survivors);
+    for (int c = 0; c < MERGE_COLUMNS; c++) {
+        cudaMemcpy(columns[c], g->scratch + (size_t)c * survivors, survivors * sizeof(float),
+                   cudaMemcpyDeviceToDevice);
+    }
+
+    g->merged += absorbed;
+    return survivors;
+}
+
+// ============== DISTRIBUTED MODE ==============
+// Several cuda_nbody processes share one simulation: rank 0 is the
+// interactive window and ranks 1..P-1 are headless workers connected to it
+// over TCP (forked on the same machine by --ranks P, or started elsewhere
+// with --worker HOST:PORT). Bodies are split into equal contiguous slabs;
+// each rank integrates its own slab with kick-drift-kick leapfrog and keeps
+// the positions and masses of all bodies, which the direct sum needs.
+//
+// A step, started by rank 0 sending DIST_STEP to every worker:
+//   1. kick-drift the own slab and copy its new positions to the host
+//   2. launch the own slab's forces on itself
+//   3. meanwhile on the host, the slabs are gathered on rank 0, which sends
+//      all positions back to every worker
+//   4. upload the other slabs, add their forces and finish the kick
+// Rank 0 renders from its copy of all positions. Messages are raw host
+// floats, so all machines must share the same byte order.
+
+#define DIST_DEFAULT_PORT 5923
+#define DIST_MAX_RANKS 16
+#define DIST_CONNECT_TRIES 300      // 100 ms apart, for workers started first
+
+// Commands from rank 0
+#define DIST_LOAD 1                 // Full state follows
+#define DIST_STEP 2
+#define DIST_QUIT 3
+
+struct DistHeader {
+    int command;
+    int rank;                       // Receiver's rank...
+    int first, count;               // ...and slab
+    int numBodies;
+    float dt;
+    float softening2;
+};
+
+struct Distributed {
+    int ranks;                      // 1 when not distributed
+    int rank;
+    int sock[DIST_MAX_RANKS];       // Rank 0: one per worker; workers: sock[0]
+    int first[DIST_MAX_RANKS];      // Slab of each rank
+    int count[DIST_MAX_RANKS];
+    int numBodies;
+    float* h_pos;                   // x, y, z columns of all bodies
+    pid_t children[DIST_MAX_RANKS]; // Workers forked by rank 0
+    int numChildren;
+};
+
+static int distSend(int fd, const void* buf, size_t bytes) {
+    const char* p = (const char*)buf;
+    while (bytes > 0) {
+        ssize_t w = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        bytes -= w;
+    }
+    return 0;
+}
+
+static int distRecv(int fd, void* buf, size_t bytes) {
+    char* p = (char*)buf;
+    while (bytes > 0) {
+        ssize_t r = recv(fd, p, bytes, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        bytes -= r;
+    }
+    return 0;
+}
+
+static void distNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void distSlabs(Distributed* d, int n) {
+    int base = n / d->ranks;
+    int extra = n % d->ranks;
+    for (int r = 0; r < d->ranks; r++) {
+        d->first[r] = r * base + (r < extra ? r : extra);
+        d->count[r] = base + (r < extra);
+    }
+    d->numBodies = n;
+}
+
+// Workers send their slab's positions and receive everyone's; rank 0
+// gathers the slabs and sends all positions back
+static int distExchange(Distributed* d) {
+    size_t n = d->numBodies;
+    if (d->rank > 0) {
+        int f = d->first[d->rank], c = d->count[d->rank];
+        for (int k = 0; k < 3; k++) {
+            if (distSend(d->sock[0], d->h_pos + k * n + f, c * sizeof(float)) < 0) return -1;
+        }
+        return distRecv(d->sock[0], d->h_pos, 3 * n * sizeof(float));
+    }
+
+    for (int r = 1; r < d->ranks; r++) {
+        for (int k = 0; k < 3; k++) {
+            if (distRecv(d->sock[r], d->h_pos + k * n + d->first[r],
+                         d->count[r] * sizeof(float)) < 0) return -1;
+        }
+    }
+    for (int r = 1; r < d->ranks; r++) {
+        if (distSend(d->sock[r], d->h_pos, 3 * n * sizeof(float)) < 0) return -1;
+    }
+    return 0;
+}
+
+// Accelerations of the own slab from all bodies, after a load
+static void distSlabForces(Distributed* d, float* const columns[SNAPSHOT_COLUMNS],
+                           float* ax, float* ay, float* az, float softening2)
+{
+    int f = d->first[d->rank], c = d->count[d->rank];
+    if (c == 0) return;
+    computeForcesRangeKernel<<<(c + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+        ax, ay, az, columns[0], columns[1], columns[2], columns[6],
+        f, c, 0, d->numBodies, softening2, G, 0);
+}
+
+// One leapfrog step of the own slab (steps 1-4 above)
+static int distSlabStep(Distributed* d, float* const columns[SNAPSHOT_COLUMNS],
+                        float* ax, float* ay, float* az, float dt, float softening2)
+{
+    size_t n = d->numBodies;
+    int f = d->first[d->rank], c = d->count[d->rank];
+    int tail = f + c;
+    float *px = columns[0], *py = columns[1], *pz = columns[2];
+    float *vx = columns[3], *vy = columns[4], *vz = columns[5];
+    const float* mass = columns[6];
+    int blocks = (c + TILE_SIZE - 1) / TILE_SIZE;
+
+    if (c > 0) {
+        leapfrogKickDriftKernel<<<blocks, TILE_SIZE>>>(px + f, py + f, pz + f,
+            vx + f, vy + f, vz + f, ax + f, ay + f, az + f, c, dt);
+    }
+    for (int k = 0; k < 3; k++) {
+        cudaMemcpy(d->h_pos + k * n + f, columns[k] + f, c * sizeof(float),
+                   cudaMemcpyDeviceToHost);
+    }
+
+    // The own slab's forces run on the GPU during the exchange
+    if (c > 0) {
+        computeForcesRangeKernel<<<blocks, TILE_SIZE>>>(ax, ay, az, px, py, pz, mass,
+                                                        f, c, f, c, softening2, G, 0);
+    }
+    if (distExchange(d) < 0) return -1;
+
+    for (int k = 0; k < 3; k++) {
+        if (f > 0) {
+            cudaMemcpy(columns[k], d->h_pos + k * n, f * sizeof(float),
+                       cudaMemcpyHostToDevice);
+        }
+        if (tail < (int)n) {
+            cudaMemcpy(columns[k] + tail, d->h_pos + k * n + tail, (n - tail) * sizeof(float),
+                       cudaMemcpyHostToDevice);
+        }
+    }
+    if (c > 0) {
+        computeForcesRangeKernel<<<blocks, TILE_SIZE>>>(ax, ay, az, px, py, pz, mass,
+                                                        f, c, 0, f, softening2, G, 1);
+        computeForcesRangeKernel<<<blocks, TILE_SIZE>>>(ax, ay, az, px, py, pz, mass,
+                                                        f, c, tail, n - tail, softening2, G, 1);
+        leapfrogKickKernel<<<blocks, TILE_SIZE>>>(vx + f, vy + f, vz + f,
+                                                  ax + f, ay + f, az + f, c, dt);
+    }
+    return 0;
+}
+
+// Rank 0: listens on port, forks ranks - 1 local workers if asked, and
+// waits for all workers to connect
+int distStart(Distributed* d, int ranks, int port, int spawn) {
+    memset(d, 0, sizeof(*d));
+    d->ranks = 1;
+    if (ranks < 2 || ranks > DIST_MAX_RANKS) {
+        fprintf(stderr, "Rank count must be 2-%d\n", DIST_MAX_RANKS);
+        return -1;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listener, ranks) < 0) {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", port, strerror(errno));
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+
+    for (int r = 1; r < ranks && spawn; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char target[32];
+            snprintf(target, sizeof(target), "127.0.0.1:%d", port);
+            execl("/proc/self/exe", "cuda_nbody", "--worker", target, (char*)NULL);
+            _exit(127);
+        }
+        if (pid > 0) d->children[d->numChildren++] = pid;
+    }
+
+    printf("Waiting for %d workers on port %d...\n", ranks - 1, port);
+    for (int r = 1; r < ranks; r++) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            close(listener);
+            return -1;
+        }
+        distNoDelay(fd);
+        d->sock[r] = fd;
+        d->ranks = r + 1;
+    }
+    close(listener);
+
+    cudaMallocHost(&d->h_pos, 3 * (size_t)MAX_BODIES * sizeof(float));
+    printf("Distributed over %d ranks\n", ranks);
+    return 0;
+}
+
+// Rank 0: hands out slabs of the state in h (already on rank 0's device)
+// and computes the own slab's starting accelerations
+int distLoad(Distributed* d, const Bodies* h, int n, float dt, float softening2,
+             float* const columns[SNAPSHOT_COLUMNS], float* ax, float* ay, float* az)
+{
+    distSlabs(d, n);
+    for (int r = 1; r < d->ranks; r++) {
+        DistHeader header = { DIST_LOAD, r, d->first[r], d->count[r], n, dt, softening2 };
+        int f = d->first[r], c = d->count[r];
+        if (distSend(d->sock[r], &header, sizeof(header)) < 0 ||
+            distSend(d->sock[r], h->x, n * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->y, n * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->z, n * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->mass, n * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->vx + f, c * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->vy + f, c * sizeof(float)) < 0 ||
+            distSend(d->sock[r], h->vz + f, c * sizeof(float)) < 0) return -1;
+    }
+    distSlabForces(d, columns, ax, ay, az, softening2);
+    return 0;
+}
+
+// Rank 0: one step on all ranks; afterwards columns hold all positions
+int distStep(Distributed* d, float* const columns[SNAPSHOT_COLUMNS],
+             float* ax, float* ay, float* az, float dt, float softening2)
+{
+    for (int r = 1; r < d->ranks; r++) {
+        DistHeader header = { DIST_STEP, r, d->first[r], d->count[r], d->numBodies,
+                              dt, softening2 };
+        if (distSend(d->sock[r], &header, sizeof(header)) < 0) return -1;
+    }
+    return distSlabStep(d, columns, ax, ay, az, dt, softening2);
+}
+
+void distStop(Distributed* d) {
+    DistHeader header;
+    memset(&header, 0, sizeof(header));
+    header.command = DIST_QUIT;
+    for (int r = 1; r < d->ranks; r++) {
+        distSend(d->sock[r], &header, sizeof(header));
+        close(d->sock[r]);
+    }
+    for (int i = 0; i < d->numChildren; i++) waitpid(d->children[i], NULL, 0);
+    cudaFreeHost(d->h_pos);
+}
+
+// Worker process: connects to rank 0 at HOST:PORT and serves its commands
+int distWorkerMain(const char* target) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", target);
+    char* colon = strrchr(host, ':');
+    if (!colon) {
+        fprintf(stderr, "--worker needs HOST:PORT\n");
+        return 1;
+    }
+    *colon = '\0';
+
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &info) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", host);
+        return 1;
+    }
+    int fd = -1;
+    for (int attempt = 0; attempt < DIST_CONNECT_TRIES && fd < 0; attempt++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, info->ai_addr, info->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+            usleep(100000);
+        }
+    }
+    freeaddrinfo(info);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to %s\n", target);
+        return 1;
+    }
+    distNoDelay(fd);
+
+    Distributed d;
+    memset(&d, 0, sizeof(d));
+    d.sock[0] = fd;
+
+    // Sized by the first load and grown only when a later load is larger
+    float* columns[SNAPSHOT_COLUMNS] = {};
+    float *ax = NULL, *ay = NULL, *az = NULL;
+    int capacity = 0;
+
+    int ok = 1;
+    DistHeader header;
+    while (ok && distRecv(fd, &header, sizeof(header)) == 0 && header.command != DIST_QUIT) {
+        // The slab indexes the body columns and sizes the receives below
+        if (header.rank < 1 || header.rank >= DIST_MAX_RANKS ||
+            header.numBodies < 1 || header.numBodies > MAX_BODIES ||
+            header.first < 0 || header.count < 0 || header.count > MAX_BODIES ||
+            header.first > header.numBodies - header.count ||
+            (header.command != DIST_LOAD && header.numBodies > capacity)) {
+            fprintf(stderr, "Bad message from rank 0\n");
+            break;
+        }
+        d.rank = header.rank;
+        d.ranks = header.rank + 1;  // Only the own slab is used on workers
+        d.first[d.rank] = header.first;
+        d.count[d.rank] = header.count;
+        d.numBodies = header.numBodies;
+
+        if (header.command == DIST_LOAD) {
+            // Positions and masses of all bodies, velocities of the own slab,
+            // each staged through h_pos
+            size_t n = header.numBodies;
+            if (header.numBodies > capacity) {
+                cudaFreeHost(d.h_pos);
+                for (int c = 0; c < SNAPSHOT_COLUMNS; c++) cudaFree(columns[c]);
+                cudaFree(ax); cudaFree(ay); cudaFree(az);
+                capacity = header.numBodies;
+                cudaMallocHost(&d.h_pos, 3 * n * sizeof(float));
+                for (int c = 0; c < SNAPSHOT_COLUMNS; c++) cudaMalloc(&columns[c], n * sizeof(float));
+                cudaMalloc(&ax, n * sizeof(float));
+                cudaMalloc(&ay, n * sizeof(float));
+                cudaMalloc(&az, n * sizeof(float));
+            }
+            ok = distRecv(fd, d.h_pos, 3 * n * sizeof(float)) == 0;
+            for (int k = 0; k < 3 && ok; k++) {
+                cudaMemcpy(columns[k], d.h_pos + k * n, n * sizeof(float),
+                           cudaMemcpyHostToDevice);
+            }
+            ok = ok && distRecv(fd, d.h_pos, n * sizeof(float)) == 0;
+            if (ok) cudaMemcpy(columns[6], d.h_pos, n * sizeof(float), cudaMemcpyHostToDevice);
+            for (int k = 3; k < 6 && ok; k++) {
+                ok = distRecv(fd, d.h_pos, header.count * sizeof(float)) == 0;
+                cudaMemcpy(columns[k] + header.first, d.h_pos, header.count * sizeof(float),
+                           cudaMemcpyHostToDevice);
+            }
+            if (ok) {
+                distSlabForces(&d, columns, ax, ay, az, header.softening2);
+                printf("Worker %d: bodies %d-%d of %d\n", d.rank, header.first,
+                       header.first + header.count - 1, header.numBodies);
+            }
+        } else if (header.command == DIST_STEP) {
+            ok = distSlabStep(&d, columns, ax, ay, az, header.dt, header.softening2) == 0;
+        }
+    }
+    if (!ok) fprintf(stderr, "Worker %d: lost connection to rank 0\n", d.rank);
+
+    close(fd);
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) cudaFree(columns[c]);
+    cudaFree(ax); cudaFree(ay); cudaFree(az);
+    cudaFreeHost(d.h_pos);
+    return ok ? 0 : 1;
+}
+
 // ============== RENDERING ==============
 __device__ void hsv2rgb(float h, float s, float v, float* r, float* g, float* b) {
     int hi = (int)(h * 6.0f) % 6;
@@ -157,6 +3486,43 @@ __device__ void hsv2rgb(float h, float s, float v, float* r, float* g, float* b)
     }
 }
 
+// Projects a body to the screen; returns 0 if it is behind the camera.
+__device__ int projectBody(float x, float y, float z,
+                           float camX, float camY, float camZ,
+                           float rotX, float rotY, float zoom, int width, int height,
+                           float* screenX, float* screenY, float* scale)
+{
+    x -= camX;
+    y -= camY;
+    z -= camZ;
+
+    // Rotate around Y axis
+    float cosY = cosf(rotY), sinY = sinf(rotY);
+    float rx = x * cosY + z * sinY;
+    float rz = -x * sinY + z * cosY;
+
+    // Rotate around X axis
+    float cosX = cosf(rotX), sinX = sinf(rotX);
+    float ry = y * cosX - rz * sinX;
+    float rzFinal = y * sinX + rz * cosX;
+
+    // Perspective projection
+    float depth = rzFinal + zoom;
+    if (depth < 1.0f) return 0;
+
+    *scale = 400.0f / depth;
+    *screenX = width / 2 + rx * *scale;
+    *screenY = height / 2 - ry * *scale;
+    return 1;
+}
+
+// Same colour as the point renderer: hue from mass, brighter when heavier
+__device__ void bodyColor(float m, float* r, float* g, float* b) {
+    float hue = fmodf(0.6f - logf(m + 0.1f) * 0.15f, 1.0f);
+    if (hue < 0) hue += 1.0f;
+    hsv2rgb(hue, 0.8f, fminf(1.0f, 0.5f + m * 0.5f), r, g, b);
+}
+
 __global__ void clearKernel(unsigned char* pixels, int width, int height, int useTrails) {
     int x = blockIdx.x * blockDim.x + threadIdx.x;
     int y = blockIdx.y * blockDim.y + threadIdx.y;
@@ -190,40 +3556,18 @@ __global__ void renderBodiesKernel(
     int i = blockIdx.x * blockDim.x + threadIdx.x;
     if (i >= n) return;
 
-    // Get body position relative to camera
-    float x = px[i] - camX;
-    float y = py[i] - camY;
-    float z = pz[i] - camZ;
-
-    // Rotate around Y axis
-    float cosY = cosf(rotY), sinY = sinf(rotY);
-    float rx = x * cosY + z * sinY;
-    float rz = -x * sinY + z * cosY;
-
-    // Rotate around X axis
-    float cosX = cosf(rotX), sinX = sinf(rotX);
-    float ry = y * cosX - rz * sinX;
-    float rzFinal = y * sinX + rz * cosX;
-
-    // Perspective projection
-    float depth = rzFinal + zoom;
-    if (depth < 1.0f) return;
-
-    float scale = 400.0f / depth;
-    int screenX = (int)(width / 2 + rx * scale);
-    int screenY = (int)(height / 2 - ry * scale);
+    float sx, sy, scale;
+    if (!projectBody(px[i], py[i], pz[i], camX, camY, camZ, rotX, rotY, zoom,
+                     width, height, &sx, &sy, &scale)) return;
+    int screenX = (int)sx;
+    int screenY = (int)sy;
 
     if (screenX < 0 || screenX >= width || screenY < 0 || screenY >= height) return;
 
     // Color based on mass
     float m = mass[i];
-    float hue = fmodf(0.6f - logf(m + 0.1f) * 0.15f, 1.0f);
-    if (hue < 0) hue += 1.0f;
-    float sat = 0.8f;
-    float val = fminf(1.0f, 0.5f + m * 0.5f);
-
     float r, g, b;
-    hsv2rgb(hue, sat, val, &r, &g, &b);
+    bodyColor(m, &r, &g, &b);
 
     // Draw body (brighter for higher mass)
     int idx = (screenY * width + screenX) * 4;
@@ -251,6 +3595,271 @@ __global__ void renderBodiesKernel(
     }
 }
 
+// ============== HDR DENSITY SPLATS ==============
+// Alternative to renderBodiesKernel, whose unsynchronized 8-bit
+// read-modify-writes lose light wherever bodies overlap. Every body becomes
+// a normalized Gaussian (sized by mass and depth) that is accumulated in a
+// float RGB buffer and tone-mapped to BGRA in a final pass; trails decay
+// that buffer instead of the 8-bit image.
+//
+// Accumulation is binned by screen tile rather than done with per-pixel
+// atomics, which would serialize in dense galaxy cores:
+//   1. project bodies and count the SPLAT_TILE^2 tiles each splat touches
+//   2. scan the counts and emit one (tile, body) pair per touched tile
+//   3. radix sort the pairs by tile and find each tile's range
+//   4. one 16x16 block per tile (times SPLAT_SPLIT, so a crowded tile is
+//      shared by several blocks) stages splats in shared memory and sums
+//      them per pixel; the only atomics are the SPLAT_SPLIT per-pixel adds
+
+#define SPLAT_TILE 16               // Tile edge in pixels (one thread per pixel)
+#define SPLAT_SPLIT 8               // Blocks sharing each tile's splat list
+#define SPLAT_BATCH (SPLAT_TILE * SPLAT_TILE)
+#define SPLAT_WORLD_SIGMA 0.08f     // Gaussian sigma for unit mass, world units
+#define SPLAT_MIN_SIGMA 0.6f        // Pixels
+#define SPLAT_MAX_SIGMA 4.0f
+#define SPLAT_CUTOFF 3.0f           // Splat radius in sigmas
+#define SPLAT_ENERGY 4.0f           // Light per body at REFERENCE_BODIES
+#define TRAIL_DECAY 0.92f
+
+struct SplatRenderer {
+    int tilesX, tilesY;
+    float4* pos;                    // Screen x, y, 1/(2 sigma^2), cutoff radius^2
+    float4* color;                  // r, g, b premultiplied by the Gaussian norm
+    int* pairCount;                 // Tiles touched per body...
+    int* pairOffset;                // ...and their exclusive scan
+    unsigned int* keys;             // Tile of each (tile, body) pair
+    int* values;                    // Body of each pair
+    int maxPairs;
+    int2* tileRange;                // [start, end) of each tile in the sorted pairs
+    float* hdr;                     // Planar R, G, B, width * height each
+};
+
+__global__ void splatProjectKernel(
+    float4* splatPos, float4* splatColor, int* pairCount,
+    const float* px, const float* py, const float* pz, const float* mass, int n,
+    float camX, float camY, float camZ, float rotX, float rotY, float zoom,
+    int width, int height, int tilesX, int tilesY, float energy)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n) return;
+
+    float sx, sy, scale;
+    int count = 0;
+    if (projectBody(px[i], py[i], pz[i], camX, camY, camZ, rotX, rotY, zoom,
+                    width, height, &sx, &sy, &scale)) {
+        float m = mass[i];
+        float sigma = SPLAT_WORLD_SIGMA * cbrtf(m) * scale;
+        sigma = fminf(SPLAT_MAX_SIGMA, fmaxf(SPLAT_MIN_SIGMA, sigma));
+        float radius = SPLAT_CUTOFF * sigma;
+
+        int tx0 = max(0, (int)floorf((sx - radius) / SPLAT_TILE));
+        int ty0 = max(0, (int)floorf((sy - radius) / SPLAT_TILE));
+        int tx1 = min(tilesX - 1, (int)floorf((sx + radius) / SPLAT_TILE));
+        int ty1 = min(tilesY - 1, (int)floorf((sy + radius) / SPLAT_TILE));
+        if (tx0 <= tx1 && ty0 <= ty1) {
+            count = (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+
+            float r, g, b;
+            bodyColor(m, &r, &g, &b);
+            float norm = energy / (2.0f * 3.14159265f * sigma * sigma);
+            splatPos[i] = make_float4(sx, sy, 0.5f / (sigma * sigma), radius * radius);
+            splatColor[i] = make_float4(r * norm, g * norm, b * norm, 0.0f);
+        }
+    }
+    pairCount[i] = count;
+}
+
+__global__ void splatEmitKernel(
+    unsigned int* keys, int* values,
+    const float4* splatPos, const int* pairCount, const int* pairOffset, int n,
+    int tilesX, int tilesY)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n || pairCount[i] == 0) return;
+
+    float4 s = splatPos[i];
+    float radius = sqrtf(s.w);
+    int tx0 = max(0, (int)floorf((s.x - radius) / SPLAT_TILE));
+    int ty0 = max(0, (int)floorf((s.y - radius) / SPLAT_TILE));
+    int tx1 = min(tilesX - 1, (int)floorf((s.x + radius) / SPLAT_TILE));
+    int ty1 = min(tilesY - 1, (int)floorf((s.y + radius) / SPLAT_TILE));
+
+    int k = pairOffset[i];
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            keys[k] = ty * tilesX + tx;
+            values[k] = i;
+            k++;
+        }
+    }
+}
+
+__global__ void splatRangeKernel(int2* tileRange, const unsigned int* keys, int numPairs) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= numPairs) return;
+
+    unsigned int key = keys[i];
+    if (i == 0 || keys[i - 1] != key) tileRange[key].x = i;
+    if (i == numPairs - 1 || keys[i + 1] != key) tileRange[key].y = i + 1;
+}
+
+__global__ void splatTileKernel(
+    float* hdr, const int2* tileRange, const int* values,
+    const float4* splatPos, const float4* splatColor,
+    int width, int height, int tilesX)
+{
+    __shared__ float4 pos[SPLAT_BATCH];
+    __shared__ float4 color[SPLAT_BATCH];
+
+    int tile = blockIdx.x;
+    int lane = threadIdx.y * SPLAT_TILE + threadIdx.x;
+    int x = (tile % tilesX) * SPLAT_TILE + threadIdx.x;
+    int y = (tile / tilesX) * SPLAT_TILE + threadIdx.y;
+    float fx = x + 0.5f, fy = y + 0.5f;
+
+    int2 range = tileRange[tile];
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+
+    // Block y takes every SPLAT_SPLIT-th batch of the tile's list
+    for (int start = range.x + blockIdx.y * SPLAT_BATCH; start < range.y;
+         start += SPLAT_BATCH * SPLAT_SPLIT) {
+        int count = min(SPLAT_BATCH, range.y - start);
+        if (lane < count) {
+            int body = values[start + lane];
+            pos[lane] = splatPos[body];
+            color[lane] = splatColor[body];
+        }
+        __syncthreads();
+
+        for (int k = 0; k < count; k++) {
+            float dx = fx - pos[k].x;
+            float dy = fy - pos[k].y;
+            float d2 = dx * dx + dy * dy;
+            if (d2 < pos[k].w) {
+                float w = __expf(-d2 * pos[k].z);
+                r += color[k].x * w;
+                g += color[k].y * w;
+                b += color[k].z * w;
+            }
+        }
+        __syncthreads();
+    }
+
+    if (x < width && y < height && (r > 0.0f || g > 0.0f || b > 0.0f)) {
+        int idx = y * width + x;
+        int plane = width * height;
+        atomicAdd(&hdr[idx], r);
+        atomicAdd(&hdr[idx + plane], g);
+        atomicAdd(&hdr[idx + 2 * plane], b);
+    }
+}
+
+__global__ void hdrFadeKernel(float* hdr, int count, float factor) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < count) hdr[i] *= factor;
+}
+
+// Exponential tone curve and approximate sRGB gamma over the dark background
+__global__ void toneMapKernel(unsigned char* pixels, const float* hdr, int width, int height) {
+    int x = blockIdx.x * blockDim.x + threadIdx.x;
+    int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (x >= width || y >= height) return;
+
+    int idx = y * width + x;
+    int plane = width * height;
+    const float background[3] = { 5.0f / 255.0f, 5.0f / 255.0f, 10.0f / 255.0f };  // B, G, R
+    for (int c = 0; c < 3; c++) {
+        float v = 1.0f - __expf(-hdr[idx + (2 - c) * plane]);
+        v = sqrtf(v) + background[c];
+        pixels[idx * 4 + c] = (unsigned char)(fminf(v, 1.0f) * 255.0f);
+    }
+    pixels[idx * 4 + 3] = 255;
+}
+
+void splatAlloc(SplatRenderer* s, int maxBodies, int width, int height) {
+    memset(s, 0, sizeof(*s));
+    s->tilesX = (width + SPLAT_TILE - 1) / SPLAT_TILE;
+    s->tilesY = (height + SPLAT_TILE - 1) / SPLAT_TILE;
+    cudaMalloc(&s->pos, maxBodies * sizeof(float4));
+    cudaMalloc(&s->color, maxBodies * sizeof(float4));
+    cudaMalloc(&s->pairCount, maxBodies * sizeof(int));
+    cudaMalloc(&s->pairOffset, maxBodies * sizeof(int));
+    cudaMalloc(&s->tileRange, s->tilesX * s->tilesY * sizeof(int2));
+    cudaMalloc(&s->hdr, 3 * width * height * sizeof(float));
+    cudaMemset(s->hdr, 0, 3 * width * height * sizeof(float));
+}
+
+void splatFree(SplatRenderer* s) {
+    cudaFree(s->pos);
+    cudaFree(s->color);
+    cudaFree(s->pairCount);
+    cudaFree(s->pairOffset);
+    cudaFree(s->keys);
+    cudaFree(s->values);
+    cudaFree(s->tileRange);
+    cudaFree(s->hdr);
+}
+
+void splatRender(SplatRenderer* s, unsigned char* pixels, int width, int height,
+                 const float* px, const float* py, const float* pz, const float* mass, int n,
+                 float camX, float camY, float camZ, float rotX, float rotY, float zoom,
+                 float energy, int useTrails)
+{
+    int hdrCount = 3 * width * height;
+    if (useTrails) {
+        hdrFadeKernel<<<(hdrCount + 255) / 256, 256>>>(s->hdr, hdrCount, TRAIL_DECAY);
+    } else {
+        cudaMemset(s->hdr, 0, hdrCount * sizeof(float));
+    }
+
+    // With no bodies there is no last pair count to read back; the faded
+    // or cleared buffer is still tone mapped below
+    int blocks = (n + 255) / 256;
+    int numPairs = 0;
+    if (n > 0) {
+        splatProjectKernel<<<blocks, 256>>>(s->pos, s->color, s->pairCount,
+            px, py, pz, mass, n, camX, camY, camZ, rotX, rotY, zoom,
+            width, height, s->tilesX, s->tilesY, energy);
+
+        thrust::exclusive_scan(thrust::device_ptr<int>(s->pairCount),
+                               thrust::device_ptr<int>(s->pairCount + n),
+                               thrust::device_ptr<int>(s->pairOffset));
+        int last[2];
+        cudaMemcpy(&last[0], s->pairOffset + n - 1, sizeof(int), cudaMemcpyDeviceToHost);
+        cudaMemcpy(&last[1], s->pairCount + n - 1, sizeof(int), cudaMemcpyDeviceToHost);
+        numPairs = last[0] + last[1];
+    }
+
+    if (numPairs > 0) {
+        if (numPairs > s->maxPairs) {
+            cudaFree(s->keys);
+            cudaFree(s->values);
+            s->maxPairs = numPairs + numPairs / 2;
+            cudaMalloc(&s->keys, s->maxPairs * sizeof(unsigned int));
+            cudaMalloc(&s->values, s->maxPairs * sizeof(int));
+        }
+        splatEmitKernel<<<blocks, 256>>>(s->keys, s->values, s->pos, s->pairCount,
+                                         s->pairOffset, n, s->tilesX, s->tilesY);
+        thrust::sort_by_key(thrust::device_ptr<unsigned int>(s->keys),
+                            thrust::device_ptr<unsigned int>(s->keys + numPairs),
+                            thrust::device_ptr<int>(s->values));
+
+        cudaMemset(s->tileRange, 0, s->tilesX * s->tilesY * sizeof(int2));
+        splatRangeKernel<<<(numPairs + 255) / 256, 256>>>(s->tileRange, s->keys, numPairs);
+
+        dim3 tileGrid(s->tilesX * s->tilesY, SPLAT_SPLIT);
+        dim3 tileBlock(SPLAT_TILE, SPLAT_TILE);
+        splatTileKernel<<<tileGrid, tileBlock>>>(s->hdr, s->tileRange, s->values,
+                                                 s->pos, s->color, width, height, s->tilesX);
+    }
+
+    dim3 block(16, 16);
+    dim3 grid((width + 15) / 16, (height + 15) / 16);
+    toneMapKernel<<<grid, block>>>(pixels, s->hdr, width, height);
+}
+
+#endif
+
 // ============== GALAXY PRESETS ==============
 
 // Random float in range [0, 1)
@@ -258,15 +3867,23 @@ float randf() {
     return (float)rand() / (float)RAND_MAX;
 }
 
+// Per-body mass factor so large runs keep the same total mass (and
+// therefore the same dynamics) as the REFERENCE_BODIES preset
+float massScale(int n) {
+    return n > REFERENCE_BODIES ? (float)REFERENCE_BODIES / n : 1.0f;
+}
+
 // Gaussian random
 float gaussRand() {
     float u1 = randf() + 0.0001f;
     float u2 = randf();
-    return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * 3.14159f * u2);
+    // u1 can reach 1.0001, clamp so log(u1) > 0 cannot produce a NaN body
+    return sqrtf(fmaxf(0.0f, -2.0f * logf(u1))) * cosf(2.0f * 3.14159f * u2);
 }
 
 void initUniformSphere(Bodies* b, int n) {
     b->count = n;
+    float ms = massScale(n);
     for (int i = 0; i < n; i++) {
         // Uniform distribution in sphere
         float theta = randf() * 2.0f * 3.14159f;
@@ -281,12 +3898,13 @@ void initUniformSphere(Bodies* b, int n) {
         b->vy[i] = gaussRand() * 0.5f;
         b->vz[i] = gaussRand() * 0.5f;
 
-        b->mass[i] = 0.5f + randf() * 0.5f;
+        b->mass[i] = (0.5f + randf() * 0.5f) * ms;
     }
 }
 
 void initRotatingDisk(Bodies* b, int n) {
     b->count = n;
+    float ms = massScale(n);
     for (int i = 0; i < n; i++) {
         // Disk in XZ plane
         float theta = randf() * 2.0f * 3.14159f;
@@ -297,18 +3915,19 @@ void initRotatingDisk(Bodies* b, int n) {
         b->z[i] = r * sinf(theta);
 
         // Circular velocity (Keplerian-ish)
-        float v = sqrtf(G * n * 0.5f / r) * 0.3f;
+        float v = sqrtf(G * n * ms * 0.5f / r) * 0.3f;
         b->vx[i] = -v * sinf(theta) + gaussRand() * 0.2f;
         b->vy[i] = gaussRand() * 0.1f;
         b->vz[i] = v * cosf(theta) + gaussRand() * 0.2f;
 
-        b->mass[i] = 0.3f + randf() * 0.4f;
+        b->mass[i] = (0.3f + randf() * 0.4f) * ms;
     }
 }
 
 void initCollidingGalaxies(Bodies* b, int n) {
     b->count = n;
     int half = n / 2;
+    float ms = massScale(n);
 
     // Galaxy 1
     for (int i = 0; i < half; i++) {
@@ -319,12 +3938,12 @@ void initCollidingGalaxies(Bodies* b, int n) {
         b->y[i] = gaussRand() * 0.5f;
         b->z[i] = r * sinf(theta);
 
-        float v = sqrtf(G * half * 0.3f / r) * 0.2f;
+        float v = sqrtf(G * half * ms * 0.3f / r) * 0.2f;
         b->vx[i] = 1.5f - v * sinf(theta);
         b->vy[i] = gaussRand() * 0.1f;
         b->vz[i] = v * cosf(theta);
 
-        b->mass[i] = 0.3f + randf() * 0.3f;
+        b->mass[i] = (0.3f + randf() * 0.3f) * ms;
     }
 
     // Galaxy 2
@@ -336,12 +3955,12 @@ void initCollidingGalaxies(Bodies* b, int n) {
         b->y[i] = 5.0f + gaussRand() * 0.5f;
         b->z[i] = r * sinf(theta);
 
-        float v = sqrtf(G * half * 0.3f / r) * 0.2f;
+        float v = sqrtf(G * half * ms * 0.3f / r) * 0.2f;
         b->vx[i] = -1.5f + v * sinf(theta);
         b->vy[i] = -0.3f + gaussRand() * 0.1f;
         b->vz[i] = -v * cosf(theta);
 
-        b->mass[i] = 0.3f + randf() * 0.3f;
+        b->mass[i] = (0.3f + randf() * 0.3f) * ms;
     }
 }
 
@@ -370,7 +3989,7 @@ void initCentralMass(Bodies* b, int n) {
         b->vy[i] = gaussRand() * 0.1f;
         b->vz[i] = v * cosf(theta) + gaussRand() * 0.3f;
 
-        b->mass[i] = 0.1f + randf() * 0.2f;
+        b->mass[i] = (0.1f + randf() * 0.2f) * massScale(n);
     }
 }
 
@@ -420,7 +4039,7 @@ void initFigure8(Bodies* b, int n) {
         b->vy[i] = gaussRand() * 0.3f;
         b->vz[i] = gaussRand() * 0.1f;
 
-        b->mass[i] = 0.05f + randf() * 0.1f;
+        b->mass[i] = (0.05f + randf() * 0.1f) * massScale(n);
     }
 }
 
@@ -432,7 +4051,223 @@ double getTime() {
     return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-int main() {
+#define BENCH_SAMPLES 256
+#define BENCH_SECONDS 2.0
+
+// RMS relative error of accelerations (stride apart, ax first) against
+// the double precision reference on the sampled targets
+static double benchError(const float* ax, const float* ay, const float* az,
+                         int stride, const int* targets, const double* ref, int samples)
+{
+    double errSum = 0.0, refSum = 0.0;
+    for (int k = 0; k < samples; k++) {
+        int i = targets[k] * stride;
+        double d[3] = { ax[i] - ref[3 * k], ay[i] - ref[3 * k + 1], az[i] - ref[3 * k + 2] };
+        for (int c = 0; c < 3; c++) {
+            errSum += d[c] * d[c];
+            refSum += ref[3 * k + c] * ref[3 * k + c];
+        }
+    }
+    return sqrt(errSum / fmax(refSum, 1e-30));
+}
+
+// Times the host solver in the SoA and AoS layouts (and the GPU kernel in
+// CUDA builds) on a uniform sphere of n bodies, each checked against a
+// double precision sum on a sample of targets
+int hostBenchmark(int n) {
+    if (n < 1 || n > MAX_BODIES) {
+        fprintf(stderr, "Body count must be 1-%d\n", MAX_BODIES);
+        return 1;
+    }
+    float* columns = (float*)malloc(8 * (size_t)n * sizeof(float));
+    Bodies h = { columns, columns + n, columns + 2 * n, columns + 3 * n,
+                 columns + 4 * n, columns + 5 * n, columns + 6 * n, n };
+    srand(42);
+    initUniformSphere(&h, n);
+    float softening2 = SOFTENING * SOFTENING;
+
+    float* ax = (float*)malloc(3 * (size_t)n * sizeof(float));
+    float* ay = ax + n;
+    float* az = ax + 2 * n;
+    float4* bodies = (float4*)malloc(n * sizeof(float4));
+    float4* acc = (float4*)malloc(n * sizeof(float4));
+    for (int i = 0; i < n; i++) bodies[i] = make_float4(h.x[i], h.y[i], h.z[i], h.mass[i]);
+
+    int samples = n < BENCH_SAMPLES ? n : BENCH_SAMPLES;
+    int targets[BENCH_SAMPLES];
+    double ref[3 * BENCH_SAMPLES];
+    for (int k = 0; k < samples; k++) {
+        int i = targets[k] = rand() % n;
+        double sx = 0.0, sy = 0.0, sz = 0.0;
+        for (int j = 0; j < n; j++) {
+            double dx = h.x[j] - h.x[i], dy = h.y[j] - h.y[i], dz = h.z[j] - h.z[i];
+            double r2 = dx * dx + dy * dy + dz * dz + softening2;
+            double f = G * h.mass[j] / (r2 * sqrt(r2));
+            sx += dx * f; sy += dy * f; sz += dz * f;
+        }
+        ref[3 * k] = sx; ref[3 * k + 1] = sy; ref[3 * k + 2] = sz;
+    }
+
+    // Alternate the layouts so both see the same thermal / clock state
+    double soaTime = 0.0, aosTime = 0.0;
+    int reps = 0;
+    while (reps < 3 || soaTime + aosTime < BENCH_SECONDS) {
+        double t0 = getTime();
+        hostComputeForces(ax, ay, az, NULL, h.x, h.y, h.z, h.mass, n, softening2, G);
+        double t1 = getTime();
+        hostComputeForcesAos(acc, bodies, n, softening2, G);
+        double t2 = getTime();
+        soaTime += t1 - t0;
+        aosTime += t2 - t1;
+        reps++;
+    }
+
+    double pairs = (double)n * n;
+    printf("Direct sum, %d bodies, %d host threads, %d runs:\n", n, hostThreadCount(), reps);
+    printf("  Host SoA     %9.2f ms  %6.2f G interactions/s  RMS error %.1e\n",
+           1000.0 * soaTime / reps, pairs * reps / soaTime * 1e-9,
+           benchError(ax, ay, az, 1, targets, ref, samples));
+    printf("  Host float4  %9.2f ms  %6.2f G interactions/s  RMS error %.1e\n",
+           1000.0 * aosTime / reps, pairs * reps / aosTime * 1e-9,
+           benchError(&acc[0].x, &acc[0].y, &acc[0].z, 4, targets, ref, samples));
+
+#ifndef CPU_ONLY
+    float *d_columns, *d_acc;
+    cudaMalloc(&d_columns, 4 * (size_t)n * sizeof(float));
+    cudaMalloc(&d_acc, 3 * (size_t)n * sizeof(float));
+    cudaMemcpy(d_columns, h.x, 3 * (size_t)n * sizeof(float), cudaMemcpyHostToDevice);
+    cudaMemcpy(d_columns + 3 * n, h.mass, n * sizeof(float), cudaMemcpyHostToDevice);
+    int blocks = (n + TILE_SIZE - 1) / TILE_SIZE;
+    double gpuTime = 0.0;
+    for (int r = 0; r <= reps; r++) {
+        double t0 = getTime();
+        computeForcesKernel<<<blocks, TILE_SIZE>>>(d_acc, d_acc + n, d_acc + 2 * n,
+            d_columns, d_columns + n, d_columns + 2 * n, d_columns + 3 * n,
+            n, softening2, G);
+        cudaDeviceSynchronize();
+        if (r > 0) gpuTime += getTime() - t0;     // First launch is warm-up
+    }
+    cudaMemcpy(ax, d_acc, 3 * (size_t)n * sizeof(float), cudaMemcpyDeviceToHost);
+    printf("  GPU tiled    %9.2f ms  %6.2f G interactions/s  RMS error %.1e\n",
+           1000.0 * gpuTime / reps, pairs * reps / gpuTime * 1e-9,
+           benchError(ax, ay, az, 1, targets, ref, samples));
+    cudaFree(d_columns);
+    cudaFree(d_acc);
+#endif
+
+    free(columns); free(ax); free(bodies); free(acc);
+    return 0;
+}
+
+#ifndef CPU_ONLY
+#define ACCURACY_SAMPLES 512
+
+// Compares the selected solver against the direct sum on a random sample
+// of bodies and prints the RMS and worst relative acceleration error
+void checkAccuracy(int solver, BHTree* tree, FmmSolver* fmm,
+                   const float* px, const float* py, const float* pz,
+                   const float* mass, int n, float softening2, float theta)
+{
+    int samples = n < ACCURACY_SAMPLES ? n : ACCURACY_SAMPLES;
+    float *d_acc, *d_ref;
+    int* d_targets;
+    cudaMalloc(&d_acc, 3 * n * sizeof(float));
+    cudaMalloc(&d_ref, 3 * n * sizeof(float));
+    cudaMalloc(&d_targets, samples * sizeof(int));
+
+    int* targets = (int*)malloc(samples * sizeof(int));
+    for (int k = 0; k < samples; k++) targets[k] = rand() % n;
+    cudaMemcpy(d_targets, targets, samples * sizeof(int), cudaMemcpyHostToDevice);
+
+    double start = getTime();
+    computeForces(solver, tree, fmm, d_acc, d_acc + n, d_acc + 2 * n, NULL,
+                  px, py, pz, mass, n, softening2, theta);
+    cudaDeviceSynchronize();
+    double elapsed = getTime() - start;
+
+    computeForcesActiveKernel<<<(samples + TILE_SIZE - 1) / TILE_SIZE, TILE_SIZE>>>(
+        d_ref, d_ref + n, d_ref + 2 * n, px, py, pz, mass,
+        d_targets, samples, n, softening2, G);
+
+    float* acc = (float*)malloc(3 * n * sizeof(float));
+    float* ref = (float*)malloc(3 * n * sizeof(float));
+    cudaMemcpy(acc, d_acc, 3 * n * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(ref, d_ref, 3 * n * sizeof(float), cudaMemcpyDeviceToHost);
+
+    double errSum = 0.0, refSum = 0.0, worst = 0.0;
+    for (int k = 0; k < samples; k++) {
+        int i = targets[k];
+        double err2 = 0.0, ref2 = 0.0;
+        for (int c = 0; c < 3; c++) {
+            double d = acc[c * n + i] - ref[c * n + i];
+            err2 += d * d;
+            ref2 += (double)ref[c * n + i] * ref[c * n + i];
+        }
+        errSum += err2;
+        refSum += ref2;
+        if (ref2 > 0.0) worst = fmax(worst, sqrt(err2 / ref2));
+    }
+    printf("Accuracy vs direct sum (%d bodies): RMS %.3f%%, worst %.3f%% | %.1f ms\n",
+           samples, 100.0 * sqrt(errSum / fmax(refSum, 1e-30)), 100.0 * worst,
+           elapsed * 1000.0);
+
+    free(acc); free(ref); free(targets);
+    cudaFree(d_acc); cudaFree(d_ref); cudaFree(d_targets);
+}
+
+void uploadBodies(float* const d[SNAPSHOT_COLUMNS], const Bodies* h, int n) {
+    const float* columns[SNAPSHOT_COLUMNS] = { h->x, h->y, h->z, h->vx, h->vy, h->vz, h->mass };
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        cudaMemcpy(d[c], columns[c], n * sizeof(float), cudaMemcpyHostToDevice);
+    }
+}
+
+void downloadBodies(Bodies* h, float* const d[SNAPSHOT_COLUMNS], int n) {
+    float* columns[SNAPSHOT_COLUMNS] = { h->x, h->y, h->z, h->vx, h->vy, h->vz, h->mass };
+    for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+        cudaMemcpy(columns[c], d[c], n * sizeof(float), cudaMemcpyDeviceToHost);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* restartPath = NULL;
+    const char* trajectoryPath = NULL;
+    int trajectoryEvery = TRAJECTORY_DEFAULT_EVERY;
+    const char* telemetryPath = NULL;
+    int diagEvery = 0;
+    int ranks = 1;
+    int remoteWorkers = 0;
+    int port = DIST_DEFAULT_PORT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--restart") == 0 && i + 1 < argc) {
+            restartPath = argv[++i];
+        } else if (strcmp(argv[i], "--trajectory") == 0 && i + 1 < argc) {
+            trajectoryPath = argv[++i];
+        } else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+            trajectoryEvery = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--diag") == 0 && i + 1 < argc) {
+            diagEvery = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            telemetryPath = argv[++i];
+        } else if (strcmp(argv[i], "--bench-host") == 0 && i + 1 < argc) {
+            return hostBenchmark(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--ranks") == 0 && i + 1 < argc) {
+            ranks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--remote") == 0) {
+            remoteWorkers = 1;
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            return distWorkerMain(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--restart FILE] [--trajectory FILE [--every K]]"
+                            " [--diag K] [--telemetry FILE]"
+                            " [--ranks P [--remote] [--port N]]"
+                            " | --bench-host N | --worker HOST:PORT\n", argv[0]);
+            return 1;
+        }
+    }
+
     printf("=== Jetson Nano CUDA N-Body Gravity Simulation ===\n\n");
     printf("Controls:\n");
     printf("  1       - Uniform sphere collapse\n");
@@ -444,10 +4279,30 @@ int main() {
     printf("  W/S     - Zoom in/out\n");
     printf("  +/-     - Time step\n");
     printf("  T       - Toggle trails\n");
+    printf("  G       - Toggle HDR splats / points\n");
+    printf("  M       - Toggle collisions / mergers\n");
+    printf("  B       - Cycle solver (direct / Barnes-Hut / FMM)\n");
+    printf("  V       - Check solver accuracy\n");
+    printf("  [/]     - Barnes-Hut theta\n");
+    printf("  ,/.     - Halve/double body count\n");
+    printf("  I       - Cycle integrator (Euler / leapfrog / Hermite)\n");
+    printf("  H       - Toggle block time steps\n");
+    printf("  E       - Toggle energy/momentum diagnostics\n");
+    printf("  K/L     - Save/load checkpoint\n");
     printf("  Space   - Pause/resume\n");
     printf("  R       - Reset current preset\n");
     printf("  Q/Esc   - Quit\n\n");
 
+    // Workers are forked before X11 is opened so they inherit no display
+    Distributed dist;
+    memset(&dist, 0, sizeof(dist));
+    dist.ranks = 1;
+    if (ranks > 1) {
+        if (distStart(&dist, ranks, port, !remoteWorkers) < 0) return 1;
+        printf("Distributed mode: direct sum with leapfrog; solver, integrator,\n"
+               "block step, merger and diagnostics settings are ignored\n");
+    }
+
     cudaDeviceProp prop;
     cudaGetDeviceProperties(&prop, 0);
     printf("GPU: %s\n", prop.name);
@@ -505,6 +4360,36 @@ int main() {
     cudaMalloc(&d_ay, MAX_BODIES * sizeof(float));
     cudaMalloc(&d_az, MAX_BODIES * sizeof(float));
 
+    BHTree tree;
+    bhAlloc(&tree, MAX_BODIES);
+
+    FmmSolver fmm;
+    fmmAlloc(&fmm, MAX_BODIES);
+
+    BlockSteps steps;
+    blockStepsAlloc(&steps, MAX_BODIES);
+
+    Hermite hermite;
+    hermiteAlloc(&hermite, MAX_BODIES);
+
+    Diagnostics diag;
+    diagnosticsAlloc(&diag, MAX_BODIES);
+    if (diagEvery > 0) diag.every = diagEvery;
+    diag.enabled = diagEvery > 0 || telemetryPath;
+    if (telemetryPath && diagnosticsOpenCsv(&diag, telemetryPath) < 0) return 1;
+
+    SplatRenderer splats;
+    splatAlloc(&splats, MAX_BODIES, WIDTH, HEIGHT);
+
+    Merger merger;
+    mergerAlloc(&merger, MAX_BODIES);
+
+    cudaEvent_t stepStart, stepStop;
+    cudaEventCreate(&stepStart);
+    cudaEventCreate(&stepStop);
+
+    float* const d_columns[SNAPSHOT_COLUMNS] = { d_x, d_y, d_z, d_vx, d_vy, d_vz, d_mass };
+
     // Allocate display buffer
     unsigned char *h_pixels, *d_pixels;
     cudaMallocHost(&h_pixels, WIDTH * HEIGHT * 4);
@@ -524,9 +4409,18 @@ int main() {
     float dt = 0.02f;
     int paused = 0;
     int showTrails = 1;
+    int useSplats = 1;
+    int solver = SOLVER_DIRECT;
+    float theta = BH_DEFAULT_THETA;
+    int useBlockSteps = 0;
+    int integrator = INTEGRATOR_LEAPFROG;
+    int haveAcc = 0;        // d_ax..d_az match the current positions
+    int distLoadPending = 1;  // Workers need h_bodies before the next step
     float rotX = 0.3f, rotY = 0.0f;
     float zoom = 80.0f;
     float camX = 0, camY = 0, camZ = 0;
+    unsigned long long stepCount = 0;
+    double simTime = 0.0;
 
     srand(42);
 
@@ -542,8 +4436,22 @@ int main() {
     cudaMemcpy(d_vz, h_bodies.vz, numBodies * sizeof(float), cudaMemcpyHostToDevice);
     cudaMemcpy(d_mass, h_bodies.mass, numBodies * sizeof(float), cudaMemcpyHostToDevice);
 
+    // Resume from a snapshot instead of the initial preset
+    const char* loadPath = restartPath;
+
+    // Rank 0 only holds the velocities of its own slab
+    if (trajectoryPath && dist.ranks > 1) {
+        fprintf(stderr, "Trajectories are not available in distributed mode\n");
+        trajectoryPath = NULL;
+    }
+    Trajectory trajectory;
+    int streaming = trajectoryPath &&
+                    trajectoryOpen(&trajectory, trajectoryPath, trajectoryEvery, numBodies) == 0;
+
     const char* presetNames[] = {"Sphere Collapse", "Rotating Disk", "Colliding Galaxies",
                                   "Central Mass", "Figure-8"};
+    const char* solverNames[] = {"Direct", "Barnes-Hut", "FMM"};
+    const char* integratorNames[] = {"Euler", "Leapfrog", "Hermite"};
     printf("Bodies: %d, Preset: %s\n", numBodies, presetNames[preset-1]);
     printf("Trails: ON\n");
 
@@ -591,6 +4499,63 @@ int main() {
                     showTrails = !showTrails;
                     printf("Trails: %s\n", showTrails ? "ON" : "OFF");
                 }
+                if (key == XK_m) {
+                    merger.enabled = !merger.enabled;
+                    printf("Mergers: %s\n", merger.enabled ? "ON" : "OFF");
+                }
+                if (key == XK_g) {
+                    useSplats = !useSplats;
+                    cudaMemset(splats.hdr, 0, 3 * WIDTH * HEIGHT * sizeof(float));
+                    printf("Renderer: %s\n", useSplats ? "HDR splats" : "points");
+                }
+                if (key == XK_b) {
+                    solver = (solver + 1) % NUM_SOLVERS;
+                    printf("Solver: %s\n", solverNames[solver]);
+                    haveAcc = 0;
+                    if (solver == SOLVER_DIRECT && numBodies > 16384) {
+                        printf("  (direct sum is O(N^2): expect a very low frame rate)\n");
+                    }
+                }
+                if (key == XK_v) {
+                    checkAccuracy(solver, &tree, &fmm, d_x, d_y, d_z, d_mass,
+                                  numBodies, softening2, theta);
+                }
+                if (key == XK_k && dist.ranks > 1) {
+                    printf("Checkpoints are not available in distributed mode\n");
+                } else if (key == XK_k) {
+                    downloadBodies(&h_bodies, d_columns, numBodies);
+                    if (snapshotSave(CHECKPOINT_PATH, &h_bodies, numBodies, stepCount,
+                                     simTime, dt, preset) == 0) {
+                        printf("Saved %s (step %llu)\n", CHECKPOINT_PATH, stepCount);
+                    }
+                }
+                if (key == XK_l) loadPath = CHECKPOINT_PATH;
+                if (key == XK_i) {
+                    integrator = (integrator + 1) % NUM_INTEGRATORS;
+                    haveAcc = 0;
+                    printf("Integrator: %s\n", integratorNames[integrator]);
+                    if (integrator == INTEGRATOR_HERMITE && solver != SOLVER_DIRECT) {
+                        printf("  (Hermite needs the jerk and always uses the direct sum)\n");
+                    }
+                }
+                if (key == XK_e) {
+                    diag.enabled = !diag.enabled;
+                    diag.haveReference = diag.measured = 0;
+                    printf("Diagnostics: %s (every %d steps)\n",
+                           diag.enabled ? "ON" : "OFF", diag.every);
+                }
+                if (key == XK_h) {
+                    useBlockSteps = !useBlockSteps;
+                    steps.initialized = 0;
+                    haveAcc = 0;
+                    steps.forceEvals = steps.substeps = 0;
+                    printf("Block time steps: %s\n", useBlockSteps ? "ON" : "OFF");
+                }
+                if (key == XK_bracketleft || key == XK_bracketright) {
+                    theta *= (key == XK_bracketright) ? 1.1f : 1.0f / 1.1f;
+                    theta = fmaxf(0.1f, fminf(1.5f, theta));
+                    printf("Theta: %.2f\n", theta);
+                }
 
                 // Presets
                 int newPreset = 0;
@@ -601,6 +4566,18 @@ int main() {
                 if (key == XK_5) newPreset = 5;
                 if (key == XK_r) newPreset = preset;  // Reset current
 
+                // Body count (re-initializes the current preset)
+                if ((key == XK_comma && numBodies > 256) ||
+                    (key == XK_period && numBodies < MAX_BODIES)) {
+                    numBodies = (key == XK_period) ? numBodies * 2 : numBodies / 2;
+                    gridSize = dim3((numBodies + TILE_SIZE - 1) / TILE_SIZE);
+                    newPreset = preset;
+                    printf("Bodies: %d\n", numBodies);
+                    if (numBodies > 16384 && solver == SOLVER_DIRECT) {
+                        printf("  (press B for Barnes-Hut or FMM at this size)\n");
+                    }
+                }
+
                 if (newPreset > 0) {
                     preset = newPreset;
                     srand(time(NULL));
@@ -623,6 +4600,11 @@ int main() {
 
                     // Clear screen
                     cudaMemset(d_pixels, 0, WIDTH * HEIGHT * 4);
+                    cudaMemset(splats.hdr, 0, 3 * WIDTH * HEIGHT * sizeof(float));
+                    steps.initialized = 0;
+                    haveAcc = 0;
+                    diag.haveReference = 0;
+                    distLoadPending = 1;
 
                     printf("Preset: %s\n", presetNames[preset-1]);
                 }
@@ -631,30 +4613,142 @@ int main() {
             if (event.type == DestroyNotify) goto cleanup;
         }
 
-        // Physics simulation
-        if (!paused) {
+        if (loadPath) {
+            SnapshotHeader header;
+            int n = snapshotLoad(loadPath, &h_bodies, MAX_BODIES, &header);
+            if (n > 0) {
+                numBodies = n;
+                gridSize = dim3((numBodies + TILE_SIZE - 1) / TILE_SIZE);
+                dt = header.dt;
+                preset = (header.preset >= 1 && header.preset <= 5) ? header.preset : preset;
+                stepCount = header.step;
+                simTime = header.time;
+                uploadBodies(d_columns, &h_bodies, numBodies);
+                cudaMemset(d_pixels, 0, WIDTH * HEIGHT * 4);
+                steps.initialized = 0;
+                haveAcc = 0;
+                diag.haveReference = 0;
+                distLoadPending = 1;
+            }
+            loadPath = NULL;
+        }
+
+        // Physics simulation. On diagnostics steps the direct / leapfrog
+        // paths fold the potential into their force pass; Hermite and block
+        // steps need a separate pass after the step.
+        int measure = !paused && diag.enabled && dist.ranks == 1 &&
+                      (stepCount + 1) % diag.every == 0;
+        cudaEventRecord(stepStart);
+        if (!paused && dist.ranks > 1) {
+            if (distLoadPending) {
+                if (distLoad(&dist, &h_bodies, numBodies, dt, softening2,
+                             d_columns, d_ax, d_ay, d_az) < 0) {
+                    fprintf(stderr, "Lost connection to a worker\n");
+                    goto cleanup;
+                }
+                distLoadPending = 0;
+            }
+            if (distStep(&dist, d_columns, d_ax, d_ay, d_az, dt, softening2) < 0) {
+                fprintf(stderr, "Lost connection to a worker\n");
+                goto cleanup;
+            }
+            cudaEventRecord(stepStop);
+        } else if (!paused && useBlockSteps) {
+            blockStep(&steps, solver, &tree, &fmm,
+                      d_x, d_y, d_z, d_vx, d_vy, d_vz, d_ax, d_ay, d_az,
+                      d_mass, numBodies, dt, SOFTENING, theta);
+            cudaEventRecord(stepStop);
+            if (measure) {
+                diagnosticsEvaluate(&diag, solver, &tree, &fmm, d_x, d_y, d_z,
+                                    d_vx, d_vy, d_vz, d_mass, numBodies, softening2, theta);
+            }
+        } else if (!paused && integrator == INTEGRATOR_HERMITE) {
+            hermiteStep(&hermite, d_x, d_y, d_z, d_vx, d_vy, d_vz, d_ax, d_ay, d_az,
+                        d_mass, numBodies, dt, softening2, haveAcc);
+            haveAcc = 1;
+            cudaEventRecord(stepStop);
+            if (measure) {
+                diagnosticsEvaluate(&diag, SOLVER_DIRECT, &tree, &fmm, d_x, d_y, d_z,
+                                    d_vx, d_vy, d_vz, d_mass, numBodies, softening2, theta);
+            }
+        } else if (!paused && integrator == INTEGRATOR_LEAPFROG) {
+            leapfrogStep(solver, &tree, &fmm, d_x, d_y, d_z, d_vx, d_vy, d_vz,
+                         d_ax, d_ay, d_az, measure ? diag.pot : NULL,
+                         d_mass, numBodies, dt, softening2, theta, haveAcc);
+            haveAcc = 1;
+            cudaEventRecord(stepStop);
+            if (measure) {
+                diagnosticsReduce(&diag, d_x, d_y, d_z, d_vx, d_vy, d_vz,
+                                  d_ax, d_ay, d_az, d_mass, numBodies);
+            }
+        } else if (!paused) {
             // Compute forces
-            computeForcesKernel<<<gridSize, blockSize>>>(
-                d_ax, d_ay, d_az,
-                d_x, d_y, d_z, d_mass,
-                numBodies, softening2, G);
+            computeForces(solver, &tree, &fmm, d_ax, d_ay, d_az, measure ? diag.pot : NULL,
+                          d_x, d_y, d_z, d_mass, numBodies, softening2, theta);
+
+            // Positions, velocities and forces agree only before the update
+            if (measure) {
+                diagnosticsReduce(&diag, d_x, d_y, d_z, d_vx, d_vy, d_vz,
+                                  d_ax, d_ay, d_az, d_mass, numBodies);
+            }
 
             // Integrate
             integrateKernel<<<gridSize, blockSize>>>(
                 d_x, d_y, d_z, d_vx, d_vy, d_vz,
                 d_ax, d_ay, d_az,
                 numBodies, dt);
+            cudaEventRecord(stepStop);
+        }
+
+        if (!paused && merger.enabled && dist.ranks == 1) {
+            int survivors = mergeBodies(&merger, d_columns, numBodies);
+            if (survivors != numBodies) {
+                numBodies = survivors;
+                gridSize = dim3((numBodies + TILE_SIZE - 1) / TILE_SIZE);
+                // Accelerations, block levels and the energy baseline no
+                // longer match the compacted bodies
+                steps.initialized = 0;
+                haveAcc = 0;
+                diag.haveReference = 0;
+            }
+        }
+
+        if (!paused) {
+            stepCount++;
+            simTime += dt;
+            if (streaming && stepCount % trajectory.every == 0) {
+                trajectoryCapture(&trajectory, d_columns, numBodies, stepCount, simTime,
+                                  dt, preset);
+            }
+            if (measure) {
+                float stepMs = 0.0f;
+                cudaEventSynchronize(stepStop);
+                cudaEventElapsedTime(&stepMs, stepStart, stepStop);
+                int hermiteDirect = integrator == INTEGRATOR_HERMITE && !useBlockSteps;
+                diagnosticsWriteCsv(&diag, stepCount, simTime, numBodies,
+                                    solverNames[hermiteDirect ? SOLVER_DIRECT : solver],
+                                    useBlockSteps ? "Block" : integratorNames[integrator],
+                                    dt, stepMs);
+            }
         }
 
         // Render
-        clearKernel<<<dispGridSize, dispBlockSize>>>(d_pixels, WIDTH, HEIGHT, showTrails);
+        if (useSplats) {
+            // Large runs scale body masses down, so they also get less light
+            // per body; the square root keeps sparse outskirts visible at 1M
+            splatRender(&splats, d_pixels, WIDTH, HEIGHT, d_x, d_y, d_z, d_mass, numBodies,
+                        camX, camY, camZ, rotX, rotY, zoom,
+                        SPLAT_ENERGY * sqrtf(massScale(numBodies)), showTrails);
+        } else {
+            clearKernel<<<dispGridSize, dispBlockSize>>>(d_pixels, WIDTH, HEIGHT, showTrails);
 
-        renderBodiesKernel<<<gridSize, blockSize>>>(
-            d_pixels, WIDTH, HEIGHT,
-            d_x, d_y, d_z, d_mass,
-            numBodies,
-            camX, camY, camZ,
-            rotX, rotY, zoom);
+            renderBodiesKernel<<<gridSize, blockSize>>>(
+                d_pixels, WIDTH, HEIGHT,
+                d_x, d_y, d_z, d_mass,
+                numBodies,
+                camX, camY, camZ,
+                rotX, rotY, zoom);
+        }
 
         cudaDeviceSynchronize();
 
@@ -666,8 +4760,32 @@ int main() {
         frameCount++;
         double now = getTime();
         if (now - lastFpsTime >= 1.0) {
-            printf("FPS: %.1f | Bodies: %d | dt: %.4f\n",
+            int hermiteDirect = integrator == INTEGRATOR_HERMITE && !useBlockSteps;
+            printf("FPS: %.1f | Bodies: %d | dt: %.4f",
                    frameCount / (now - lastFpsTime), numBodies, dt);
+            if (dist.ranks > 1) {
+                printf(" | Direct | Leapfrog | %d ranks", dist.ranks);
+            } else {
+                printf(" | %s", hermiteDirect ? solverNames[SOLVER_DIRECT] : solverNames[solver]);
+                if (!useBlockSteps) printf(" | %s", integratorNames[integrator]);
+            }
+            if (useBlockSteps && steps.substeps > 0 && dist.ranks == 1) {
+                // Cost relative to stepping every body at the finest sub-step
+                printf(" | levels 0-%d, %.1f%% of force evals",
+                       steps.maxLevel,
+                       100.0 * steps.forceEvals / ((double)numBodies * steps.substeps));
+                steps.forceEvals = steps.substeps = 0;
+            }
+            if (merger.enabled && dist.ranks == 1) {
+                printf(" | %d merged", merger.merged);
+                merger.merged = 0;
+            }
+            if (diag.enabled && diag.measured) {
+                printf(" | dE/E %+.2e dP %.1e dL %.1e Q %.3f",
+                       diag.energyDrift, diag.momentumDrift, diag.angularDrift,
+                       diag.virialRatio);
+            }
+            printf("\n");
             frameCount = 0;
             lastFpsTime = now;
         }
@@ -677,6 +4795,9 @@ int main() {
 cleanup:
     printf("\nCleaning up...\n");
 
+    if (streaming) trajectoryClose(&trajectory);
+    if (dist.ranks > 1) distStop(&dist);
+
     XFreeGC(display, gc);
     image->data = NULL;
     XDestroyImage(image);
@@ -687,6 +4808,15 @@ cleanup:
     cudaFree(d_vx); cudaFree(d_vy); cudaFree(d_vz);
     cudaFree(d_mass);
     cudaFree(d_ax); cudaFree(d_ay); cudaFree(d_az);
+    bhFree(&tree);
+    hermiteFree(&hermite);
+    diagnosticsFree(&diag);
+    splatFree(&splats);
+    mergerFree(&merger);
+    cudaEventDestroy(stepStart);
+    cudaEventDestroy(stepStop);
+    fmmFree(&fmm);
+    blockStepsFree(&steps);
     cudaFree(d_pixels);
 
     cudaFreeHost(h_bodies.x); cudaFreeHost(h_bodies.y); cudaFreeHost(h_bodies.z);
@@ -697,3 +4827,147 @@ cleanup:
     printf("Done!\n");
     return 0;
 }
+#else
+// Kinetic plus potential energy (pot holds the potential per unit mass)
+static double hostEnergy(const Bodies* h, const float* pot, int n) {
+    double e = 0.0;
+    for (int i = 0; i < n; i++) {
+        e += h->mass[i] * (0.5 * (h->vx[i] * h->vx[i] + h->vy[i] * h->vy[i] +
+                                  h->vz[i] * h->vz[i]) + 0.5 * pot[i]);
+    }
+    return e;
+}
+
+// Host direct sum or host FMM (near and far field on the host threads)
+static void hostSolverForces(int solver, FmmSolver* fmm, float* ax, float* ay, float* az,
+                             float* pot, const Bodies* h, int n, float softening2) {
+    if (solver == SOLVER_FMM) {
+        fmmComputeForcesHost(fmm, ax, ay, az, pot, h->x, h->y, h->z, h->mass, n, softening2);
+    } else {
+        hostComputeForces(ax, ay, az, pot, h->x, h->y, h->z, h->mass, n, softening2, G);
+    }
+}
+
+// Host-only build: no window, a preset is stepped with kick-drift-kick
+// leapfrog on the host direct sum or FMM (merging touching bodies after each
+// step with --merge) and throughput and energy drift are printed about once
+// a second
+int main(int argc, char** argv) {
+    int numBodies = 4096;
+    int preset = 2;
+    int maxSteps = 1000;
+    float dt = 0.02f;
+    int merge = 0;
+    int solver = SOLVER_DIRECT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            return hostBenchmark(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc) {
+            numBodies = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc) {
+            preset = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            maxSteps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dt") == 0 && i + 1 < argc) {
+            dt = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            merge = 1;
+        } else if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "direct") == 0 || strcmp(argv[i + 1], "fmm") == 0)) {
+            solver = strcmp(argv[++i], "fmm") == 0 ? SOLVER_FMM : SOLVER_DIRECT;
+        } else {
+            fprintf(stderr, "Usage: %s [--bodies N] [--preset 1-5] [--steps K] [--dt DT]"
+                            " [--merge] [--solver direct|fmm] | --bench N\n", argv[0]);
+            return 1;
+        }
+    }
+    if (numBodies < 3 || numBodies > MAX_BODIES || preset < 1 || preset > 5) {
+        fprintf(stderr, "Need 3-%d bodies and a preset from 1 to 5\n", MAX_BODIES);
+        return 1;
+    }
+
+    int n = numBodies;
+    float* columns = (float*)malloc(11 * (size_t)n * sizeof(float));
+    Bodies h = { columns, columns + n, columns + 2 * n, columns + 3 * n,
+                 columns + 4 * n, columns + 5 * n, columns + 6 * n, n };
+    float* ax = columns + 7 * n;
+    float* ay = columns + 8 * n;
+    float* az = columns + 9 * n;
+    float* pot = columns + 10 * n;
+
+    srand(42);
+    switch (preset) {
+        case 1: initUniformSphere(&h, n); break;
+        case 2: initRotatingDisk(&h, n); break;
+        case 3: initCollidingGalaxies(&h, n); break;
+        case 4: initCentralMass(&h, n); break;
+        case 5: initFigure8(&h, n); break;
+    }
+
+    float softening2 = SOFTENING * SOFTENING;
+    float* const mergeColumns[MERGE_COLUMNS] = { h.x, h.y, h.z, h.vx, h.vy, h.vz, h.mass };
+    FmmSolver fmm;
+    fmmAlloc(&fmm, n);
+    hostSolverForces(solver, &fmm, ax, ay, az, pot, &h, n, softening2);
+    double e0 = hostEnergy(&h, pot, n);
+    printf("Host %s solver: %d bodies, preset %d, %d threads%s\n",
+           solver == SOLVER_FMM ? "FMM" : "direct-sum", n, preset, hostThreadCount(),
+           merge ? ", mergers on" : "");
+
+    double lastTime = getTime();
+    int lastStep = 0, merged = 0;
+    for (int step = 1; step <= maxSteps; step++) {
+        float halfDt = 0.5f * dt;
+        for (int i = 0; i < n; i++) {
+            h.vx[i] += ax[i] * halfDt;
+            h.vy[i] += ay[i] * halfDt;
+            h.vz[i] += az[i] * halfDt;
+            h.x[i] += h.vx[i] * dt;
+            h.y[i] += h.vy[i] * dt;
+            h.z[i] += h.vz[i] * dt;
+        }
+        hostSolverForces(solver, &fmm, ax, ay, az, pot, &h, n, softening2);
+        for (int i = 0; i < n; i++) {
+            h.vx[i] += ax[i] * halfDt;
+            h.vy[i] += ay[i] * halfDt;
+            h.vz[i] += az[i] * halfDt;
+        }
+
+        if (merge) {
+            int survivors = mergeBodiesHost(mergeColumns, n);
+            if (survivors != n) {
+                // Mergers are inelastic, so the energy baseline starts over
+                // (as diag.haveReference does in the windowed build)
+                merged += n - survivors;
+                n = survivors;
+                hostSolverForces(solver, &fmm, ax, ay, az, pot, &h, n, softening2);
+                e0 = hostEnergy(&h, pot, n);
+            }
+        }
+
+        double now = getTime();
+        if (now - lastTime >= 1.0 || step == maxSteps) {
+            double e = hostEnergy(&h, pot, n);
+            double rate = (step - lastStep) / (now - lastTime);
+            printf("Step %d | t %.2f | %.1f steps/s | ", step, step * dt, rate);
+            if (solver == SOLVER_FMM) {
+                printf("%.2f M bodies/s", rate * n * 1e-6);
+            } else {
+                printf("%.2f G interactions/s", rate * n * (double)n * 1e-9);
+            }
+            printf(" | dE/E %+.2e", (e - e0) / fabs(e0));
+            if (merge) {
+                printf(" | %d bodies, %d merged", n, merged);
+                merged = 0;
+            }
+            printf("\n");
+            lastTime = now;
+            lastStep = step;
+        }
+    }
+
+    fmmFree(&fmm);
+    free(columns);
+    return 0;
+}
+#endif
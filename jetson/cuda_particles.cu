@@ -3,6 +3,10 @@
  *
  * Simulates thousands of particles with gravity, bouncing, and trails
  * All physics computed in parallel on the GPU!
+ *
+ * Particles add their light to a fixed-point HDR buffer with integer
+ * atomics and a tone-mapping pass converts it to 8-bit colour, so bright
+ * overlaps do not clip and trails fade without 8-bit rounding.
  */
 
 #include <cuda_runtime.h>
@@ -19,6 +23,8 @@
 #define HEIGHT 600
 #define NUM_PARTICLES 50000
 #define TRAIL_FADE 0.92f
+#define HDR_ONE 4096.0f         // Fixed-point units per unit of light
+#define PARTICLE_LIGHT 0.5f     // Light added by a full-intensity particle
 
 struct Particle {
     float x, y;
@@ -96,48 +102,73 @@ __global__ void updateParticles(Particle* particles, curandState* states,
     p->g *= (0.97f + fade * 0.03f);
 }
 
-// Render particles to framebuffer
-__global__ void renderParticles(unsigned char* pixels, Particle* particles, int width, int height) {
+// Adds each particle's light to the HDR buffer (planar R, G, B). Freshly
+// respawned particles all sit on the emitter pixel, so when a whole warp
+// targets one pixel its light is summed with shuffles and added by one
+// lane instead of 32 atomics contending for the same address.
+__global__ void renderParticles(unsigned int* hdr, Particle* particles, int width, int height) {
     int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx >= NUM_PARTICLES) return;
-
-    Particle* p = &particles[idx];
 
-    if (p->life <= 0) return;
-
-    int px = (int)p->x;
-    int py = (int)p->y;
-
-    if (px < 0 || px >= width || py < 0 || py >= height) return;
-
-    int pidx = (py * width + px) * 4;
+    int pidx = -1;
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+    if (idx < NUM_PARTICLES) {
+        Particle* p = &particles[idx];
+        int px = (int)p->x;
+        int py = (int)p->y;
+
+        if (p->life > 0 && px >= 0 && px < width && py >= 0 && py < height) {
+            pidx = py * width + px;
+
+            float intensity = p->life / 2.5f;
+            if (intensity > 1.0f) intensity = 1.0f;
+            float light = intensity * PARTICLE_LIGHT * HDR_ONE;
+            r = p->r * light;
+            g = p->g * light;
+            b = p->b * light;
+        }
+    }
 
-    // Additive blending for glowing effect
-    float intensity = p->life / 2.5f;
-    if (intensity > 1.0f) intensity = 1.0f;
+    int plane = width * height;
+    int lane = threadIdx.x & 31;
+    int leaderPixel = __shfl_sync(0xffffffff, pidx, 0);
+    if (__all_sync(0xffffffff, pidx == leaderPixel)) {
+        if (pidx < 0) return;
+        for (int offset = 16; offset > 0; offset >>= 1) {
+            r += __shfl_down_sync(0xffffffff, r, offset);
+            g += __shfl_down_sync(0xffffffff, g, offset);
+            b += __shfl_down_sync(0xffffffff, b, offset);
+        }
+        if (lane != 0) return;
+    } else if (pidx < 0) {
+        return;
+    }
 
-    int r = pixels[pidx + 2] + (int)(p->r * intensity * 100);
-    int g = pixels[pidx + 1] + (int)(p->g * intensity * 100);
-    int b = pixels[pidx + 0] + (int)(p->b * intensity * 100);
+    atomicAdd(&hdr[pidx], (unsigned int)r);
+    atomicAdd(&hdr[pidx + plane], (unsigned int)g);
+    atomicAdd(&hdr[pidx + 2 * plane], (unsigned int)b);
+}
 
-    pixels[pidx + 2] = (r > 255) ? 255 : r;
-    pixels[pidx + 1] = (g > 255) ? 255 : g;
-    pixels[pidx + 0] = (b > 255) ? 255 : b;
-    pixels[pidx + 3] = 255;
+// Fade the HDR buffer (creates trails)
+__global__ void fadeFramebuffer(unsigned int* hdr, int count, float fade) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < count) hdr[i] = (unsigned int)(hdr[i] * fade);
 }
 
-// Fade/clear the framebuffer (creates trails)
-__global__ void fadeFramebuffer(unsigned char* pixels, int width, int height, float fade) {
+// Maps accumulated light to BGRA with an exponential curve, which keeps
+// dense regions from clipping
+__global__ void toneMap(unsigned char* pixels, const unsigned int* hdr, int width, int height) {
     int x = blockIdx.x * blockDim.x + threadIdx.x;
     int y = blockIdx.y * blockDim.y + threadIdx.y;
 
     if (x >= width || y >= height) return;
 
-    int idx = (y * width + x) * 4;
-
-    pixels[idx + 0] = (unsigned char)(pixels[idx + 0] * fade);
-    pixels[idx + 1] = (unsigned char)(pixels[idx + 1] * fade);
-    pixels[idx + 2] = (unsigned char)(pixels[idx + 2] * fade);
+    int idx = y * width + x;
+    int plane = width * height;
+    for (int c = 0; c < 3; c++) {
+        float light = hdr[idx + (2 - c) * plane] * (1.0f / HDR_ONE);
+        pixels[idx * 4 + c] = (unsigned char)(255.0f * (1.0f - __expf(-light)));
+    }
+    pixels[idx * 4 + 3] = 255;
 }
 
 double getTime() {
@@ -190,16 +221,18 @@ int main() {
     // Allocate memory
     unsigned char* h_pixels;
     unsigned char* d_pixels;
+    unsigned int* d_hdr;
     Particle* d_particles;
     curandState* d_states;
 
     cudaMallocHost(&h_pixels, WIDTH * HEIGHT * 4);
     cudaMalloc(&d_pixels, WIDTH * HEIGHT * 4);
+    cudaMalloc(&d_hdr, 3 * WIDTH * HEIGHT * sizeof(unsigned int));
     cudaMalloc(&d_particles, NUM_PARTICLES * sizeof(Particle));
     cudaMalloc(&d_states, NUM_PARTICLES * sizeof(curandState));
 
     // Clear framebuffer
-    cudaMemset(d_pixels, 0, WIDTH * HEIGHT * 4);
+    cudaMemset(d_hdr, 0, 3 * WIDTH * HEIGHT * sizeof(unsigned int));
 
     // Initialize random states
     int blockSize = 256;
@@ -222,9 +255,11 @@ int main() {
 
     GC gc = XCreateGC(display, window, 0, NULL);
 
-    // Grid config for fade kernel
-    dim3 fadeBlock(16, 16);
-    dim3 fadeGrid((WIDTH + 15) / 16, (HEIGHT + 15) / 16);
+    // Grid config for the fade and tone-mapping kernels
+    int hdrCount = 3 * WIDTH * HEIGHT;
+    int fadeBlocks = (hdrCount + blockSize - 1) / blockSize;
+    dim3 toneBlock(16, 16);
+    dim3 toneGrid((WIDTH + 15) / 16, (HEIGHT + 15) / 16);
 
     double startTime = getTime();
     double lastTime = startTime;
@@ -257,13 +292,14 @@ int main() {
         float time = (float)(now - startTime);
 
         // Fade the framebuffer (creates trails)
-        fadeFramebuffer<<<fadeGrid, fadeBlock>>>(d_pixels, WIDTH, HEIGHT, TRAIL_FADE);
+        fadeFramebuffer<<<fadeBlocks, blockSize>>>(d_hdr, hdrCount, TRAIL_FADE);
 
         // Update particles on GPU
         updateParticles<<<numBlocks, blockSize>>>(d_particles, d_states, dt, mouseX, mouseY, time);
 
         // Render particles on GPU
-        renderParticles<<<numBlocks, blockSize>>>(d_pixels, d_particles, WIDTH, HEIGHT);
+        renderParticles<<<numBlocks, blockSize>>>(d_hdr, d_particles, WIDTH, HEIGHT);
+        toneMap<<<toneGrid, toneBlock>>>(d_pixels, d_hdr, WIDTH, HEIGHT);
 
         // Copy to host
         cudaMemcpy(h_pixels, d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
@@ -291,6 +327,7 @@ cleanup:
     XCloseDisplay(display);
 
     cudaFree(d_pixels);
+    cudaFree(d_hdr);
     cudaFree(d_particles);
     cudaFree(d_states);
     cudaFreeHost(h_pixels);
@@ -1,17 +1,33 @@
 // Utah Teapot Renderer - 100% CUDA Software Rasterizer with Phong Shading
 // No OpenGL - complete transform, rasterize, shade pipeline in CUDA
 // For Jetson Nano
+//
+// Triangles are binned into 16x16 screen tiles, then each tile is
+// rasterized by one thread block with its depth buffer in registers.
+// The same pipeline runs on host threads (H key, --cpu, or a -DCPU_ONLY
+// build via make cuda_teapot_cpu); --bench FRAMES times both and exits.
 
+#ifndef CPU_ONLY
 #include <cuda_runtime.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
 #include <float.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
+#include "host_threads.h"
+
+#ifdef CPU_ONLY
+// Host-only build: the shared __host__ __device__ code compiles as plain C++
+#define __host__
+#define __device__
+#endif
 
 #define WIDTH 800
 #define HEIGHT 600
@@ -110,200 +126,554 @@ struct Triangle {
     int v0, v1, v2;
 };
 
-// Device constants - raw arrays to avoid constructor issues
-__constant__ float d_mvp[16];
-__constant__ float d_model[16];
-__constant__ float d_modelIT[16];
-__constant__ float d_lightPos[3];
-__constant__ float d_viewPos[3];
+// Mesh arrays, in host or device memory
+struct Mesh {
+    vec3* vertices;
+    vec3* normals;
+    Triangle* triangles;
+    int numVertices, numTriangles;
+};
 
-// ============== Clear Kernels ==============
+// Per-frame transforms and lights. Kernels take it by value (kernel
+// parameters live in constant memory); the host path by reference.
+struct FrameUniforms {
+    float mvp[16];
+    float model[16];
+    float modelIT[16];
+    vec3 lightPos;
+    vec3 viewPos;
+};
 
-__global__ void clearFramebuffer(unsigned char* pixels) {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx >= WIDTH * HEIGHT) return;
-    
-    int y = idx / WIDTH;
-    float t = (float)y / HEIGHT;
-    unsigned char bg = (unsigned char)(20 + t * 30);
-    
-    int pidx = idx * 4;
-    pixels[pidx + 0] = bg;
-    pixels[pidx + 1] = bg;
-    pixels[pidx + 2] = bg + 10;
-    pixels[pidx + 3] = 255;
-}
+// ============== Binned Rasterization ==============
+// The screen is cut into 16x16 tiles and a frame runs in five passes:
+//   0. Vertices: one thread per vertex transforms it once into a
+//      post-transform buffer; a teapot vertex is shared by ~6 triangles.
+//   1. Setup: one thread per triangle gathers its three transformed
+//      vertices, culls it, stores what the later passes need and counts
+//      the tiles its edges touch.
+//   2. Scan: an exclusive prefix sum of the per-tile counts gives each
+//      tile's slice of one shared triangle list.
+//   3. Bin: each triangle writes its index into the slices of its tiles.
+//   4. Raster: one block per tile, one thread per pixel. Triangles are
+//      staged through shared memory in batches; each thread keeps its
+//      pixel's depth and winning triangle in registers, then shades the
+//      winner once. No global atomics, and big triangles are spread over
+//      many blocks instead of stalling one thread.
+// Equal depths go to the lower triangle index, so the image does not depend
+// on the order in which the bin pass filled a tile's list.
 
-__global__ void clearDepth(float* depth) {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx >= WIDTH * HEIGHT) return;
-    depth[idx] = 1.0f;
-}
+#define TILE 16
+#define TILES_X ((WIDTH + TILE - 1) / TILE)
+#define TILES_Y ((HEIGHT + TILE - 1) / TILE)
+#define NUM_TILES (TILES_X * TILES_Y)
+#define SCAN_THREADS 1024
+
+// A vertex after the vertex pass: clip w (for near-plane culling), screen
+// position and depth, and the world-space inputs to lighting
+struct TransformedVertex {
+    float clipW, invW;
+    float sx, sy, sz;
+    vec3 worldPos;
+    vec3 worldNormal;
+};
 
-// ============== Rasterization Kernel ==============
+// What rasterization reads for every pixel of every tile a triangle touches
+struct TriRaster {
+    float sx[3], sy[3], sz[3];      // Screen position and depth of the corners
+    float invArea;
+};
+
+// What shading reads, once per pixel the triangle wins
+struct TriShade {
+    vec3 worldPos[3];
+    vec3 worldNormal[3];
+    float invW[3];
+};
 
-__device__ float edgeFunction(float ax, float ay, float bx, float by, float cx, float cy) {
+// Tiles under a triangle's screen bounding box (inclusive); empty if culled
+struct TileRect {
+    int x0, y0, x1, y1;
+};
+
+// Per-frame binning state, on the device or the host
+struct TileBins {
+    TransformedVertex* verts;       // One per mesh vertex
+    TriRaster* raster;
+    TriShade* shade;
+    TileRect* rect;
+    int* tileCount;                 // Triangles touching each tile
+    int* tileStart;                 // Exclusive prefix sum; [NUM_TILES] is the total
+    int* tileFill;                  // Scatter cursors for the bin pass
+    int* tileTris;                  // Triangle indices grouped by tile
+    int capacity;                   // Length of tileTris
+    int onDevice;
+};
+
+__host__ __device__ float edgeFunction(float ax, float ay, float bx, float by, float cx, float cy) {
     return (cx - ax) * (by - ay) - (cy - ay) * (bx - ax);
 }
 
-__global__ void rasterizeTriangles(
-    const vec3* vertices,
-    const vec3* normals,
-    const Triangle* triangles,
-    int numTriangles,
-    unsigned char* pixels,
-    float* depth
-) {
-    int triIdx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (triIdx >= numTriangles) return;
-    
-    Triangle tri = triangles[triIdx];
-    
-    vec3 v0 = vertices[tri.v0];
-    vec3 v1 = vertices[tri.v1];
-    vec3 v2 = vertices[tri.v2];
-    
-    vec3 n0 = normals[tri.v0];
-    vec3 n1 = normals[tri.v1];
-    vec3 n2 = normals[tri.v2];
-    
-    // Transform to clip space
-    vec4 clip0 = mulMV(d_mvp, vec4(v0, 1.0f));
-    vec4 clip1 = mulMV(d_mvp, vec4(v1, 1.0f));
-    vec4 clip2 = mulMV(d_mvp, vec4(v2, 1.0f));
-    
+__host__ __device__ void transformVertex(const Mesh& mesh, int v, const FrameUniforms& u,
+                                         TransformedVertex* out) {
+    vec3 p = mesh.vertices[v];
+    vec4 clip = mulMV(u.mvp, vec4(p, 1.0f));
+
+    // Perspective divide, then NDC to screen coordinates. Vertices behind
+    // the near plane are kept; setup culls their triangles.
+    float invW = 1.0f / clip.w;
+    out->clipW = clip.w;
+    out->invW = invW;
+    out->sx = (clip.x * invW + 1.0f) * 0.5f * WIDTH;
+    out->sy = (1.0f - clip.y * invW) * 0.5f * HEIGHT;
+    out->sz = (clip.z * invW + 1.0f) * 0.5f;
+
+    // World-space position and normal for lighting
+    vec4 world = mulMV(u.model, vec4(p, 1.0f));
+    vec4 wn = mulMV(u.modelIT, vec4(mesh.normals[v], 0.0f));
+    out->worldPos = vec3(world.x, world.y, world.z);
+    out->worldNormal = normalize(vec3(wn.x, wn.y, wn.z));
+}
+
+// Assembles and culls one triangle from transformed vertices. A culled
+// triangle gets an empty rect.
+__host__ __device__ void setupTriangle(const TransformedVertex* verts, const Triangle* triangles,
+                                       int t, TriRaster* r, TriShade* s, TileRect* rect) {
+    rect->x0 = rect->y0 = 0;
+    rect->x1 = rect->y1 = -1;
+
+    Triangle tri = triangles[t];
+    TransformedVertex v[3] = { verts[tri.v0], verts[tri.v1], verts[tri.v2] };
+
     // Near-plane culling
-    if (clip0.w < 0.1f || clip1.w < 0.1f || clip2.w < 0.1f) return;
-    
-    // Perspective divide -> NDC
-    float invW0 = 1.0f / clip0.w;
-    float invW1 = 1.0f / clip1.w;
-    float invW2 = 1.0f / clip2.w;
-    
-    vec3 ndc0 = vec3(clip0.x * invW0, clip0.y * invW0, clip0.z * invW0);
-    vec3 ndc1 = vec3(clip1.x * invW1, clip1.y * invW1, clip1.z * invW1);
-    vec3 ndc2 = vec3(clip2.x * invW2, clip2.y * invW2, clip2.z * invW2);
-    
-    // NDC to screen coordinates
-    float sx0 = (ndc0.x + 1.0f) * 0.5f * WIDTH;
-    float sy0 = (1.0f - ndc0.y) * 0.5f * HEIGHT;
-    float sz0 = (ndc0.z + 1.0f) * 0.5f;
-    
-    float sx1 = (ndc1.x + 1.0f) * 0.5f * WIDTH;
-    float sy1 = (1.0f - ndc1.y) * 0.5f * HEIGHT;
-    float sz1 = (ndc1.z + 1.0f) * 0.5f;
-    
-    float sx2 = (ndc2.x + 1.0f) * 0.5f * WIDTH;
-    float sy2 = (1.0f - ndc2.y) * 0.5f * HEIGHT;
-    float sz2 = (ndc2.z + 1.0f) * 0.5f;
-    
-    // Bounding box
-    int minX = max(0, (int)floorf(fminf(sx0, fminf(sx1, sx2))));
-    int maxX = min(WIDTH - 1, (int)ceilf(fmaxf(sx0, fmaxf(sx1, sx2))));
-    int minY = max(0, (int)floorf(fminf(sy0, fminf(sy1, sy2))));
-    int maxY = min(HEIGHT - 1, (int)ceilf(fmaxf(sy0, fmaxf(sy1, sy2))));
-    
-    float area = edgeFunction(sx0, sy0, sx1, sy1, sx2, sy2);
+    if (v[0].clipW < 0.1f || v[1].clipW < 0.1f || v[2].clipW < 0.1f) return;
+    for (int k = 0; k < 3; k++) {
+        r->sx[k] = v[k].sx;
+        r->sy[k] = v[k].sy;
+        r->sz[k] = v[k].sz;
+    }
+
+    float area = edgeFunction(r->sx[0], r->sy[0], r->sx[1], r->sy[1], r->sx[2], r->sy[2]);
     if (fabsf(area) < 0.001f) return;
     if (area < 0) return;  // Back-face culling
-    
-    float invArea = 1.0f / area;
-    
-    // World-space positions for lighting
-    vec4 world0 = mulMV(d_model, vec4(v0, 1.0f));
-    vec4 world1 = mulMV(d_model, vec4(v1, 1.0f));
-    vec4 world2 = mulMV(d_model, vec4(v2, 1.0f));
-    vec3 wp0 = vec3(world0.x, world0.y, world0.z);
-    vec3 wp1 = vec3(world1.x, world1.y, world1.z);
-    vec3 wp2 = vec3(world2.x, world2.y, world2.z);
-    
-    // Transform normals
-    vec4 wn0 = mulMV(d_modelIT, vec4(n0, 0.0f));
-    vec4 wn1 = mulMV(d_modelIT, vec4(n1, 0.0f));
-    vec4 wn2 = mulMV(d_modelIT, vec4(n2, 0.0f));
-    vec3 worldN0 = normalize(vec3(wn0.x, wn0.y, wn0.z));
-    vec3 worldN1 = normalize(vec3(wn1.x, wn1.y, wn1.z));
-    vec3 worldN2 = normalize(vec3(wn2.x, wn2.y, wn2.z));
-    
+    r->invArea = 1.0f / area;
+
+    // Bounding box
+    int minX = (int)floorf(fminf(r->sx[0], fminf(r->sx[1], r->sx[2])));
+    int maxX = (int)ceilf(fmaxf(r->sx[0], fmaxf(r->sx[1], r->sx[2])));
+    int minY = (int)floorf(fminf(r->sy[0], fminf(r->sy[1], r->sy[2])));
+    int maxY = (int)ceilf(fmaxf(r->sy[0], fmaxf(r->sy[1], r->sy[2])));
+    minX = minX > 0 ? minX : 0;
+    minY = minY > 0 ? minY : 0;
+    maxX = maxX < WIDTH - 1 ? maxX : WIDTH - 1;
+    maxY = maxY < HEIGHT - 1 ? maxY : HEIGHT - 1;
+    if (minX > maxX || minY > maxY) return;
+
+    for (int k = 0; k < 3; k++) {
+        s->worldPos[k] = v[k].worldPos;
+        s->worldNormal[k] = v[k].worldNormal;
+        s->invW[k] = v[k].invW;
+    }
+
+    rect->x0 = minX / TILE;
+    rect->y0 = minY / TILE;
+    rect->x1 = maxX / TILE;
+    rect->y1 = maxY / TILE;
+}
+
+// Whether the triangle can cover a pixel of tile (tx, ty). Edge functions
+// are linear, so one that is negative at all four corners of the tile is
+// negative at every pixel centre inside it.
+__host__ __device__ int touchesTile(const TriRaster& r, int tx, int ty) {
+    float x0 = (float)(tx * TILE), y0 = (float)(ty * TILE);
+    float x1 = x0 + TILE, y1 = y0 + TILE;
+    for (int e = 0; e < 3; e++) {
+        int a = (e + 1) % 3, b = (e + 2) % 3;
+        if (edgeFunction(r.sx[a], r.sy[a], r.sx[b], r.sy[b], x0, y0) < 0 &&
+            edgeFunction(r.sx[a], r.sy[a], r.sx[b], r.sy[b], x1, y0) < 0 &&
+            edgeFunction(r.sx[a], r.sy[a], r.sx[b], r.sy[b], x0, y1) < 0 &&
+            edgeFunction(r.sx[a], r.sy[a], r.sx[b], r.sy[b], x1, y1) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Barycentric weights and depth of pixel centre (x, y); returns whether
+// the pixel is inside the triangle
+__host__ __device__ int coverPixel(const TriRaster& r, float x, float y,
+                                   float* w0, float* w1, float* w2, float* z) {
+    *w0 = edgeFunction(r.sx[1], r.sy[1], r.sx[2], r.sy[2], x, y) * r.invArea;
+    *w1 = edgeFunction(r.sx[2], r.sy[2], r.sx[0], r.sy[0], x, y) * r.invArea;
+    *w2 = edgeFunction(r.sx[0], r.sy[0], r.sx[1], r.sy[1], x, y) * r.invArea;
+    if (*w0 < 0 || *w1 < 0 || *w2 < 0) return 0;
+    *z = r.sz[0] * *w0 + r.sz[1] * *w1 + r.sz[2] * *w2;
+    return 1;
+}
+
+// Depth test: nearer wins, and equal depths go to the lower index
+__host__ __device__ inline int depthWins(float z, int id, float depth, int winner) {
+    return z < depth || (z == depth && id < winner);
+}
+
+__host__ __device__ void backgroundPixel(unsigned char* out, int py) {
+    float t = (float)py / HEIGHT;
+    unsigned char bg = (unsigned char)(20 + t * 30);
+    out[0] = bg;
+    out[1] = bg;
+    out[2] = bg + 10;
+    out[3] = 255;
+}
+
+// Blinn-Phong shading of pixel (px, py) as covered by one triangle
+__host__ __device__ void shadePixel(unsigned char* out, const TriRaster& r, const TriShade& s,
+                                    const FrameUniforms& u, int px, int py) {
+    float w0, w1, w2, z;
+    coverPixel(r, px + 0.5f, py + 0.5f, &w0, &w1, &w2, &z);
+
+    // Perspective-correct interpolation
+    float oneOverW = w0 * s.invW[0] + w1 * s.invW[1] + w2 * s.invW[2];
+    float corrW0 = w0 * s.invW[0] / oneOverW;
+    float corrW1 = w1 * s.invW[1] / oneOverW;
+    float corrW2 = w2 * s.invW[2] / oneOverW;
+
+    // Interpolate world position and normal
+    vec3 worldPos = s.worldPos[0] * corrW0 + s.worldPos[1] * corrW1 + s.worldPos[2] * corrW2;
+    vec3 normal = normalize(s.worldNormal[0] * corrW0 + s.worldNormal[1] * corrW1 +
+                            s.worldNormal[2] * corrW2);
+
     // Material properties (copper)
     vec3 ambient = vec3(0.05f, 0.03f, 0.02f);
     vec3 diffuseColor = vec3(0.7f, 0.4f, 0.2f);
     vec3 specularColor = vec3(1.0f, 0.9f, 0.8f);
     float shininess = 32.0f;
     vec3 lightColor = vec3(1.0f, 0.95f, 0.9f);
-    
-    vec3 lightP = vec3(d_lightPos[0], d_lightPos[1], d_lightPos[2]);
-    vec3 viewP = vec3(d_viewPos[0], d_viewPos[1], d_viewPos[2]);
-    
-    // Rasterize
-    for (int py = minY; py <= maxY; py++) {
-        for (int px = minX; px <= maxX; px++) {
-            float x = px + 0.5f;
-            float y = py + 0.5f;
-            
-            float w0 = edgeFunction(sx1, sy1, sx2, sy2, x, y) * invArea;
-            float w1 = edgeFunction(sx2, sy2, sx0, sy0, x, y) * invArea;
-            float w2 = edgeFunction(sx0, sy0, sx1, sy1, x, y) * invArea;
-            
-            if (w0 < 0 || w1 < 0 || w2 < 0) continue;
-            
-            // Perspective-correct interpolation
-            float oneOverW = w0 * invW0 + w1 * invW1 + w2 * invW2;
-            float corrW0 = w0 * invW0 / oneOverW;
-            float corrW1 = w1 * invW1 / oneOverW;
-            float corrW2 = w2 * invW2 / oneOverW;
-            
-            float z = sz0 * w0 + sz1 * w1 + sz2 * w2;
-            
-            int pixelIdx = py * WIDTH + px;
-            
-            // Depth test with atomic CAS
-            float oldDepth = depth[pixelIdx];
-            if (z >= oldDepth) continue;
-            
-            unsigned int assumed, old;
-            do {
-                assumed = __float_as_uint(oldDepth);
-                old = atomicCAS((unsigned int*)&depth[pixelIdx], assumed, __float_as_uint(z));
-                oldDepth = __uint_as_float(old);
-            } while (oldDepth > z && old != assumed);
-            
-            if (oldDepth <= z) continue;
-            
-            // Interpolate world position and normal
-            vec3 worldPos = wp0 * corrW0 + wp1 * corrW1 + wp2 * corrW2;
-            vec3 normal = normalize(worldN0 * corrW0 + worldN1 * corrW1 + worldN2 * corrW2);
-            
-            // ====== PHONG SHADING ======
-            vec3 L = normalize(lightP - worldPos);
-            vec3 V = normalize(viewP - worldPos);
-            
-            // Diffuse
-            float NdotL = fmaxf(dot(normal, L), 0.0f);
-            vec3 diffuse = diffuseColor * lightColor * NdotL;
-            
-            // Specular (Blinn-Phong)
-            vec3 H = normalize(L + V);
-            float NdotH = fmaxf(dot(normal, H), 0.0f);
-            float spec = powf(NdotH, shininess);
-            vec3 specular = specularColor * lightColor * spec;
-            
-            vec3 color = ambient + diffuse + specular * 0.5f;
-            
-            // Tone mapping and gamma
-            color.x = powf(color.x / (color.x + 1.0f), 0.45f);
-            color.y = powf(color.y / (color.y + 1.0f), 0.45f);
-            color.z = powf(color.z / (color.z + 1.0f), 0.45f);
-            
-            int outIdx = pixelIdx * 4;
-            pixels[outIdx + 0] = (unsigned char)(fminf(color.z * 255.0f, 255.0f));
-            pixels[outIdx + 1] = (unsigned char)(fminf(color.y * 255.0f, 255.0f));
-            pixels[outIdx + 2] = (unsigned char)(fminf(color.x * 255.0f, 255.0f));
-            pixels[outIdx + 3] = 255;
+
+    // ====== PHONG SHADING ======
+    vec3 L = normalize(u.lightPos - worldPos);
+    vec3 V = normalize(u.viewPos - worldPos);
+
+    // Diffuse
+    float NdotL = fmaxf(dot(normal, L), 0.0f);
+    vec3 diffuse = diffuseColor * lightColor * NdotL;
+
+    // Specular (Blinn-Phong)
+    vec3 H = normalize(L + V);
+    float NdotH = fmaxf(dot(normal, H), 0.0f);
+    float spec = powf(NdotH, shininess);
+    vec3 specular = specularColor * lightColor * spec;
+
+    vec3 color = ambient + diffuse + specular * 0.5f;
+
+    // Tone mapping and gamma
+    color.x = powf(color.x / (color.x + 1.0f), 0.45f);
+    color.y = powf(color.y / (color.y + 1.0f), 0.45f);
+    color.z = powf(color.z / (color.z + 1.0f), 0.45f);
+
+    out[0] = (unsigned char)(fminf(color.z * 255.0f, 255.0f));
+    out[1] = (unsigned char)(fminf(color.y * 255.0f, 255.0f));
+    out[2] = (unsigned char)(fminf(color.x * 255.0f, 255.0f));
+    out[3] = 255;
+}
+
+#ifndef CPU_ONLY
+// ============== Binning Kernels ==============
+
+__global__ void vertexKernel(Mesh mesh, FrameUniforms u, TransformedVertex* verts) {
+    int v = blockIdx.x * blockDim.x + threadIdx.x;
+    if (v >= mesh.numVertices) return;
+    transformVertex(mesh, v, u, &verts[v]);
+}
+
+__global__ void setupKernel(Mesh mesh, TileBins bins) {
+    int t = blockIdx.x * blockDim.x + threadIdx.x;
+    if (t >= mesh.numTriangles) return;
+
+    TileRect rect;
+    setupTriangle(bins.verts, mesh.triangles, t, &bins.raster[t], &bins.shade[t], &rect);
+    bins.rect[t] = rect;
+    TriRaster r = bins.raster[t];
+    for (int ty = rect.y0; ty <= rect.y1; ty++) {
+        for (int tx = rect.x0; tx <= rect.x1; tx++) {
+            if (touchesTile(r, tx, ty)) atomicAdd(&bins.tileCount[ty * TILES_X + tx], 1);
         }
     }
 }
 
+// Exclusive prefix sum of the tile counts in one block: each thread sums a
+// short run, the run totals are scanned in shared memory, then each thread
+// writes its run's offsets
+__global__ void scanTileCounts(int* tileStart, const int* tileCount) {
+    __shared__ int partial[SCAN_THREADS];
+    int t = threadIdx.x;
+    int per = (NUM_TILES + SCAN_THREADS - 1) / SCAN_THREADS;
+    int begin = t * per;
+    int end = min(begin + per, NUM_TILES);
+
+    int sum = 0;
+    for (int i = begin; i < end; i++) sum += tileCount[i];
+    partial[t] = sum;
+    __syncthreads();
+    for (int offset = 1; offset < SCAN_THREADS; offset <<= 1) {
+        int v = t >= offset ? partial[t - offset] : 0;
+        __syncthreads();
+        partial[t] += v;
+        __syncthreads();
+    }
+
+    int running = partial[t] - sum;
+    for (int i = begin; i < end; i++) {
+        tileStart[i] = running;
+        running += tileCount[i];
+    }
+    if (t == SCAN_THREADS - 1) tileStart[NUM_TILES] = partial[t];
+}
+
+__global__ void binKernel(int numTriangles, TileBins bins) {
+    int t = blockIdx.x * blockDim.x + threadIdx.x;
+    if (t >= numTriangles) return;
+
+    TileRect rect = bins.rect[t];
+    TriRaster r = bins.raster[t];
+    for (int ty = rect.y0; ty <= rect.y1; ty++) {
+        for (int tx = rect.x0; tx <= rect.x1; tx++) {
+            if (!touchesTile(r, tx, ty)) continue;
+            int tile = ty * TILES_X + tx;
+            int slot = atomicAdd(&bins.tileFill[tile], 1);
+            bins.tileTris[bins.tileStart[tile] + slot] = t;
+        }
+    }
+}
+
+// ============== Tile Rasterization Kernel ==============
+
+__global__ void rasterizeTiles(TileBins bins, FrameUniforms u, unsigned char* pixels) {
+    __shared__ TriRaster batch[TILE * TILE];
+    __shared__ int batchId[TILE * TILE];
+
+    int tile = blockIdx.x;
+    int t = threadIdx.x;
+    int px = (tile % TILES_X) * TILE + t % TILE;
+    int py = (tile / TILES_X) * TILE + t / TILE;
+    float x = px + 0.5f, y = py + 0.5f;
+
+    float depth = 1.0f;
+    int winner = -1;
+    int start = bins.tileStart[tile], end = bins.tileStart[tile + 1];
+    for (int base = start; base < end; base += TILE * TILE) {
+        int n = min(TILE * TILE, end - base);
+        if (t < n) {
+            int id = bins.tileTris[base + t];
+            batchId[t] = id;
+            batch[t] = bins.raster[id];
+        }
+        __syncthreads();
+
+        for (int k = 0; k < n; k++) {
+            float w0, w1, w2, z;
+            if (coverPixel(batch[k], x, y, &w0, &w1, &w2, &z) &&
+                depthWins(z, batchId[k], depth, winner)) {
+                depth = z;
+                winner = batchId[k];
+            }
+        }
+        __syncthreads();
+    }
+
+    if (px >= WIDTH || py >= HEIGHT) return;
+    unsigned char* out = &pixels[(py * WIDTH + px) * 4];
+    if (winner < 0) {
+        backgroundPixel(out, py);
+    } else {
+        shadePixel(out, bins.raster[winner], bins.shade[winner], u, px, py);
+    }
+}
+#endif
+
+// ============== Binning (Host Side) ==============
+
+void binsAlloc(TileBins* b, const Mesh* mesh, int onDevice) {
+    int numTriangles = mesh->numTriangles;
+    b->onDevice = onDevice;
+    b->capacity = numTriangles * 4;
+#ifndef CPU_ONLY
+    if (onDevice) {
+        cudaMalloc(&b->verts, mesh->numVertices * sizeof(TransformedVertex));
+        cudaMalloc(&b->raster, numTriangles * sizeof(TriRaster));
+        cudaMalloc(&b->shade, numTriangles * sizeof(TriShade));
+        cudaMalloc(&b->rect, numTriangles * sizeof(TileRect));
+        cudaMalloc(&b->tileCount, NUM_TILES * sizeof(int));
+        cudaMalloc(&b->tileStart, (NUM_TILES + 1) * sizeof(int));
+        cudaMalloc(&b->tileFill, NUM_TILES * sizeof(int));
+        cudaMalloc(&b->tileTris, b->capacity * sizeof(int));
+        return;
+    }
+#endif
+    b->verts = (TransformedVertex*)malloc(mesh->numVertices * sizeof(TransformedVertex));
+    b->raster = (TriRaster*)malloc(numTriangles * sizeof(TriRaster));
+    b->shade = (TriShade*)malloc(numTriangles * sizeof(TriShade));
+    b->rect = (TileRect*)malloc(numTriangles * sizeof(TileRect));
+    b->tileCount = (int*)malloc(NUM_TILES * sizeof(int));
+    b->tileStart = (int*)malloc((NUM_TILES + 1) * sizeof(int));
+    b->tileFill = (int*)malloc(NUM_TILES * sizeof(int));
+    b->tileTris = (int*)malloc(b->capacity * sizeof(int));
+}
+
+void binsFree(TileBins* b) {
+    void* all[] = { b->verts, b->raster, b->shade, b->rect, b->tileCount, b->tileStart, b->tileFill,
+                    b->tileTris };
+    for (int i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++) {
+#ifndef CPU_ONLY
+        if (b->onDevice) {
+            cudaFree(all[i]);
+            continue;
+        }
+#endif
+        free(all[i]);
+    }
+}
+
+// Runs the vertex, setup, scan and bin passes; returns the number of (tile, triangle) pairs.
+// On the device this waits for the setup pass to learn the total.
+int binTriangles(TileBins* b, const Mesh* mesh, const FrameUniforms* u) {
+    int total;
+#ifndef CPU_ONLY
+    if (b->onDevice) {
+        int blocks = (mesh->numTriangles + 127) / 128;
+        cudaMemset(b->tileCount, 0, NUM_TILES * sizeof(int));
+        cudaMemset(b->tileFill, 0, NUM_TILES * sizeof(int));
+        vertexKernel<<<(mesh->numVertices + 127) / 128, 128>>>(*mesh, *u, b->verts);
+        setupKernel<<<blocks, 128>>>(*mesh, *b);
+        scanTileCounts<<<1, SCAN_THREADS>>>(b->tileStart, b->tileCount);
+        cudaMemcpy(&total, b->tileStart + NUM_TILES, sizeof(int), cudaMemcpyDeviceToHost);
+        if (total > b->capacity) {
+            cudaFree(b->tileTris);
+            b->capacity = total + total / 2;
+            cudaMalloc(&b->tileTris, b->capacity * sizeof(int));
+        }
+        binKernel<<<blocks, 128>>>(mesh->numTriangles, *b);
+        return total;
+    }
+#endif
+    for (int v = 0; v < mesh->numVertices; v++) transformVertex(*mesh, v, *u, &b->verts[v]);
+    memset(b->tileCount, 0, NUM_TILES * sizeof(int));
+    for (int t = 0; t < mesh->numTriangles; t++) {
+        TileRect* rect = &b->rect[t];
+        setupTriangle(b->verts, mesh->triangles, t, &b->raster[t], &b->shade[t], rect);
+        for (int ty = rect->y0; ty <= rect->y1; ty++) {
+            for (int tx = rect->x0; tx <= rect->x1; tx++) {
+                if (touchesTile(b->raster[t], tx, ty)) b->tileCount[ty * TILES_X + tx]++;
+            }
+        }
+    }
+    total = 0;
+    for (int i = 0; i < NUM_TILES; i++) {
+        b->tileStart[i] = total;
+        total += b->tileCount[i];
+    }
+    b->tileStart[NUM_TILES] = total;
+    if (total > b->capacity) {
+        free(b->tileTris);
+        b->capacity = total + total / 2;
+        b->tileTris = (int*)malloc(b->capacity * sizeof(int));
+    }
+    memset(b->tileFill, 0, NUM_TILES * sizeof(int));
+    for (int t = 0; t < mesh->numTriangles; t++) {
+        const TileRect* rect = &b->rect[t];
+        for (int ty = rect->y0; ty <= rect->y1; ty++) {
+            for (int tx = rect->x0; tx <= rect->x1; tx++) {
+                if (!touchesTile(b->raster[t], tx, ty)) continue;
+                int tile = ty * TILES_X + tx;
+                b->tileTris[b->tileStart[tile] + b->tileFill[tile]++] = t;
+            }
+        }
+    }
+    return total;
+}
+
+// Host counterpart of rasterizeTiles: threads take whole tiles from a
+// shared counter and keep the tile's depth and winners on the stack
+struct HostRasterJob {
+    const TileBins* bins;
+    const FrameUniforms* uniforms;
+    unsigned char* pixels;
+    int nextTile;               // Work queue, advanced atomically
+};
+
+static void rasterizeTileHost(const HostRasterJob* job, int tile) {
+    const TileBins* b = job->bins;
+    int x0 = (tile % TILES_X) * TILE, y0 = (tile / TILES_X) * TILE;
+    int x1 = x0 + TILE < WIDTH ? x0 + TILE : WIDTH;
+    int y1 = y0 + TILE < HEIGHT ? y0 + TILE : HEIGHT;
+    float depth[TILE * TILE];
+    int winner[TILE * TILE];
+    for (int i = 0; i < TILE * TILE; i++) {
+        depth[i] = 1.0f;
+        winner[i] = -1;
+    }
+
+    for (int k = b->tileStart[tile]; k < b->tileStart[tile + 1]; k++) {
+        int id = b->tileTris[k];
+        const TriRaster& r = b->raster[id];
+
+        // Only the pixels under the triangle's bounding box
+        int minX = (int)floorf(fminf(r.sx[0], fminf(r.sx[1], r.sx[2])));
+        int maxX = (int)ceilf(fmaxf(r.sx[0], fmaxf(r.sx[1], r.sx[2])));
+        int minY = (int)floorf(fminf(r.sy[0], fminf(r.sy[1], r.sy[2])));
+        int maxY = (int)ceilf(fmaxf(r.sy[0], fmaxf(r.sy[1], r.sy[2])));
+        minX = minX > x0 ? minX : x0;
+        minY = minY > y0 ? minY : y0;
+        maxX = maxX < x1 - 1 ? maxX : x1 - 1;
+        maxY = maxY < y1 - 1 ? maxY : y1 - 1;
+        for (int py = minY; py <= maxY; py++) {
+            for (int px = minX; px <= maxX; px++) {
+                float w0, w1, w2, z;
+                int i = (py - y0) * TILE + (px - x0);
+                if (coverPixel(r, px + 0.5f, py + 0.5f, &w0, &w1, &w2, &z) &&
+                    depthWins(z, id, depth[i], winner[i])) {
+                    depth[i] = z;
+                    winner[i] = id;
+                }
+            }
+        }
+    }
+
+    for (int py = y0; py < y1; py++) {
+        for (int px = x0; px < x1; px++) {
+            unsigned char* out = &job->pixels[(py * WIDTH + px) * 4];
+            int w = winner[(py - y0) * TILE + (px - x0)];
+            if (w < 0) {
+                backgroundPixel(out, py);
+            } else {
+                shadePixel(out, b->raster[w], b->shade[w], *job->uniforms, px, py);
+            }
+        }
+    }
+}
+
+static void* hostRasterWorker(void* arg) {
+    HostRasterJob* job = (HostRasterJob*)arg;
+    for (;;) {
+        int tile = __atomic_fetch_add(&job->nextTile, 1, __ATOMIC_RELAXED);
+        if (tile >= NUM_TILES) break;
+        rasterizeTileHost(job, tile);
+    }
+    return NULL;
+}
+
+// Rasterizes and shades the binned triangles into pixels (device memory
+// for device bins)
+void rasterizeBins(unsigned char* pixels, const TileBins* b, const FrameUniforms* u) {
+#ifndef CPU_ONLY
+    if (b->onDevice) {
+        rasterizeTiles<<<NUM_TILES, TILE * TILE>>>(*b, *u, pixels);
+        return;
+    }
+#endif
+    HostRasterJob job = { b, u, pixels, 0 };
+    int numThreads = hostThreadCount();
+    hostRunThreads(hostRasterWorker, &job, numThreads);
+}
+
 // ============== OBJ Loader ==============
 
 void loadOBJ(const char* filename, 
@@ -402,33 +772,193 @@ void normalizeMesh(vec3* vertices, int numVertices) {
 
 // ============== Main ==============
 
-int main() {
+double getTime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void binsSync(const TileBins* b) {
+#ifndef CPU_ONLY
+    if (b->onDevice) cudaDeviceSynchronize();
+#else
+    (void)b;
+#endif
+}
+
+// Builds the frame's matrices, light and eye position
+void frameUniforms(FrameUniforms* u, float angle, float lightAngle, float lightHeight,
+                   float camDist) {
+    float view[16], proj[16], temp[16];
+    rotateY(u->model, angle);
+
+    vec3 eye = vec3(cosf(0.3f) * camDist, 1.5f, sinf(0.3f) * camDist);
+    vec3 center = vec3(0, 0, 0);
+    vec3 up = vec3(0, 1, 0);
+    lookAt(view, eye, center, up);
+
+    perspective(proj, 45.0f * 3.14159f / 180.0f, (float)WIDTH / HEIGHT, 0.1f, 100.0f);
+
+    mulMM(temp, view, u->model);
+    mulMM(u->mvp, proj, temp);
+    memcpy(u->modelIT, u->model, sizeof(u->model));  // Same for uniform scale
+
+    u->lightPos = vec3(cosf(lightAngle) * 5.0f, lightHeight, sinf(lightAngle) * 5.0f);
+    u->viewPos = eye;
+}
+
+#ifndef CPU_ONLY
+void meshUpload(Mesh* d, const Mesh* h) {
+    *d = *h;
+    cudaMalloc(&d->vertices, h->numVertices * sizeof(vec3));
+    cudaMalloc(&d->normals, h->numVertices * sizeof(vec3));
+    cudaMalloc(&d->triangles, h->numTriangles * sizeof(Triangle));
+    cudaMemcpy(d->vertices, h->vertices, h->numVertices * sizeof(vec3), cudaMemcpyHostToDevice);
+    cudaMemcpy(d->normals, h->normals, h->numVertices * sizeof(vec3), cudaMemcpyHostToDevice);
+    cudaMemcpy(d->triangles, h->triangles, h->numTriangles * sizeof(Triangle),
+               cudaMemcpyHostToDevice);
+}
+
+void meshFree(Mesh* d) {
+    cudaFree(d->vertices);
+    cudaFree(d->normals);
+    cudaFree(d->triangles);
+}
+#endif
+
+// Renders the same orbit on each backend, timing the geometry passes
+// (vertex, setup, scan, bin) and the raster pass separately, then compares the last frames
+int teapotBenchmark(int frames, const Mesh* h_mesh) {
+    if (frames < 1 || frames > 10000) {
+        fprintf(stderr, "Frame count must be 1-10000\n");
+        return 1;
+    }
+#ifndef CPU_ONLY
+    int backends = 2;
+    Mesh d_mesh;
+    meshUpload(&d_mesh, h_mesh);
+    unsigned char* d_pixels;
+    cudaMalloc(&d_pixels, WIDTH * HEIGHT * 4);
+#else
+    int backends = 1;
+#endif
+    unsigned char* images[2];
+    images[0] = (unsigned char*)malloc(WIDTH * HEIGHT * 4);
+    images[1] = (unsigned char*)malloc(WIDTH * HEIGHT * 4);
+
+    printf("Binned rasterizer, %d vertices, %d triangles, %d %dx%d tiles, %d host threads:\n",
+           h_mesh->numVertices, h_mesh->numTriangles, NUM_TILES, TILE, TILE, hostThreadCount());
+    printf("  backend   geometry ms   raster ms   frame ms   tile pairs/frame\n");
+    for (int k = 0; k < backends; k++) {
+        int onDevice = backends == 2 && k == 0;
+        const Mesh* mesh = h_mesh;
+        unsigned char* pixels = images[k];
+#ifndef CPU_ONLY
+        if (onDevice) {
+            mesh = &d_mesh;
+            pixels = d_pixels;
+        }
+#endif
+        TileBins bins;
+        binsAlloc(&bins, h_mesh, onDevice);
+        FrameUniforms u;
+
+        double binTime = 0.0, rasterTime = 0.0;
+        long pairs = 0;
+        for (int i = -1; i < frames; i++) {
+            frameUniforms(&u, 0.05f * (i < 0 ? 0 : i), 0.0f, 3.0f, 4.0f);
+            double t0 = getTime();
+            int n = binTriangles(&bins, mesh, &u);
+            binsSync(&bins);
+            double t1 = getTime();
+            rasterizeBins(pixels, &bins, &u);
+            binsSync(&bins);
+            if (i < 0) continue;       // Warm-up frame
+            binTime += t1 - t0;
+            rasterTime += getTime() - t1;
+            pairs += n;
+        }
+#ifndef CPU_ONLY
+        if (onDevice) cudaMemcpy(images[k], d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
+#endif
+        printf("  %-7s %13.2f %11.2f %10.2f %18ld\n", onDevice ? "GPU" : "host",
+               1000.0 * binTime / frames, 1000.0 * rasterTime / frames,
+               1000.0 * (binTime + rasterTime) / frames, pairs / frames);
+        binsFree(&bins);
+    }
+    if (backends == 2) {
+        int mismatched = 0, worst = 0;
+        for (int i = 0; i < WIDTH * HEIGHT; i++) {
+            int diff = 0;
+            for (int c = 0; c < 3; c++) {
+                int d = abs(images[0][i * 4 + c] - images[1][i * 4 + c]);
+                diff = d > diff ? d : diff;
+            }
+            mismatched += diff > 0;
+            worst = diff > worst ? diff : worst;
+        }
+        printf("  GPU/host last frame: %d pixels differ, max difference %d\n", mismatched, worst);
+    }
+
+#ifndef CPU_ONLY
+    cudaFree(d_pixels);
+    meshFree(&d_mesh);
+#endif
+    free(images[0]);
+    free(images[1]);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+#ifndef CPU_ONLY
+    int useHost = 0;
+#else
+    int useHost = 1;
+#endif
+    int benchFrames = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0) {
+            useHost = 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchFrames = atoi(argv[++i]);
+            if (benchFrames < 1) benchFrames = -1;
+        } else {
+            fprintf(stderr, "Usage: %s [--cpu] | --bench FRAMES\n", argv[0]);
+            return 1;
+        }
+    }
+
     printf("=== Utah Teapot - CUDA Software Rasterizer ===\n");
-    printf("100%% CUDA: Transform -> Rasterize -> Phong Shading\n");
+    printf("100%% CUDA: Transform -> Bin -> Rasterize -> Phong Shading\n");
     printf("Resolution: %dx%d\n\n", WIDTH, HEIGHT);
     
-    vec3* h_vertices = (vec3*)malloc(MAX_VERTICES * sizeof(vec3));
-    vec3* h_normals = (vec3*)malloc(MAX_VERTICES * sizeof(vec3));
-    Triangle* h_triangles = (Triangle*)malloc(MAX_TRIANGLES * sizeof(Triangle));
-    int numVertices, numTriangles;
+    Mesh h_mesh;
+    h_mesh.vertices = (vec3*)malloc(MAX_VERTICES * sizeof(vec3));
+    h_mesh.normals = (vec3*)malloc(MAX_VERTICES * sizeof(vec3));
+    h_mesh.triangles = (Triangle*)malloc(MAX_TRIANGLES * sizeof(Triangle));
     
-    loadOBJ("teapot.obj", h_vertices, &numVertices, h_triangles, &numTriangles, h_normals);
-    normalizeMesh(h_vertices, numVertices);
+    loadOBJ("teapot.obj", h_mesh.vertices, &h_mesh.numVertices, h_mesh.triangles,
+            &h_mesh.numTriangles, h_mesh.normals);
+    normalizeMesh(h_mesh.vertices, h_mesh.numVertices);
+
+    if (benchFrames != 0) {
+        int status = teapotBenchmark(benchFrames, &h_mesh);
+        free(h_mesh.vertices);
+        free(h_mesh.normals);
+        free(h_mesh.triangles);
+        return status;
+    }
     
-    vec3 *d_vertices, *d_normals;
-    Triangle* d_triangles;
+    TileBins hostBins;
+    binsAlloc(&hostBins, &h_mesh, 0);
+#ifndef CPU_ONLY
+    Mesh d_mesh;
+    meshUpload(&d_mesh, &h_mesh);
     unsigned char* d_pixels;
-    float* d_depth;
-    
-    cudaMalloc(&d_vertices, numVertices * sizeof(vec3));
-    cudaMalloc(&d_normals, numVertices * sizeof(vec3));
-    cudaMalloc(&d_triangles, numTriangles * sizeof(Triangle));
     cudaMalloc(&d_pixels, WIDTH * HEIGHT * 4);
-    cudaMalloc(&d_depth, WIDTH * HEIGHT * sizeof(float));
-    
-    cudaMemcpy(d_vertices, h_vertices, numVertices * sizeof(vec3), cudaMemcpyHostToDevice);
-    cudaMemcpy(d_normals, h_normals, numVertices * sizeof(vec3), cudaMemcpyHostToDevice);
-    cudaMemcpy(d_triangles, h_triangles, numTriangles * sizeof(Triangle), cudaMemcpyHostToDevice);
+    TileBins deviceBins;
+    binsAlloc(&deviceBins, &h_mesh, 1);
+#endif
     
     Display* display = XOpenDisplay(NULL);
     if (!display) {
@@ -465,7 +995,11 @@ int main() {
     printf("  Up/Down    - Change light height\n");
     printf("  W/S        - Zoom in/out\n");
     printf("  Space      - Toggle auto-rotate\n");
+#ifndef CPU_ONLY
+    printf("  H          - Toggle GPU / host rendering\n");
+#endif
     printf("  Q/ESC      - Quit\n\n");
+    printf("Rendering on the %s\n", useHost ? "host" : "GPU");
     
     float angle = 0.0f;
     float lightAngle = 0.0f;
@@ -474,8 +1008,9 @@ int main() {
     int autoRotate = 1;
     int running = 1;
     
-    float h_mvp[16], h_model[16], h_view[16], h_proj[16], h_temp[16];
-    float h_lightPos[3], h_viewPos[3];
+    FrameUniforms uniforms;
+    int frameCount = 0;
+    double lastTime = getTime();
     
     while (running) {
         while (XPending(display)) {
@@ -501,6 +1036,11 @@ int main() {
                 } else if (key == XK_space) {
                     autoRotate = !autoRotate;
                     printf("Auto-rotate: %s\n", autoRotate ? "ON" : "OFF");
+#ifndef CPU_ONLY
+                } else if (key == XK_h || key == XK_H) {
+                    useHost = !useHost;
+                    printf("Rendering on the %s\n", useHost ? "host" : "GPU");
+#endif
                 }
             }
         }
@@ -510,61 +1050,44 @@ int main() {
             lightAngle += 0.015f;
         }
         
-        // Build matrices
-        rotateY(h_model, angle);
+        frameUniforms(&uniforms, angle, lightAngle, lightHeight, camDist);
         
-        vec3 eye = vec3(cosf(0.3f) * camDist, 1.5f, sinf(0.3f) * camDist);
-        vec3 center = vec3(0, 0, 0);
-        vec3 up = vec3(0, 1, 0);
-        lookAt(h_view, eye, center, up);
-        
-        perspective(h_proj, 45.0f * 3.14159f / 180.0f, (float)WIDTH / HEIGHT, 0.1f, 100.0f);
-        
-        mulMM(h_temp, h_view, h_model);
-        mulMM(h_mvp, h_proj, h_temp);
-        
-        h_lightPos[0] = cosf(lightAngle) * 5.0f;
-        h_lightPos[1] = lightHeight;
-        h_lightPos[2] = sinf(lightAngle) * 5.0f;
-        
-        h_viewPos[0] = eye.x;
-        h_viewPos[1] = eye.y;
-        h_viewPos[2] = eye.z;
-        
-        cudaMemcpyToSymbol(d_mvp, h_mvp, sizeof(h_mvp));
-        cudaMemcpyToSymbol(d_model, h_model, sizeof(h_model));
-        cudaMemcpyToSymbol(d_modelIT, h_model, sizeof(h_model));  // Same for uniform scale
-        cudaMemcpyToSymbol(d_lightPos, h_lightPos, sizeof(h_lightPos));
-        cudaMemcpyToSymbol(d_viewPos, h_viewPos, sizeof(h_viewPos));
-        
-        clearFramebuffer<<<(WIDTH * HEIGHT + 255) / 256, 256>>>(d_pixels);
-        clearDepth<<<(WIDTH * HEIGHT + 255) / 256, 256>>>(d_depth);
-        
-        int threadsPerBlock = 64;
-        int blocks = (numTriangles + threadsPerBlock - 1) / threadsPerBlock;
-        rasterizeTriangles<<<blocks, threadsPerBlock>>>(
-            d_vertices, d_normals, d_triangles, numTriangles,
-            d_pixels, d_depth
-        );
-        
-        cudaDeviceSynchronize();
-        
-        cudaMemcpy(image->data, d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
+        int pairs;
+#ifndef CPU_ONLY
+        if (!useHost) {
+            pairs = binTriangles(&deviceBins, &d_mesh, &uniforms);
+            rasterizeBins(d_pixels, &deviceBins, &uniforms);
+            cudaMemcpy(image->data, d_pixels, WIDTH * HEIGHT * 4, cudaMemcpyDeviceToHost);
+        } else
+#endif
+        {
+            pairs = binTriangles(&hostBins, &h_mesh, &uniforms);
+            rasterizeBins((unsigned char*)image->data, &hostBins, &uniforms);
+        }
         XPutImage(display, window, gc, image, 0, 0, 0, 0, WIDTH, HEIGHT);
         XFlush(display);
         
+        frameCount++;
+        double now = getTime();
+        if (now - lastTime >= 1.0) {
+            printf("FPS: %.1f | %s | %d tile-triangle pairs\n", frameCount / (now - lastTime),
+                   useHost ? "host" : "GPU", pairs);
+            frameCount = 0;
+            lastTime = now;
+        }
+        
         usleep(16666);
     }
     
-    cudaFree(d_vertices);
-    cudaFree(d_normals);
-    cudaFree(d_triangles);
+#ifndef CPU_ONLY
+    binsFree(&deviceBins);
     cudaFree(d_pixels);
-    cudaFree(d_depth);
-    
-    free(h_vertices);
-    free(h_normals);
-    free(h_triangles);
+    meshFree(&d_mesh);
+#endif
+    binsFree(&hostBins);
+    free(h_mesh.vertices);
+    free(h_mesh.normals);
+    free(h_mesh.triangles);
     
     XDestroyImage(image);
     XFreeGC(display, gc);
@@ -0,0 +1,27 @@
+// Host worker threads shared by the demos' CPU paths
+
+#ifndef HOST_THREADS_H
+#define HOST_THREADS_H
+
+#include <unistd.h>
+#include <pthread.h>
+
+#define HOST_MAX_THREADS 64
+
+// Online cores, clamped to [1, HOST_MAX_THREADS]
+static inline int hostThreadCount() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > HOST_MAX_THREADS) n = HOST_MAX_THREADS;
+    return (int)n;
+}
+
+// Runs worker(arg) on numThreads threads and waits for all of them
+static inline void hostRunThreads(void* (*worker)(void*), void* arg, int numThreads) {
+    pthread_t threads[HOST_MAX_THREADS];
+    if (numThreads > HOST_MAX_THREADS) numThreads = HOST_MAX_THREADS;
+    for (int i = 0; i < numThreads; i++) pthread_create(&threads[i], NULL, worker, arg);
+    for (int i = 0; i < numThreads; i++) pthread_join(threads[i], NULL);
+}
+
+#endif